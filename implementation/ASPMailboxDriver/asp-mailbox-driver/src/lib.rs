@@ -18,37 +18,217 @@
 
 use cantrip_os_common::camkes::Camkes;
 use cantrip_os_common::sel4_sys;
-use log::info;
+use log::trace;
 
-// TODO(chrisphan): Use ringbuf crate instead.
-//use circular_buffer::Buffer;
-//use register::{bit, Field, Register};
+use asp_mailbox_ring::{
+    desc_buf, desc_frame, desc_off, desc_word, frag_chan, frag_header, frag_info, frag_words, DescPool, FragCollector, FrameParser,
+    MailboxRing, RegisterBank, CSR_BANK_ACK_MASK, CSR_BLOCK_BIT, DOORBELL_BIT, ENABLE_BIT, FRAG_BLOCK, FRAG_DESC,
+    FRAG_DONE, FRAG_FIRST, FRAG_LAST,
+    HEAD_NOTIFY_BIT, IR_TX_WAIT_BIT, MAX_BANKS, RXR_CONS, RXR_HDR_WORDS, RXR_PROD, VALID_MASK,
+};
+use core::sync::atomic::{fence, AtomicBool, AtomicUsize, Ordering};
 
-// Driver-owned circular buffer to receive more than the FIFO size before the
-// received data is consumed by rx_update.
-//static mut RX_BUFFER: Buffer = Buffer::new();
+// 每个接收区的消息寄存器数，其后依次为IR与CSR。寄存器布局、帧头与环形区的收发在asp-mailbox-ring中，
+// 这里只提供寄存器访问并实现发送策略
+const MAILBOX_MAX_REG_NUM: usize = 62;
+type Ring = MailboxRing<Mmio, MAILBOX_MAX_REG_NUM>;
 
-// Driver-owned circular buffer to buffer more transmitted bytes than can fit
-// in the transmit FIFO.
-//static mut TX_BUFFER: Buffer = Buffer::new();
+/// CAmkES映射的mailbox寄存器窗口。stable Rust没有volatile的批量拷贝，连续写入沿用逐个寄存器的默认实现
+struct Mmio;
 
-const ENABLE_BIT: u64 = (1 as u64) << 63;
-const VALID_MASK: u64 = 0x7fff_ffff_ffff_ffff;
+impl RegisterBank for Mmio {
+    #[inline]
+    fn read(&self, index: usize) -> u64 {
+        unsafe { mmio_region.add(index).read_volatile() }
+    }
 
-const RECEIVE_BASE_INDEX: isize = 64;//我们自己的接受区，只读
-const RECEIVE_CSR_INDEX: isize = 127;
-const RECEIVE_IR_INDEX: isize = 126;
+    #[inline]
+    fn write(&self, index: usize, val: u64) {
+        unsafe { mmio_region.add(index).write_volatile(val) }
+    }
+}
 
-const SEND_BASE_INDEX: isize = 0; //我们自己的发送区，可读写，即对方的接收区
-const SEND_CSR_INDEX: isize = 63;
-const SEND_IR_INDEX: isize = 62;
+static mut RING: Ring = Ring::new(Mmio);
+// 接收分片的解析状态，分片可以跨越多次中断
+static mut PARSER: FrameParser = FrameParser::new();
 
-const MAILBOX_MAX_REG_NUM: u64 = 62;
+#[inline]
+unsafe fn ring() -> &'static mut Ring {
+    &mut *core::ptr::addr_of_mut!(RING)
+}
 
 static mut CAMKES: Camkes = Camkes::new("ASPMailboxDriver");
 
+/// 数据通路统计，替代热路径上的逐次日志
+#[derive(Clone, Copy, Default, Debug)]
+pub struct MailboxStats {
+    pub rx_words: u64,
+    pub tx_words: u64,
+    pub doorbells_rx: u64,
+    pub doorbells_tx: u64,
+    pub tx_full_spins: u64,
+    pub rx_msgs: u64,
+    pub rx_aborts: u64,
+    pub tx_blocks: u64,
+    pub rx_blocks: u64,
+    pub tx_descs: u64,
+    pub tx_desc_done: u64,
+    pub rx_descs: u64,
+    pub rx_desc_bad: u64,
+    pub tx_echoed: u64,
+    pub rx_ring_words: u64,
+    pub rx_ring_stalls: u64,
+    pub rx_ring_desc_skips: u64,
+    pub rx_batches: u64,
+    pub tx_buf_queued: [u64; PRIO_NUM],
+    pub tx_buf_drained: [u64; PRIO_NUM],
+    pub tx_buf_would_block: [u64; PRIO_NUM],
+    pub tx_buf_waits: u64,
+    pub tx_buf_msgs: [u64; PRIO_NUM],
+    pub tx_buf_ahead_words: [u64; PRIO_NUM],
+}
+
+static mut STATS: MailboxStats = MailboxStats {
+    rx_words: 0,
+    tx_words: 0,
+    doorbells_rx: 0,
+    doorbells_tx: 0,
+    tx_full_spins: 0,
+    rx_msgs: 0,
+    rx_aborts: 0,
+    tx_blocks: 0,
+    rx_blocks: 0,
+    tx_descs: 0,
+    tx_desc_done: 0,
+    rx_descs: 0,
+    rx_desc_bad: 0,
+    tx_echoed: 0,
+    rx_ring_words: 0,
+    rx_ring_stalls: 0,
+    rx_ring_desc_skips: 0,
+    rx_batches: 0,
+    tx_buf_queued: [0; PRIO_NUM],
+    tx_buf_drained: [0; PRIO_NUM],
+    tx_buf_would_block: [0; PRIO_NUM],
+    tx_buf_waits: 0,
+    tx_buf_msgs: [0; PRIO_NUM],
+    tx_buf_ahead_words: [0; PRIO_NUM],
+};
+
+/// 返回当前统计信息的快照
+pub unsafe fn stats() -> MailboxStats { STATS }
+
+// 块模式：不小于BLOCK_THRESHOLD字节的消息按bank大小分片，每个分片单独写入并敲一次门铃，
+// 对方读完后以该bank的应答位回应。BLOCK_BANKS为1时为停等，多个bank时在对方读bank N的同时写bank N+1。
+// 自适应时比较两种模式每个寄存器平均的空转次数（ASP端没有时钟，以空转次数近似等待时间，x16定点），
+// 每32条消息试探一次另一种模式
+static mut BLOCK_THRESHOLD: usize = 512;
+static mut BLOCK_BANKS: usize = 2;
+static mut BLOCK_ADAPTIVE: bool = false;
+static mut BLOCK_SPINS_PER_WORD: u64 = 0;
+static mut FIFO_SPINS_PER_WORD: u64 = 0;
+static mut BLOCK_PROBE: u32 = 0;
+
+/// 设置块模式的消息大小阈值（0表示总是流式发送）、bank数（1为停等，至多4）与是否按观测到的等待时间自适应选择
+pub unsafe fn set_block_mode(threshold: usize, banks: usize, adaptive: bool) {
+    BLOCK_THRESHOLD = threshold;
+    BLOCK_BANKS = banks.clamp(1, MAX_BANKS);
+    BLOCK_ADAPTIVE = adaptive;
+}
+
+unsafe fn use_block_mode(len: usize) -> bool {
+    if BLOCK_THRESHOLD == 0 || len < BLOCK_THRESHOLD {
+        return false;
+    }
+    if !BLOCK_ADAPTIVE {
+        return true;
+    }
+    let block = BLOCK_SPINS_PER_WORD <= FIFO_SPINS_PER_WORD;
+    BLOCK_PROBE = BLOCK_PROBE.wrapping_add(1);
+    if BLOCK_PROBE % 32 == 0 { !block } else { block }
+}
+
+// 描述符模式：desc_pool与Linux端的保留区为同一块内存，两端的缓冲区大小必须一致。
+// 不小于DESC_THRESHOLD字节且放得下一个缓冲区的消息拷进A2C池后只发送描述符，没有空闲缓冲区时退回寄存器
+const DESC_POOL_SIZE: usize = 0x100000;
+const DESC_SLOT_SIZE: usize = 0x10000;
+const DESC_SLOTS: usize = DESC_POOL_SIZE / 2 / DESC_SLOT_SIZE;
+static DESC_POOL: DescPool = DescPool::new(DESC_SLOTS);
+static mut DESC_THRESHOLD: usize = 16384;
+
+// 收到的描述符在中断处理中交还，发送线程正在写寄存器环时留给它在写完后发出。
+// 队列的容量不小于Linux端的缓冲区数，只有中断处理写入
+const DONE_QUEUE_LEN: usize = 64;
+static mut DONE_QUEUE: [u64; DONE_QUEUE_LEN] = [0; DONE_QUEUE_LEN];
+static DONE_HEAD: AtomicUsize = AtomicUsize::new(0);
+static DONE_TAIL: AtomicUsize = AtomicUsize::new(0);
+// 发送线程与中断处理之间保证寄存器环中的分片不交错
+static TX_LOCK: AtomicBool = AtomicBool::new(false);
+
+/// 设置走描述符模式的消息大小阈值，0表示不使用
+pub unsafe fn set_desc_threshold(threshold: usize) {
+    DESC_THRESHOLD = threshold;
+}
+
+// 发送缓冲：send把整条消息组帧后放进TX_BUFFER立即返回，放不下时返回WouldBlock，调用线程不等Linux端。
+// 缓冲中的分片在对方接收区放得下整个分片时写出（与block_send、回显不会在分片中间交错），
+// send、每次中断处理与receive_batch都会尝试；写不完时在自己的IR中挂起TX_WAIT，
+// Linux端读走寄存器后以HEAD_NOTIFY门铃触发中断处理接着写。两个计数都不回绕，只有send写入、持发送锁时读出。
+// 每个优先级一个缓冲，每写一个分片都先看高优先级的缓冲，大消息在分片之间让出寄存器环；
+// 两个优先级的分片会交错，同一task的消息只能走同一个优先级
+pub const PRIO_NORMAL: usize = 0;
+pub const PRIO_HIGH: usize = 1;
+pub const PRIO_NUM: usize = 2;
+const TX_BUFFER_WORDS: usize = 16384;
+const TX_DATA_SIZE: usize = 0x10000;
+static mut TX_BUFFER: [[u64; TX_BUFFER_WORDS]; PRIO_NUM] = [[0; TX_BUFFER_WORDS]; PRIO_NUM];
+static TX_BUF_HEAD: [AtomicUsize; PRIO_NUM] = [AtomicUsize::new(0), AtomicUsize::new(0)];
+static TX_BUF_TAIL: [AtomicUsize; PRIO_NUM] = [AtomicUsize::new(0), AtomicUsize::new(0)];
+
+/// send失败的原因，数值即api_send的返回值
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(i32)]
+pub enum SendError {
+    /// 发送缓冲暂时放不下，等已排队的消息写出后重试
+    WouldBlock = 1,
+    /// 组帧后超过整个发送缓冲
+    TooLarge = 2,
+}
+
+// 回显：中断处理把收到的寄存器分片原样发回同一通道，Linux端按task重组后就是原来的消息，
+// 供user_test/mailbox_bench测量往返延迟。以echo特性编译时默认打开
+static ECHO: AtomicBool = AtomicBool::new(cfg!(feature = "echo"));
+static mut ECHO_COLLECTOR: FragCollector<MAILBOX_MAX_REG_NUM> = FragCollector::new();
+
+/// 打开或关闭回显，回显期间不应再调用block_send
+pub fn set_echo(enabled: bool) {
+    ECHO.store(enabled, Ordering::Relaxed);
+}
+
+// 接收环：rx_ring数据端口与客户端共享，布局见asp-mailbox-ring中的RXR_*。中断处理把寄存器模式的分片整片写入，
+// 客户端每次receive_batch取走一批寄存器，不必每条消息一次RPC。描述符消息从C2A池拷出，按寄存器模式的分片写入，
+// 客户端看到的与寄存器模式发来的消息相同，拷完后才交还缓冲区；回显时描述符消息归回显所有，不进入接收环。
+// 第一次调用receive_batch后启用，此前收到的分片读完即丢；接收环放不下时不再推进head，
+// Linux端在接收区满时等待，receive_batch腾出空间后接着读
+const RX_RING_SIZE: usize = 0x10000;
+const RX_RING_WORDS: usize = RX_RING_SIZE / 8 - RXR_HDR_WORDS;
+static RX_RING_ACTIVE: AtomicBool = AtomicBool::new(false);
+static RX_RING_STALLED: AtomicBool = AtomicBool::new(false);
+// 客户端在rx_semaphore上等待时才post，信号量不会在没人取的时候越攒越多
+static RX_RING_WAITING: AtomicBool = AtomicBool::new(false);
+static RX_RING_PROD: AtomicUsize = AtomicUsize::new(0);
+static RX_RING_CONS: AtomicUsize = AtomicUsize::new(0);
+// 上一次receive_batch返回、下一次调用时归还的寄存器数
+static mut RX_RING_BATCH: usize = 0;
+static mut RX_RING_COLLECTOR: FragCollector<MAILBOX_MAX_REG_NUM> = FragCollector::new();
+// 拷到一半时接收环满了的描述符消息：帧头、描述符与已拷出的字节数，拷完之前不再取新的分片
+static mut RX_RING_DESC: Option<(u64, u64, usize)> = None;
+
 extern "C" {
     static mmio_region: *mut u64;
+    static desc_pool: *mut u8;
+    static rx_ring: *mut u64;
+    static tx_data: *const u8;
     fn api_mutex_lock() -> u32;
     fn api_mutex_unlock() -> u32;
     fn rx_semaphore_wait() -> u32;
@@ -62,9 +242,6 @@ fn cantrip_assert(expr: bool) {
     debug_assert!(expr);
 }
 
-unsafe fn read_reg(index: isize) -> u64 { mmio_region.offset(index).read_volatile() }
-unsafe fn write_reg(val: u64, index: isize) { mmio_region.offset(index).write_volatile(val); }
-
 #[no_mangle]
 #[allow(unused_variables)]
 pub fn logger_log(_level: u8, msg: *const cstr_core::c_char) {
@@ -79,9 +256,10 @@ pub fn logger_log(_level: u8, msg: *const cstr_core::c_char) {
 #[no_mangle]
 pub unsafe extern "C" fn pre_init() {
     CAMKES.init_logger(log::LevelFilter::Trace);
-    write_reg(ENABLE_BIT | VALID_MASK, RECEIVE_CSR_INDEX);
+    ring().set_own_csr(ENABLE_BIT | VALID_MASK);
+    ring().sync();
     log::info!("ASP Mailbox initialized, ver=003");
-    let val = read_reg(RECEIVE_CSR_INDEX);
+    let val = ring().own_csr();
     log::info!("receive csr value is now 0x{:X}", val);
 }
 
@@ -90,87 +268,653 @@ pub unsafe extern "C" fn pre_init() {
 pub unsafe extern "C" fn rx_irq_handle() {
     api_mutex_lock();
 
-    let valid_bits = read_reg(RECEIVE_CSR_INDEX) & VALID_MASK;
-
-    //log::info!("[test]interrupt handler: valid_bits value is 0x{:X}",valid_bits);
-    write_reg(valid_bits | ENABLE_BIT, RECEIVE_CSR_INDEX); //开中断
-    // let tmp = read_reg(receive_csr_index);
-    // //log::info!("[test]interrupt handler: Receive Complete");
-    // log::info!("[test]interrupt handler: receive csr value is 0x{:X}",tmp);
-    let receive_info_reg = read_reg(RECEIVE_IR_INDEX);
-    log::info!(
-        "[test]interrupt handler: receive ir value is 0x{:X}",
-        receive_info_reg
-    );
-    let send_info_reg = read_reg(SEND_IR_INDEX);
-    log::info!("[test]interrupt handler: send ir value is 0x{:X}", send_info_reg);
-    let rx_tail_from_receiver = (receive_info_reg & 0xff00) >> 8;
-    let rx_head_from_sender = send_info_reg & 0x00ff;
-
-    let mut msgs: [u64; 62] = [0; 62];
-    let mut msg_ptr: usize = 0;
+    let valid_bits = ring().own_csr() & VALID_MASK;
+
+    ring().set_own_csr(valid_bits | ENABLE_BIT); //开中断
+    STATS.doorbells_rx += 1;
+    if valid_bits & CSR_BLOCK_BIT != 0 {
+        STATS.rx_blocks += 1;
+    }
+    rx_drain();
+
+    api_mutex_unlock();
+    cantrip_assert(rx_irq_acknowledge() == 0);
+}
+
+// 读出接收区中的寄存器，交给解析、接收环与回显后推进head，持有api_mutex时调用
+unsafe fn rx_drain() {
+    let mut msgs = [0u64; MAILBOX_MAX_REG_NUM];
+    let (msg_ptr, receive_info_reg) = ring().rx_read(&mut msgs);
+
+    // 接收环放不下的寄存器留在接收区，等receive_batch腾出空间
+    let ring_active = RX_RING_ACTIVE.load(Ordering::Relaxed);
+    let ring_desc = ring_active && !ECHO.load(Ordering::Relaxed);
+    let n = if ring_active { rx_ring_fill(&msgs[..msg_ptr], ring_desc) } else { msg_ptr };
+    RX_RING_STALLED.store(n < msg_ptr || (*core::ptr::addr_of!(RX_RING_DESC)).is_some(), Ordering::Relaxed);
+    if n < msg_ptr {
+        STATS.rx_ring_stalls += 1;
+    }
+
+    STATS.rx_words += n as u64;
+    // 只解析分片边界并统计完整的消息数，payload由客户端从接收环中按task重组；交还分片与不进入接收环的描述符分片在这里处理
+    let parsed = (*core::ptr::addr_of_mut!(PARSER)).parse_with(&msgs[..n], |hdr, desc| desc_rx(hdr, desc, ring_desc));
+    STATS.rx_msgs += parsed.msgs;
+    STATS.rx_aborts += parsed.aborts;
+    // release构建中trace级别日志被编译掉，不占用数据通路
+    trace!("rx_irq_handle: len={}", n);
+
+    ring().rx_release(n); //将head推进到读完的位置
+    // head通知与bank应答合并成一次写，对方收到时已能看到推进后的head；一个也没读时不通知，免得对方空转
+    let mut acks = parsed.bank_acks;
+    if receive_info_reg & IR_TX_WAIT_BIT != 0 && n != 0 {
+        acks |= HEAD_NOTIFY_BIT; // Linux端发送队列在等待空间
+    }
+    if acks != 0 {
+        ring_doorbell(acks);
+    }
+    // 先腾出接收区再回显，Linux端的发送不会因为我们在等它读而卡住
+    if ECHO.load(Ordering::Relaxed) {
+        echo(&msgs[..n]);
+    }
+    if desc_done_pending() && tx_try_lock() {
+        tx_unlock();
+    }
+    // 对方读走寄存器后的HEAD_NOTIFY也走到这里
+    tx_buf_drain();
+}
 
-    let mut head = rx_head_from_sender;
+// 把攒满的分片写进接收环，返回用掉的寄存器数，写完后更新头中的RXR_PROD，客户端在等待时唤醒它。
+// 接收环还要为收集器中攒了一半的分片留出空间，放不下的寄存器不用。take_desc时描述符消息由rx_ring_desc_copy拷进接收环，
+// 否则跳过，由desc_rx交还
+unsafe fn rx_ring_fill(words: &[u64], take_desc: bool) -> usize {
+    let collector = &mut *core::ptr::addr_of_mut!(RX_RING_COLLECTOR);
+    let data = rx_ring.add(RXR_HDR_WORDS);
+    let mut prod = RX_RING_PROD.load(Ordering::Relaxed);
+    let mut used = 0;
 
-    while head != rx_tail_from_receiver {
-        // let tmp_addr = RECEIVE_BASE_INDEX + (head as isize);
-        // log::info!("[test]interrupt handler: read from {}",tmp_addr);
-        msgs[msg_ptr] = read_reg(RECEIVE_BASE_INDEX + (head as isize)); /* error */
-        head += 1;
-        if head >= MAILBOX_MAX_REG_NUM {
-            head -= MAILBOX_MAX_REG_NUM;
+    // 每取到一个描述符消息就停下先拷它，拷完再按剩下的空间接着取
+    while rx_ring_desc_copy(&mut prod) && used < words.len() {
+        let free = RX_RING_WORDS - (prod - RX_RING_CONS.load(Ordering::Acquire));
+        let limit = core::cmp::min(words.len(), used + free.saturating_sub(MAILBOX_MAX_REG_NUM));
+        if limit == used {
+            break;
         }
-        msg_ptr += 1;
+        used += collector.feed_while(&words[used..limit], |frag| {
+            if frag[0] & FRAG_DESC == 0 {
+                for &w in frag {
+                    data.add(prod % RX_RING_WORDS).write_volatile(w);
+                    prod += 1;
+                }
+                STATS.rx_ring_words += frag.len() as u64;
+                return true;
+            }
+            if frag[0] & FRAG_DONE != 0 {
+                return true;
+            }
+            if !take_desc {
+                STATS.rx_ring_desc_skips += 1;
+                return true;
+            }
+            if !desc_rx_check(frag[0], frag[1]) {
+                STATS.rx_desc_bad += 1;
+                return true;
+            }
+            STATS.rx_descs += 1;
+            RX_RING_DESC = Some((frag[0], frag[1], 0));
+            false
+        });
+    }
+    if prod == RX_RING_PROD.load(Ordering::Relaxed) {
+        return used;
+    }
+    // 分片的内容先于RXR_PROD可见
+    fence(Ordering::SeqCst);
+    rx_ring.add(RXR_PROD).write_volatile(prod as u64);
+    RX_RING_PROD.store(prod, Ordering::SeqCst);
+    if RX_RING_WAITING.swap(false, Ordering::SeqCst) {
+        rx_semaphore_post();
     }
+    used
+}
 
-    log::info!("[test]interrupt handler: len={} msgs: {:?}", msg_ptr, msgs);
+// 把RX_RING_DESC中的描述符消息接着拷进接收环，分片与Linux端流式发送的相同，接收环放不下下一个分片时留到下次。
+// 拷完后排队交还C2A池中的缓冲区，返回是否已拷完（没有待拷的消息时也为true）
+unsafe fn rx_ring_desc_copy(prod: &mut usize) -> bool {
+    let pending = &mut *core::ptr::addr_of_mut!(RX_RING_DESC);
+    let (hdr, desc, mut sent) = match *pending {
+        Some(p) => p,
+        None => return true,
+    };
+    // 取出时已检查过
+    let (src, len) = desc_rx_range(hdr, desc).unwrap_or((0, 0));
+    let msg = core::slice::from_raw_parts(desc_pool.add(src), len);
+    let data = rx_ring.add(RXR_HDR_WORDS);
+    let mut frame: [u64; Ring::FRAG_MAX_WORDS + 1] = [0; Ring::FRAG_MAX_WORDS + 1];
 
-    let mut send_info_reg = read_reg(SEND_IR_INDEX);
-    send_info_reg &= 0xffff_ffff_ffff_ff00;
-    send_info_reg |= rx_tail_from_receiver; //将head设置为原来的tail,即读出了所有内容
-    write_reg(send_info_reg, SEND_IR_INDEX);
+    loop {
+        let words = 1 + (core::cmp::min(len - sent, Ring::FRAG_MAX_WORDS * 8) + 7) / 8;
+        if words > RX_RING_WORDS - (*prod - RX_RING_CONS.load(Ordering::Acquire)) {
+            *pending = Some((hdr, desc, sent));
+            return false;
+        }
+        let index = (sent / (Ring::FRAG_MAX_WORDS * 8)) as u32;
+        sent += frag_build(&mut frame, frag_chan(hdr), (hdr & 0xff) as u8, msg, sent, index, Ring::FRAG_MAX_WORDS, 0);
+        for &w in &frame[..words] {
+            data.add(*prod % RX_RING_WORDS).write_volatile(w);
+            *prod += 1;
+        }
+        STATS.rx_ring_words += words as u64;
+        if sent == len {
+            break;
+        }
+    }
+    *pending = None;
+    desc_done_queue(desc);
+    true
+}
+
+/// ASPMailboxAPI的receive_batch：归还上一次返回的寄存器，等到接收环非空，返回从头中RXR_CONS处开始、
+/// 不越过分片区末尾的至多limit个寄存器的个数（limit为0时按1）。只能有一个客户端线程调用
+#[no_mangle]
+pub unsafe extern "C" fn api_receive_batch(limit: u32) -> u32 {
+    RX_RING_ACTIVE.store(true, Ordering::Relaxed);
+    let cons = RX_RING_CONS.load(Ordering::Relaxed) + RX_RING_BATCH;
+    RX_RING_BATCH = 0;
+    rx_ring.add(RXR_CONS).write_volatile(cons as u64);
+    RX_RING_CONS.store(cons, Ordering::Release);
+    if RX_RING_STALLED.load(Ordering::Relaxed) {
+        api_mutex_lock();
+        rx_drain();
+        api_mutex_unlock();
+    }
+
+    let mut prod = RX_RING_PROD.load(Ordering::SeqCst);
+    while prod == cons {
+        // 先登记再复查，中断处理在两者之间写入时会看到登记并post
+        RX_RING_WAITING.store(true, Ordering::SeqCst);
+        prod = RX_RING_PROD.load(Ordering::SeqCst);
+        if prod != cons {
+            RX_RING_WAITING.store(false, Ordering::Relaxed);
+            break;
+        }
+        rx_semaphore_wait();
+        prod = RX_RING_PROD.load(Ordering::SeqCst);
+    }
+    let n = (prod - cons).min(RX_RING_WORDS - cons % RX_RING_WORDS).min(limit.max(1) as usize);
+    RX_RING_BATCH = n;
+    STATS.rx_batches += 1;
+    n as u32
+}
+
+// 阻塞向Linux端的chan通道发送一条消息，按分片加帧头，不同task的消息在接收方分别重组。
+// 按消息大小选择描述符、环形FIFO流式发送或块模式。Linux端的CSR为停止标志CSR_STOPPED时
+// 没有人会来读，与Linux端的tx_peer_stopped一样不发送并返回false，等待空间或发送锁期间Linux端停止时同样放弃；
+// 不想等待时用send
+pub unsafe fn block_send(chan: u8, task: u8, msg: &[u8]) -> bool {
+    if ring().peer_stopped() {
+        return false;
+    }
+    if DESC_THRESHOLD != 0 && msg.len() >= DESC_THRESHOLD && msg.len() <= DESC_SLOT_SIZE {
+        if let Some((buf, dst)) = desc_alloc() {
+            dst[..msg.len()].copy_from_slice(msg);
+            return desc_send(chan, task, buf, msg.len());
+        }
+    }
 
+    let mut frame: [u64; Ring::FRAG_MAX_WORDS + 1] = [0; Ring::FRAG_MAX_WORDS + 1];
+    let mut sent: usize = 0;
+    let mut index: u32 = 0;
+    let block = use_block_mode(msg.len());
+    let banks = BLOCK_BANKS;
+    // 块模式的分片正好占一个bank
+    let frag_words = if block { Ring::block_frag_words(banks) } else { Ring::FRAG_MAX_WORDS };
+    let spins_before = STATS.tx_full_spins;
+
+    if !tx_lock() {
+        return false;
+    }
+    loop {
+        let flags = if block { FRAG_BLOCK | ((index as usize % banks) as u64) << 28 } else { 0 };
+        let n = frag_build(&mut frame, chan, task, msg, sent, index, frag_words, flags);
+        let words = (n + 7) / 8;
+        let written = if block {
+            ring_write_block(&frame[..1 + words], DOORBELL_BIT)
+        } else {
+            ring_write(&frame[..1 + words], DOORBELL_BIT)
+        };
+        if !written {
+            tx_unlock();
+            return false;
+        }
+        sent += n;
+        index += 1;
+        if sent == msg.len() {
+            break;
+        }
+    }
+    tx_unlock();
+
+    // 本条消息每个寄存器平均的空转次数，计入所用模式的EWMA
+    let total_words = (msg.len() as u64 + 7) / 8 + index as u64;
+    let sample = (STATS.tx_full_spins - spins_before) * 16 / total_words;
+    if block {
+        BLOCK_SPINS_PER_WORD = ewma_update(BLOCK_SPINS_PER_WORD, sample);
+    } else {
+        FIFO_SPINS_PER_WORD = ewma_update(FIFO_SPINS_PER_WORD, sample);
+    }
+    true
+}
+
+// 把msg[sent..]中至多frag_words个寄存器的payload组成第index个分片写进frame，返回本分片的字节数
+#[allow(clippy::too_many_arguments)]
+fn frag_build(frame: &mut [u64], chan: u8, task: u8, msg: &[u8], sent: usize, index: u32, frag_words: usize, flags: u64) -> usize {
+    let n = core::cmp::min(msg.len() - sent, frag_words * 8);
+    let mut flags = flags | if index == 0 { FRAG_FIRST } else { 0 };
+    if sent + n == msg.len() {
+        flags |= FRAG_LAST;
+    }
+    let info = if index == 0 { msg.len() as u32 } else { index };
+    frame[0] = frag_header(chan, task, (n + 7) / 8, flags, info);
+    for (w, chunk) in msg[sent..sent + n].chunks(8).enumerate() {
+        // 只有最后一个不满8字节的寄存器补0
+        let mut bytes = [0u8; 8];
+        bytes[..chunk.len()].copy_from_slice(chunk);
+        frame[1 + w] = u64::from_le_bytes(bytes);
+    }
+    n
+}
+
+/// 把一条消息组帧后放进普通优先级的发送缓冲立即返回，见send_prio
+pub unsafe fn send(chan: u8, task: u8, msg: &[u8]) -> Result<(), SendError> {
+    send_prio(PRIO_NORMAL, chan, task, msg)
+}
+
+/// 把一条消息组帧后放进prio优先级的发送缓冲立即返回，不等Linux端读走。达到描述符阈值且有空闲缓冲区时只排队描述符。
+/// 同一时刻只能有一个线程调用；与block_send以分片为单位交错，两者并用时不要共用task
+pub unsafe fn send_prio(prio: usize, chan: u8, task: u8, msg: &[u8]) -> Result<(), SendError> {
+    let prio = core::cmp::min(prio, PRIO_HIGH);
+    let head = TX_BUF_HEAD[prio].load(Ordering::Acquire);
+    let mut tail = TX_BUF_TAIL[prio].load(Ordering::Relaxed);
+    let frags = core::cmp::max(1, (msg.len() + Ring::FRAG_MAX_WORDS * 8 - 1) / (Ring::FRAG_MAX_WORDS * 8));
+    let desc = DESC_THRESHOLD != 0 && msg.len() >= DESC_THRESHOLD && msg.len() <= DESC_SLOT_SIZE;
+    let regs_need = (msg.len() + 7) / 8 + frags;
+    if !desc && regs_need > TX_BUFFER_WORDS {
+        return Err(SendError::TooLarge);
+    }
+    // 先确定走描述符还是寄存器，没有空闲缓冲区时按寄存器组帧所需的空间检查
+    let slot = if desc { desc_alloc() } else { None };
+    let need = if slot.is_some() { 2 } else { regs_need };
+    if need > TX_BUFFER_WORDS - (tail - head) {
+        if let Some((buf, _)) = slot {
+            desc_free(buf);
+        }
+        STATS.tx_buf_would_block[prio] += 1;
+        tx_buf_drain();
+        return Err(SendError::WouldBlock);
+    }
+    // ASP端没有时钟，以排在本条消息前面、会先写出的寄存器数近似排队时间
+    let mut ahead = tail - head;
+    for p in prio + 1..PRIO_NUM {
+        ahead += TX_BUF_TAIL[p].load(Ordering::Relaxed) - TX_BUF_HEAD[p].load(Ordering::Relaxed);
+    }
+    STATS.tx_buf_msgs[prio] += 1;
+    STATS.tx_buf_ahead_words[prio] += ahead as u64;
+
+    let buffer = &mut (*core::ptr::addr_of_mut!(TX_BUFFER))[prio];
+    let mut frame: [u64; Ring::FRAG_MAX_WORDS + 1] = [0; Ring::FRAG_MAX_WORDS + 1];
+    let mut push = |words: &[u64]| {
+        for &w in words {
+            buffer[tail % TX_BUFFER_WORDS] = w;
+            tail += 1;
+        }
+    };
+    match slot {
+        Some((buf, dst)) => {
+            dst[..msg.len()].copy_from_slice(msg);
+            // 缓冲区的内容先于描述符可见，写出描述符时已在发送缓冲中排过队
+            fence(Ordering::SeqCst);
+            push(&desc_frame(chan, task, 0, msg.len() as u32, desc_word(buf, DESC_POOL.seq(buf), 0)));
+            STATS.tx_descs += 1;
+        }
+        None => {
+            let (mut sent, mut index) = (0, 0);
+            loop {
+                let n = frag_build(&mut frame, chan, task, msg, sent, index, Ring::FRAG_MAX_WORDS, 0);
+                push(&frame[..1 + (n + 7) / 8]);
+                sent += n;
+                index += 1;
+                if sent == msg.len() {
+                    break;
+                }
+            }
+        }
+    }
+    STATS.tx_buf_queued[prio] += (tail - TX_BUF_TAIL[prio].load(Ordering::Relaxed)) as u64;
+    TX_BUF_TAIL[prio].store(tail, Ordering::Release);
+    tx_buf_drain();
+    Ok(())
+}
+
+/// ASPMailboxAPI的send：把tx_data数据端口中的前len字节作为一条prio优先级的消息排队，返回0或SendError的值，
+/// 返回后即可改写tx_data
+#[no_mangle]
+pub unsafe extern "C" fn api_send(chan: u8, task: u8, prio: u8, len: u32) -> i32 {
+    if len as usize > TX_DATA_SIZE {
+        return SendError::TooLarge as i32;
+    }
+    api_mutex_lock();
+    let ret = send_prio(prio as usize, chan, task, core::slice::from_raw_parts(tx_data, len as usize));
     api_mutex_unlock();
-    cantrip_assert(rx_irq_acknowledge() == 0);
+    match ret {
+        Ok(()) => 0,
+        Err(e) => e as i32,
+    }
+}
+
+fn tx_buf_empty(prio: usize) -> bool {
+    TX_BUF_HEAD[prio].load(Ordering::Relaxed) == TX_BUF_TAIL[prio].load(Ordering::Acquire)
+}
+
+// 把发送缓冲中放得下的整片写进对方接收区，每个分片都先从高优先级的缓冲取，每批敲一次门铃。
+// 与写tail一样在发送锁下改写自己的IR；发送锁被block_send或回显占用时留给持锁者在tx_unlock中写出
+unsafe fn tx_buf_drain() {
+    if (0..PRIO_NUM).all(tx_buf_empty) || !tx_try_lock() {
+        return;
+    }
+    let buffers = &*core::ptr::addr_of!(TX_BUFFER);
+    let mut out = [0u64; Ring::CAPACITY];
+    let mut waiting = false;
+
+    loop {
+        // 凑出放得下的若干个整片。只按已凑出的加上下一片的大小询问空闲数，缓存的head放不下时才读对方的IR
+        let (mut n, mut free) = (0, 0);
+        let mut taken = [0usize; PRIO_NUM];
+        while let Some(p) = (0..PRIO_NUM)
+            .rev()
+            .find(|&p| TX_BUF_HEAD[p].load(Ordering::Relaxed) + taken[p] != TX_BUF_TAIL[p].load(Ordering::Acquire))
+        {
+            let (buffer, head) = (&buffers[p], TX_BUF_HEAD[p].load(Ordering::Relaxed) + taken[p]);
+            let hdr = buffer[head % TX_BUFFER_WORDS];
+            let len = 1 + frag_words(hdr);
+            // 高优先级的分片放不下时也不让普通优先级的分片先走
+            if n + len > free {
+                free = ring().tx_free(n + len);
+                if n + len > free {
+                    break;
+                }
+            }
+            for i in 0..len {
+                out[n + i] = buffer[(head + i) % TX_BUFFER_WORDS];
+            }
+            n += len;
+            taken[p] += len;
+        }
+        if n != 0 {
+            ring_write(&out[..n], DOORBELL_BIT);
+            for p in 0..PRIO_NUM {
+                STATS.tx_buf_drained[p] += taken[p] as u64;
+                TX_BUF_HEAD[p].fetch_add(taken[p], Ordering::Release);
+            }
+            continue;
+        }
+        if (0..PRIO_NUM).all(tx_buf_empty) {
+            ring().set_tx_wait(false);
+            break;
+        }
+        if waiting {
+            break;
+        }
+        // 先挂起等待标志再看一次head，防止对方在两者之间推进head而漏掉通知
+        ring().set_tx_wait(true);
+        waiting = true;
+        STATS.tx_buf_waits += 1;
+    }
+    tx_release();
+}
+
+/// 分配一个A2C池中的缓冲区，返回缓冲区号与可以直接填写的缓冲区，全部在Linux端手中时返回None
+pub unsafe fn desc_alloc() -> Option<(u16, &'static mut [u8])> {
+    let (buf, _) = DESC_POOL.alloc()?;
+    let base = desc_pool.add(DESC_POOL_SIZE / 2 + buf as usize * DESC_SLOT_SIZE);
+    Some((buf, core::slice::from_raw_parts_mut(base, DESC_SLOT_SIZE)))
+}
+
+/// 放弃desc_alloc分配而未发送的缓冲区
+pub unsafe fn desc_free(buf: u16) {
+    DESC_POOL.free(buf);
+}
+
+/// 把缓冲区buf的前len字节以描述符发给Linux端的chan通道，缓冲区在Linux端交还前不能再写。
+/// 等待期间Linux端停止时释放缓冲区并返回false
+pub unsafe fn desc_send(chan: u8, task: u8, buf: u16, len: usize) -> bool {
+    let seq = DESC_POOL.seq(buf);
+    let frame = desc_frame(chan, task, 0, len as u32, desc_word(buf, seq, 0));
+    // 缓冲区的内容先于描述符可见
+    fence(Ordering::SeqCst);
+    let sent = tx_lock() && {
+        let written = ring_write(&frame, DOORBELL_BIT);
+        tx_unlock();
+        written
+    };
+    if !sent {
+        DESC_POOL.free(buf);
+        return false;
+    }
+    STATS.tx_descs += 1;
+    true
+}
+
+// 中断处理中每个描述符分片结束时调用：交还分片释放A2C池中的缓冲区。
+// 描述符消息在ring_desc时已由rx_ring_fill取走，拷进接收环后才交还；否则检查后排队交还C2A池中的缓冲区，
+// 与接收环启用前的寄存器分片一样读完即丢，回显时由echo拷出后交还
+unsafe fn desc_rx(hdr: u64, desc: u64, ring_desc: bool) {
+    if hdr & FRAG_DONE != 0 {
+        if DESC_POOL.complete(desc) {
+            STATS.tx_desc_done += 1;
+        } else {
+            STATS.rx_desc_bad += 1;
+        }
+        return;
+    }
+    if ring_desc {
+        return;
+    }
+    if !desc_rx_check(hdr, desc) {
+        STATS.rx_desc_bad += 1;
+        return;
+    }
+    STATS.rx_descs += 1;
+    // 回显时拷出内容后再交还
+    if !ECHO.load(Ordering::Relaxed) {
+        desc_done_queue(desc);
+    }
+}
+
+// 描述符越界或交还队列已满时不接收这条消息
+fn desc_rx_check(hdr: u64, desc: u64) -> bool {
+    desc_rx_range(hdr, desc).is_some() && DONE_HEAD.load(Ordering::Relaxed) - DONE_TAIL.load(Ordering::Acquire) != DONE_QUEUE_LEN
+}
+
+// 描述符所指的消息在C2A池中的字节范围，越界时返回None
+fn desc_rx_range(hdr: u64, desc: u64) -> Option<(usize, usize)> {
+    let (buf, off, len) = (desc_buf(desc) as usize, desc_off(desc) as usize, frag_info(hdr) as usize);
+    if buf >= DESC_SLOTS || off > DESC_SLOT_SIZE || len > DESC_SLOT_SIZE - off {
+        return None;
+    }
+    Some((buf * DESC_SLOT_SIZE + off, len))
+}
+
+// 排队交还C2A池中的缓冲区，只在中断处理中调用，调用前已确认队列未满
+unsafe fn desc_done_queue(desc: u64) {
+    let head = DONE_HEAD.load(Ordering::Relaxed);
+    DONE_QUEUE[head % DONE_QUEUE_LEN] = desc;
+    DONE_HEAD.store(head + 1, Ordering::SeqCst);
 }
 
-// 阻塞发送消息
-pub unsafe fn block_send(msg: &[u64]) {
+fn desc_done_pending() -> bool {
+    DONE_TAIL.load(Ordering::SeqCst) != DONE_HEAD.load(Ordering::SeqCst)
+}
+
+// 持有发送锁时写出排队的交还分片，Linux端停止时余下的留在队列中
+unsafe fn desc_done_flush() {
+    let head = DONE_HEAD.load(Ordering::Acquire);
+    let mut tail = DONE_TAIL.load(Ordering::Relaxed);
+    if tail == head {
+        return;
+    }
+    while tail != head {
+        let frame = desc_frame(0, 0, FRAG_DONE, 0, DONE_QUEUE[tail % DONE_QUEUE_LEN]);
+        if !ring_write(&frame, DOORBELL_BIT) {
+            break;
+        }
+        tail += 1;
+    }
+    DONE_TAIL.store(tail, Ordering::Release);
+}
+
+fn tx_try_lock() -> bool {
+    TX_LOCK.compare_exchange(false, true, Ordering::SeqCst, Ordering::Relaxed).is_ok()
+}
+
+// 持锁者在Linux端停止时会放弃，等锁期间同样看对方的停止标志，停止时返回false
+unsafe fn tx_lock() -> bool {
+    while !tx_try_lock() {
+        if ring().peer_stopped() {
+            return false;
+        }
+        core::hint::spin_loop();
+    }
+    true
+}
+
+// 释放前写出交还分片；中断处理在我们持锁期间排队的交还留给了我们，释放后再检查一次
+unsafe fn tx_release() {
+    loop {
+        desc_done_flush();
+        TX_LOCK.store(false, Ordering::SeqCst);
+        if !desc_done_pending() || !tx_try_lock() {
+            break;
+        }
+    }
+}
+
+// 释放发送锁，持锁期间send_prio放进发送缓冲、因拿不到锁而没写出的分片也在这里写出
+unsafe fn tx_unlock() {
+    tx_release();
+    tx_buf_drain();
+}
+
+// 攒满的分片凑成不超过一次写入的批量写回，每批敲一次门铃。块模式分片去掉BLOCK与bank后按流式写回；
+// 描述符消息拷进A2C池后以新的描述符发回，再交还C2A池中的缓冲区，A2C池没有空闲缓冲区时丢弃。交还分片不回显。
+// Linux端停止后不再回显，描述符消息的缓冲区照样交还
+unsafe fn echo(words: &[u64]) {
+    let collector = &mut *core::ptr::addr_of_mut!(ECHO_COLLECTOR);
+    let mut out = [0u64; Ring::CAPACITY];
+    let mut n = 0;
+    let locked = tx_lock();
+    let mut stopped = !locked;
+
+    collector.feed(words, |frag| {
+        let desc;
+        let frag = if frag[0] & FRAG_DESC == 0 {
+            if stopped {
+                return;
+            }
+            frag
+        } else if let Some(frame) = frag.get(1).and_then(|&d| echo_desc(frag[0], d, !stopped)) {
+            desc = frame;
+            &desc[..]
+        } else {
+            return;
+        };
+        if n + frag.len() > Ring::CAPACITY {
+            stopped = !ring_write(&out[..n], DOORBELL_BIT);
+            n = 0;
+            if stopped {
+                return;
+            }
+        }
+        out[n] = frag[0] & !(FRAG_BLOCK | 0xf << 28);
+        out[n + 1..n + frag.len()].copy_from_slice(&frag[1..]);
+        n += frag.len();
+        STATS.tx_echoed += 1;
+    });
+    if n != 0 && !stopped {
+        ring_write(&out[..n], DOORBELL_BIT);
+    }
+    if locked {
+        tx_unlock();
+    }
+}
+
+// 把收到的描述符消息拷进A2C池，返回发回用的描述符分片，之后交还C2A池中的缓冲区；不回显（copy为false）时只交还
+unsafe fn echo_desc(hdr: u64, desc: u64, copy: bool) -> Option<[u64; 2]> {
+    if hdr & FRAG_DONE != 0 {
+        return None;
+    }
+    let (src, len) = desc_rx_range(hdr, desc)?;
+    let copied = if !copy { None } else { desc_alloc() }.map(|(buf, dst)| {
+        dst[..len].copy_from_slice(core::slice::from_raw_parts(desc_pool.add(src), len));
+        // 缓冲区的内容先于描述符可见
+        fence(Ordering::SeqCst);
+        STATS.tx_descs += 1;
+        desc_frame(frag_chan(hdr), (hdr & 0xff) as u8, 0, len as u32, desc_word(buf, DESC_POOL.seq(buf), 0))
+    });
+    desc_done_queue(desc);
+    copied
+}
+
+#[inline]
+fn ewma_update(ewma: u64, sample: u64) -> u64 {
+    if ewma == 0 { sample } else { ewma - (ewma >> 3) + (sample >> 3) }
+}
+
+// 块模式写入一个分片：等对方接收区放得下整个分片（即该分片要占用的bank已被应答），一次写完；
+// 写完后要等对方读完才能写下一个分片时门铃带CSR_BLOCK_BIT。等待期间Linux端停止时返回false
+unsafe fn ring_write_block(frame: &[u64], doorbell: u64) -> bool {
+    while ring().tx_free(frame.len()) < frame.len() {
+        if ring().peer_stopped() {
+            return false;
+        }
+        STATS.tx_full_spins += 1;
+    }
+    let block = if Ring::block_doorbell(frame[0]) { CSR_BLOCK_BIT } else { 0 };
+    STATS.tx_blocks += 1;
+    ring_write(frame, doorbell | block)
+}
+
+// 把一段寄存器写进对方接收区，空间不足时原地等待，每次写入后置doorbell中的门铃位。
+// 等待期间Linux端停止（没有人会再读）时放弃并返回false，已写入的部分留在对方接收区中
+unsafe fn ring_write(msg: &[u64], doorbell: u64) -> bool {
     let size: usize = msg.len();
     let mut msg_ptr: usize = 0;
 
-    /* 待实现逻辑：若接收方关闭了中断使能，则不发送消息 */
-    //let mailbox_csr = read_reg(RECEIVE_CSR_INDEX);
-
     while msg_ptr != size {
-        let receiver_info_reg = read_reg(SEND_IR_INDEX);
-        let sender_info_reg = read_reg(RECEIVE_IR_INDEX);
-        let rx_tail_from_receiver = (receiver_info_reg & 0xff00) >> 8;
-        let rx_head_from_sender = sender_info_reg & 0x00ff;
-        let used_regs_num = u64_mod(rx_tail_from_receiver + MAILBOX_MAX_REG_NUM  - rx_head_from_sender, MAILBOX_MAX_REG_NUM); //先相加保证usize一定为正数
-        let valid_regs_num = MAILBOX_MAX_REG_NUM - 1 - used_regs_num;
-
-        if valid_regs_num > 0 {
-            log::info!("valid regs are:{}", valid_regs_num);
-            let regs_to_write = u64_min((size - msg_ptr) as u64, valid_regs_num);
-            for i in 0..regs_to_write {
-                let val = msg[msg_ptr + i as usize];
-                let index = u64_mod(SEND_BASE_INDEX as u64 + rx_tail_from_receiver + i, MAILBOX_MAX_REG_NUM);
-                write_reg(val, index as isize);
+        let left = size - msg_ptr;
+        // 分片可以跨越两次写入，缓存的head显示已满时才重读对方的IR
+        let valid_regs_num = ring().tx_free(1);
+
+        if valid_regs_num == 0 {
+            if ring().peer_stopped() {
+                return false;
             }
-            msg_ptr += regs_to_write as usize;
-            let new_rx_tail = u64_mod(rx_tail_from_receiver + regs_to_write, MAILBOX_MAX_REG_NUM);
-            let mut receiver_info_reg = read_reg(SEND_IR_INDEX);
-            receiver_info_reg &= 0xffff_ffff_ffff_00ff;
-            receiver_info_reg |= new_rx_tail << 8;
-            log::info!("[test]fn block_send: writing {} to linux's mailbox csr",receiver_info_reg);
-            write_reg(receiver_info_reg, SEND_IR_INDEX);
-            write_reg(0xffff_ffff_ffff_ffff, SEND_CSR_INDEX);
+            STATS.tx_full_spins += 1;
+        } else {
+            let regs_to_write = core::cmp::min(left, valid_regs_num);
+            ring().tx_push(&msg[msg_ptr..msg_ptr + regs_to_write]);
+            msg_ptr += regs_to_write;
+            STATS.tx_words += regs_to_write as u64;
+            trace!("block_send: tail={} regs={}", ring().tx_tail(), regs_to_write);
+            ring_doorbell(doorbell);
         }
     }
+    true
+}
+
+unsafe fn ring_doorbell(bits: u64) {
+    ring().doorbell(bits);
+    if bits & !(HEAD_NOTIFY_BIT | CSR_BANK_ACK_MASK) != 0 {
+        STATS.doorbells_tx += 1;
+    }
 }
 
-#[inline]
-fn u64_min(a:u64,b:u64) -> u64{if a < b {a} else {b} }
-#[inline]
-fn u64_mod(val:u64, m:u64) -> u64 {if val < m {val} else {val-m} }
@@ -0,0 +1,102 @@
+//! 在主机上用模拟的寄存器窗口测量环形区协议本身的开销：
+//! cargo bench -p asp-mailbox-ring --features mock
+//!
+//! stream：一端按分片写入并敲门铃，另一端读出、解析分片并推进head，统计每条消息的耗时与字节吞吐。
+//! wrap：下标回绕的算术，对比取模。
+
+use asp_mailbox_ring::mock::{MockBank, MockRegisters};
+use asp_mailbox_ring::{frag_header, FrameParser, MailboxRing, DOORBELL_BIT, FRAG_FIRST, FRAG_LAST};
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use std::hint::black_box;
+
+const REGS: usize = 62;
+type Ring = MailboxRing<MockBank, REGS>;
+
+/// 按驱动的格式把msg切成分片组帧到frame
+fn frame_message(msg: &[u8], frame: &mut Vec<u64>) {
+    let frag_bytes = Ring::FRAG_MAX_WORDS * 8;
+    let mut sent = 0;
+    let mut index = 0u32;
+    frame.clear();
+    loop {
+        let n = core::cmp::min(msg.len() - sent, frag_bytes);
+        let words = (n + 7) / 8;
+        let mut flags = if index == 0 { FRAG_FIRST } else { 0 };
+        if sent + n == msg.len() {
+            flags |= FRAG_LAST;
+        }
+        let info = if index == 0 { msg.len() as u32 } else { index };
+        frame.push(frag_header(0, 1, words, flags, info));
+        for chunk in msg[sent..sent + n].chunks(8) {
+            let mut bytes = [0u8; 8];
+            bytes[..chunk.len()].copy_from_slice(chunk);
+            frame.push(u64::from_le_bytes(bytes));
+        }
+        sent += n;
+        index += 1;
+        if sent == msg.len() {
+            break;
+        }
+    }
+}
+
+/// 单线程交替收发一条消息：写满对方接收区或写完后由接收端读空
+fn send_recv(tx: &mut Ring, rx: &mut Ring, parser: &mut FrameParser, frame: &[u64], buf: &mut [u64; REGS]) -> u64 {
+    let mut sent = 0;
+    let mut msgs = 0;
+    while sent < frame.len() {
+        let left = frame.len() - sent;
+        let free = tx.tx_free(core::cmp::min(left, Ring::CAPACITY));
+        let n = core::cmp::min(left, free);
+        tx.tx_push(&frame[sent..sent + n]);
+        tx.doorbell(DOORBELL_BIT);
+        sent += n;
+
+        let (got, _) = rx.rx_read(buf);
+        rx.rx_release(got);
+        msgs += parser.parse(&buf[..got]).msgs;
+    }
+    msgs
+}
+
+fn bench_stream(c: &mut Criterion) {
+    let regs = MockRegisters::new(REGS);
+    let mut tx = Ring::new(regs.endpoint(0));
+    let mut rx = Ring::new(regs.endpoint(1));
+    tx.sync();
+    rx.sync();
+    let mut parser = FrameParser::new();
+    let mut buf = [0u64; REGS];
+    let mut frame = Vec::new();
+
+    let mut group = c.benchmark_group("stream");
+    for &size in &[8usize, 64, 480, 4096, 65536] {
+        let msg = vec![0xa5u8; size];
+        frame_message(&msg, &mut frame);
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &frame, |b, frame| {
+            b.iter(|| {
+                let msgs = send_recv(&mut tx, &mut rx, &mut parser, black_box(frame), &mut buf);
+                assert_eq!(msgs, 1);
+            })
+        });
+    }
+    group.finish();
+}
+
+fn bench_wrap(c: &mut Criterion) {
+    let indices: Vec<usize> = (0..4096).map(|i| (i * 37) % (2 * REGS)).collect();
+
+    let mut group = c.benchmark_group("wrap");
+    group.throughput(Throughput::Elements(indices.len() as u64));
+    group.bench_function("branch_free", |b| {
+        b.iter(|| black_box(&indices).iter().map(|&i| Ring::wrap(i)).sum::<usize>())
+    });
+    group.bench_function("modulo", |b| {
+        b.iter(|| black_box(&indices).iter().map(|&i| i % REGS).sum::<usize>())
+    });
+    group.finish();
+}
+
+criterion_group!(benches, bench_stream, bench_wrap);
+criterion_main!(benches);
@@ -0,0 +1,689 @@
+//! ASP mailbox寄存器环协议：寄存器布局、CSR/IR位定义、分片帧头与环形区的收发操作。
+//!
+//! 协议与寄存器的访问方式分开：驱动用mmio_region实现[`RegisterBank`]，
+//! 主机上的基准与调试使用`mock`特性提供的[`mock::MockRegisters`]，两者走同一份代码；单元测试总是带着它编译。
+#![no_std]
+
+#[cfg(any(test, feature = "mock"))]
+extern crate std;
+
+#[cfg(any(test, feature = "mock"))]
+pub mod mock;
+
+use core::sync::atomic::{AtomicU16, AtomicU64, Ordering};
+
+// CSR：最高位为中断使能，其余位写入自己的CSR时为写1清零
+pub const ENABLE_BIT: u64 = 1 << 63;
+pub const VALID_MASK: u64 = 0x7fff_ffff_ffff_ffff;
+// 门铃：所有逻辑通道共用一个环和一个门铃位，接收方按分片头中的通道号分发
+pub const DOORBELL_BIT: u64 = 1;
+// head通知位：接收方推进head后，若发送方在IR中挂起了等待标志，则置此位唤醒发送方
+pub const HEAD_NOTIFY_BIT: u64 = 1 << 1;
+// 停止标志：STOP时把对方的CSR整个写成此值（使能位清零、其余位全1），此后不再向对方发送，
+// 与Linux端MAILBOX_CSR_STOPPED一致，与轮询时只清使能位相区分
+pub const CSR_STOPPED: u64 = VALID_MASK;
+// 门铃对应一个块模式分片
+pub const CSR_BLOCK_BIT: u64 = 1 << 62;
+// bit58-61为各bank的应答位，接收方读完一个块模式分片后置发送方CSR中该分片所在bank的位
+pub const CSR_BANK_SHIFT: u32 = 58;
+pub const MAX_BANKS: usize = 4;
+pub const CSR_BANK_ACK_MASK: u64 = ((1 << MAX_BANKS) - 1) << CSR_BANK_SHIFT;
+
+// IR：[7:0]为自己接收区的head，[15:8]为对方接收区的tail，bit16为发送方等待对方推进head的标志
+pub const IR_HEAD_MASK: u64 = 0x00ff;
+pub const IR_TAIL_MASK: u64 = 0xff00;
+pub const IR_TAIL_SHIFT: u32 = 8;
+pub const IR_TX_WAIT_BIT: u64 = 1 << 16;
+
+// 分片帧头，与Linux端sw_mailbox.h一致：
+// [7:0]task id，[15:8]本分片payload寄存器数，bit16 FIRST，bit17 LAST，bit18 ABORT，bit19 BLOCK，bit20 PACKED，
+// [27:24]逻辑通道号，[31:28]块模式分片所在的bank，
+// bit21 DESC：payload为一个指向共享缓冲区的描述符，bit22 DONE：与DESC同时置位，交还对方的缓冲区，
+// [63:32]在FIRST分片中为消息字节数，其余分片中为分片序号。只有整条消息的最后一个寄存器补0。
+pub const FRAG_FIRST: u64 = 1 << 16;
+pub const FRAG_LAST: u64 = 1 << 17;
+pub const FRAG_ABORT: u64 = 1 << 18;
+pub const FRAG_BLOCK: u64 = 1 << 19;
+pub const FRAG_PACKED: u64 = 1 << 20;
+pub const FRAG_DESC: u64 = 1 << 21;
+pub const FRAG_DONE: u64 = 1 << 22;
+
+#[inline]
+pub fn frag_header(chan: u8, task: u8, words: usize, flags: u64, info: u32) -> u64 {
+    task as u64 | (words as u64) << 8 | flags | ((chan & 0xf) as u64) << 24 | (info as u64) << 32
+}
+
+#[inline]
+pub fn frag_words(hdr: u64) -> usize {
+    ((hdr >> 8) & 0xff) as usize
+}
+
+#[inline]
+pub fn frag_bank(hdr: u64) -> usize {
+    ((hdr >> 28) & 0xf) as usize
+}
+
+#[inline]
+pub fn frag_chan(hdr: u64) -> u8 {
+    ((hdr >> 24) & 0xf) as u8
+}
+
+#[inline]
+pub fn frag_info(hdr: u64) -> u32 {
+    (hdr >> 32) as u32
+}
+
+// 描述符，与Linux端MAILBOX_DESC一致：[15:0]缓冲区号，[31:16]该缓冲区的发送序号，[63:32]消息在缓冲区中的字节偏移。
+// 共享内存平分为两个池，前半由Linux端写入，后半由ASP端写入，每个池切成大小相同的缓冲区
+#[inline]
+pub fn desc_word(buf: u16, seq: u16, off: u32) -> u64 {
+    buf as u64 | (seq as u64) << 16 | (off as u64) << 32
+}
+
+#[inline]
+pub fn desc_buf(desc: u64) -> u16 {
+    desc as u16
+}
+
+#[inline]
+pub fn desc_seq(desc: u64) -> u16 {
+    (desc >> 16) as u16
+}
+
+#[inline]
+pub fn desc_off(desc: u64) -> u32 {
+    (desc >> 32) as u32
+}
+
+/// 描述符帧：帧头加一个描述符寄存器，flags为0时是一条消息，为FRAG_DONE时交还对方的缓冲区
+#[inline]
+pub fn desc_frame(chan: u8, task: u8, flags: u64, len: u32, desc: u64) -> [u64; 2] {
+    [frag_header(chan, task, 1, FRAG_FIRST | FRAG_LAST | FRAG_DESC | flags, len), desc]
+}
+
+// ASP端驱动与CAmkES客户端共享的接收环（rx_ring数据端口）：开头为RXR_HDR_WORDS个寄存器的头，其后为分片区。
+// 驱动按到达顺序写入完整的分片（帧头加payload），分片可以跨越分片区的末尾；两个计数都不回绕，
+// 在分片区中的位置为对分片区的寄存器数取余
+/// 头中驱动已写入的寄存器总数的下标
+pub const RXR_PROD: usize = 0;
+/// 头中客户端已归还的寄存器总数的下标，receive_batch返回的寄存器从这里开始
+pub const RXR_CONS: usize = 8;
+pub const RXR_HDR_WORDS: usize = 16;
+
+/// 自己方向缓冲池的分配状态，至多64个缓冲区。发送线程分配，收到交还的中断处理中释放，两者可以并发
+pub struct DescPool {
+    slots: usize,
+    busy: AtomicU64,
+    seq: [AtomicU16; 64],
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const SEQ_INIT: AtomicU16 = AtomicU16::new(0);
+
+impl DescPool {
+    pub const MAX_SLOTS: usize = 64;
+
+    pub const fn new(slots: usize) -> Self {
+        DescPool {
+            slots: if slots > Self::MAX_SLOTS { Self::MAX_SLOTS } else { slots },
+            busy: AtomicU64::new(0),
+            seq: [SEQ_INIT; 64],
+        }
+    }
+
+    pub fn slots(&self) -> usize {
+        self.slots
+    }
+
+    /// 分配一个空闲缓冲区，返回缓冲区号与本次的发送序号，全部在对方手中时返回None
+    pub fn alloc(&self) -> Option<(u16, u16)> {
+        let all = if self.slots == 64 { u64::MAX } else { (1u64 << self.slots) - 1 };
+        let mut busy = self.busy.load(Ordering::Acquire);
+        loop {
+            let free = !busy & all;
+            if free == 0 {
+                return None;
+            }
+            let b = free.trailing_zeros() as usize;
+            match self.busy.compare_exchange_weak(busy, busy | 1 << b, Ordering::AcqRel, Ordering::Acquire) {
+                Ok(_) => {
+                    let seq = self.seq[b].load(Ordering::Relaxed).wrapping_add(1);
+                    self.seq[b].store(seq, Ordering::Release);
+                    return Some((b as u16, seq));
+                }
+                Err(now) => busy = now,
+            }
+        }
+    }
+
+    /// 缓冲区当前的发送序号
+    pub fn seq(&self, buf: u16) -> u16 {
+        self.seq[buf as usize % Self::MAX_SLOTS].load(Ordering::Acquire)
+    }
+
+    /// 发送方放弃已分配的缓冲区
+    pub fn free(&self, buf: u16) {
+        if (buf as usize) < self.slots {
+            self.busy.fetch_and(!(1 << buf), Ordering::Release);
+        }
+    }
+
+    /// 对方交还了desc所指的缓冲区，序号不符（过期的交还）时不释放，返回是否释放
+    pub fn complete(&self, desc: u64) -> bool {
+        let b = desc_buf(desc) as usize;
+        if b >= self.slots || self.seq[b].load(Ordering::Acquire) != desc_seq(desc) {
+            return false;
+        }
+        self.busy.fetch_and(!(1 << b), Ordering::Release) & 1 << b != 0
+    }
+}
+
+/// 寄存器访问。index按64位寄存器计，窗口前半为自己的发送区（对方的接收区），后半为自己的接收区
+pub trait RegisterBank {
+    fn read(&self, index: usize) -> u64;
+    fn write(&self, index: usize, val: u64);
+
+    /// 从index开始连续写入src，调用者保证不越过所在的接收区
+    #[inline]
+    fn write_run(&self, index: usize, src: &[u64]) {
+        for (i, &val) in src.iter().enumerate() {
+            self.write(index + i, val);
+        }
+    }
+
+    /// 从index开始连续读出dst.len()个寄存器，调用者保证不越过所在的接收区
+    #[inline]
+    fn read_run(&self, index: usize, dst: &mut [u64]) {
+        for (i, val) in dst.iter_mut().enumerate() {
+            *val = self.read(index + i);
+        }
+    }
+}
+
+/// 一端看到的寄存器环。REGS为每个接收区的消息寄存器数（现有硬件为62），其后依次为IR与CSR。
+///
+/// 自己的IR只有本端会写，收发两侧分别修改其中的head与tail字段，保存影子后不必先读回。
+/// 对方的head只会前进，按上次读到的值算出的空闲数只会偏少，空间不够时才重读。
+pub struct MailboxRing<B: RegisterBank, const REGS: usize> {
+    bank: B,
+    ir_shadow: u64,
+    tx_peer_head: usize,
+}
+
+impl<B: RegisterBank, const REGS: usize> MailboxRing<B, REGS> {
+    /// 发送区：对方的接收区、自己的IR、对方的CSR
+    pub const TX_BASE: usize = 0;
+    pub const OWN_IR: usize = REGS;
+    pub const PEER_CSR: usize = REGS + 1;
+    /// 接收区：自己的接收区、对方的IR、自己的CSR
+    pub const RX_BASE: usize = REGS + 2;
+    pub const PEER_IR: usize = 2 * REGS + 2;
+    pub const OWN_CSR: usize = 2 * REGS + 3;
+
+    /// 留一个空位区分空与满
+    pub const CAPACITY: usize = REGS - 1;
+    /// 一个分片加上帧头正好填满对方接收区
+    pub const FRAG_MAX_WORDS: usize = REGS - 2;
+
+    /// 构造后需要调用sync从寄存器恢复影子
+    pub const fn new(bank: B) -> Self {
+        MailboxRing { bank, ir_shadow: 0, tx_peer_head: 0 }
+    }
+
+    pub fn bank(&self) -> &B {
+        &self.bank
+    }
+
+    /// 从自己的IR恢复影子，清除残留的等待标志，对方的head视为满，第一次发送时再读取
+    pub fn sync(&mut self) {
+        self.ir_shadow = self.bank.read(Self::OWN_IR) & !IR_TX_WAIT_BIT;
+        self.tx_peer_head = Self::wrap(self.tx_tail() + 1);
+    }
+
+    /// 把[0, 2*REGS)中的下标折回[0, REGS)，不用除法也不分支
+    #[inline(always)]
+    pub fn wrap(index: usize) -> usize {
+        let d = index.wrapping_sub(REGS);
+        d.wrapping_add(REGS & ((d as isize >> (usize::BITS - 1)) as usize))
+    }
+
+    /// head到tail之间已占用的寄存器数
+    #[inline(always)]
+    pub fn used(head: usize, tail: usize) -> usize {
+        Self::wrap(tail + REGS - head)
+    }
+
+    /// 块模式下分成banks个bank时每个分片的payload寄存器数，帧头加payload正好占一个bank
+    #[inline]
+    pub fn block_frag_words(banks: usize) -> usize {
+        Self::CAPACITY / banks - 1
+    }
+
+    /// 块模式分片的门铃是否带CSR_BLOCK_BIT，与sw_mailbox_ring.h的mailbox_block_doorbell相同：
+    /// 只有写完这个分片后要等对方读完才能写下一个时才带，流水线中间的bank不带
+    #[inline]
+    pub fn block_doorbell(hdr: u64) -> bool {
+        hdr & FRAG_LAST != 0 || 2 * (1 + frag_words(hdr)) > Self::CAPACITY
+    }
+
+    /// 自己在对方接收区中写到的tail
+    #[inline]
+    pub fn tx_tail(&self) -> usize {
+        ((self.ir_shadow & IR_TAIL_MASK) >> IR_TAIL_SHIFT) as usize
+    }
+
+    /// 对方接收区的空闲寄存器数，按缓存的head放得下need个时不读寄存器
+    #[inline]
+    pub fn tx_free(&mut self, need: usize) -> usize {
+        let tail = self.tx_tail();
+        let free = Self::CAPACITY - Self::used(self.tx_peer_head, tail);
+        if free >= need {
+            return free;
+        }
+        let head = (self.bank.read(Self::PEER_IR) & IR_HEAD_MASK) as usize;
+        if head >= REGS {
+            return 0;
+        }
+        self.tx_peer_head = head;
+        Self::CAPACITY - Self::used(head, tail)
+    }
+
+    /// 从tail开始写入words（不超过tx_free的返回值），在回绕点处至多分成两段，之后推进tail并写回自己的IR
+    #[inline]
+    pub fn tx_push(&mut self, words: &[u64]) {
+        let tail = self.tx_tail();
+        let first = core::cmp::min(words.len(), REGS - tail);
+        self.bank.write_run(Self::TX_BASE + tail, &words[..first]);
+        self.bank.write_run(Self::TX_BASE, &words[first..]);
+        let tail = Self::wrap(tail + words.len());
+        self.ir_shadow = (self.ir_shadow & !IR_TAIL_MASK) | (tail as u64) << IR_TAIL_SHIFT;
+        self.bank.write(Self::OWN_IR, self.ir_shadow);
+    }
+
+    /// 置对方CSR中的门铃位，保留对方的中断使能位，返回写入的值
+    #[inline]
+    pub fn doorbell(&self, bits: u64) -> u64 {
+        let csr = self.bank.read(Self::PEER_CSR) | bits;
+        self.bank.write(Self::PEER_CSR, csr);
+        csr
+    }
+
+    /// 读出自己接收区中head到tail之间的全部寄存器，返回读出的寄存器数与对方IR的值，不推进head
+    #[inline]
+    pub fn rx_read(&self, dst: &mut [u64; REGS]) -> (usize, u64) {
+        let peer_ir = self.bank.read(Self::PEER_IR);
+        let tail = ((peer_ir & IR_TAIL_MASK) >> IR_TAIL_SHIFT) as usize;
+        let head = (self.ir_shadow & IR_HEAD_MASK) as usize;
+        if tail >= REGS {
+            return (0, peer_ir);
+        }
+        let n = Self::used(head, tail);
+        let first = core::cmp::min(n, REGS - head);
+        self.bank.read_run(Self::RX_BASE + head, &mut dst[..first]);
+        self.bank.read_run(Self::RX_BASE, &mut dst[first..n]);
+        (n, peer_ir)
+    }
+
+    /// 读完n个寄存器后推进head并写回自己的IR
+    #[inline]
+    pub fn rx_release(&mut self, n: usize) {
+        let head = Self::wrap((self.ir_shadow & IR_HEAD_MASK) as usize + n);
+        self.ir_shadow = (self.ir_shadow & !IR_HEAD_MASK) | head as u64;
+        self.bank.write(Self::OWN_IR, self.ir_shadow);
+    }
+
+    /// 挂起或撤销自己IR中的TX_WAIT，挂起时对方读走寄存器后以HEAD_NOTIFY门铃通知
+    #[inline]
+    pub fn set_tx_wait(&mut self, wait: bool) {
+        let ir = if wait { self.ir_shadow | IR_TX_WAIT_BIT } else { self.ir_shadow & !IR_TX_WAIT_BIT };
+        if ir != self.ir_shadow {
+            self.ir_shadow = ir;
+            self.bank.write(Self::OWN_IR, ir);
+        }
+    }
+
+    /// 对方的CSR是否为停止标志，同Linux端的tx_peer_stopped。对方轮询期间会暂时清掉使能位，不能以使能位判断
+    #[inline]
+    pub fn peer_stopped(&self) -> bool {
+        self.bank.read(Self::PEER_CSR) == CSR_STOPPED
+    }
+
+    pub fn own_csr(&self) -> u64 {
+        self.bank.read(Self::OWN_CSR)
+    }
+
+    /// 写自己的CSR：使能位按普通位写入，其余位写1清零
+    pub fn set_own_csr(&self, val: u64) {
+        self.bank.write(Self::OWN_CSR, val);
+    }
+}
+
+/// 一次解析的结果
+#[derive(Clone, Copy, Default, Debug, PartialEq, Eq)]
+pub struct ParseResult {
+    /// 完整的消息数，含描述符消息，不含交还分片
+    pub msgs: u64,
+    pub aborts: u64,
+    /// 读完的块模式分片所在bank的应答位
+    pub bank_acks: u64,
+}
+
+/// 只解析分片边界，分片可以跨越多次读取，payload由上层按task重组
+#[derive(Clone, Copy, Default, Debug)]
+pub struct FrameParser {
+    hdr: u64,
+    left: usize,
+    desc: u64,
+}
+
+impl FrameParser {
+    pub const fn new() -> Self {
+        FrameParser { hdr: 0, left: 0, desc: 0 }
+    }
+
+    pub fn parse(&mut self, words: &[u64]) -> ParseResult {
+        self.parse_with(words, |_, _| {})
+    }
+
+    /// 同parse，每个描述符分片（含交还分片）结束时以帧头与描述符调用on_desc
+    pub fn parse_with<F: FnMut(u64, u64)>(&mut self, words: &[u64], mut on_desc: F) -> ParseResult {
+        let mut result = ParseResult::default();
+        let mut i = 0;
+        while i < words.len() {
+            if self.left == 0 {
+                self.hdr = words[i];
+                self.left = frag_words(self.hdr);
+                i += 1;
+            } else {
+                let n = core::cmp::min(self.left, words.len() - i);
+                if self.hdr & FRAG_DESC != 0 {
+                    self.desc = words[i + n - 1];
+                }
+                self.left -= n;
+                i += n;
+            }
+            if self.left != 0 {
+                continue;
+            }
+            if self.hdr & FRAG_BLOCK != 0 {
+                result.bank_acks |= 1 << (CSR_BANK_SHIFT + (frag_bank(self.hdr) % MAX_BANKS) as u32);
+            }
+            if self.hdr & FRAG_DESC != 0 {
+                on_desc(self.hdr, self.desc);
+                if self.hdr & FRAG_DONE == 0 {
+                    result.msgs += 1;
+                }
+                self.hdr = 0;
+            } else if self.hdr & FRAG_LAST != 0 {
+                if self.hdr & FRAG_ABORT != 0 {
+                    result.aborts += 1;
+                } else {
+                    result.msgs += 1;
+                }
+                self.hdr = 0;
+            }
+        }
+        result
+    }
+}
+
+/// 把读到的寄存器攒成完整的分片（帧头加payload），分片可以跨越多次读取。
+/// N不小于帧头加最大分片的寄存器数，更长的分片只计数丢弃
+#[derive(Clone, Copy, Debug)]
+pub struct FragCollector<const N: usize> {
+    frag: [u64; N],
+    len: usize,
+    need: usize,
+    /// 超过N而被丢弃的分片数
+    pub overflows: u64,
+}
+
+impl<const N: usize> FragCollector<N> {
+    pub const fn new() -> Self {
+        FragCollector { frag: [0; N], len: 0, need: 0, overflows: 0 }
+    }
+
+    /// 每攒满一个分片以它的全部寄存器调用on_frag
+    pub fn feed<F: FnMut(&[u64])>(&mut self, words: &[u64], mut on_frag: F) {
+        self.feed_while(words, |frag| {
+            on_frag(frag);
+            true
+        });
+    }
+
+    /// 同feed，on_frag返回false时停在该分片之后，返回用掉的寄存器数，其余的寄存器留给下一次调用
+    pub fn feed_while<F: FnMut(&[u64]) -> bool>(&mut self, words: &[u64], mut on_frag: F) -> usize {
+        let mut i = 0;
+        while i < words.len() {
+            if self.need == 0 {
+                self.need = 1 + frag_words(words[i]);
+                self.len = 0;
+            }
+            let n = core::cmp::min(self.need - self.len, words.len() - i);
+            if self.need <= N {
+                self.frag[self.len..self.len + n].copy_from_slice(&words[i..i + n]);
+            }
+            self.len += n;
+            i += n;
+            if self.len == self.need {
+                self.need = 0;
+                if self.len > N {
+                    self.overflows += 1;
+                } else if !on_frag(&self.frag[..self.len]) {
+                    break;
+                }
+            }
+        }
+        i
+    }
+}
+
+// 在模拟的寄存器窗口上检查协议：cargo test -p asp-mailbox-ring
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::mock::{MockBank, MockRegisters};
+    use std::vec;
+    use std::vec::Vec;
+
+    const REGS: usize = 8;
+    type Ring = MailboxRing<MockBank, REGS>;
+
+    /// 两端各一个环，0端发送、1端接收
+    fn pair() -> (Ring, Ring) {
+        let regs = MockRegisters::new(REGS);
+        let mut tx = Ring::new(regs.endpoint(0));
+        let mut rx = Ring::new(regs.endpoint(1));
+        tx.sync();
+        rx.sync();
+        (tx, rx)
+    }
+
+    fn words(from: u64, n: usize) -> Vec<u64> {
+        (from..from + n as u64).collect()
+    }
+
+    #[test]
+    fn wrap_and_used_at_boundary() {
+        assert_eq!(Ring::wrap(0), 0);
+        assert_eq!(Ring::wrap(REGS - 1), REGS - 1);
+        assert_eq!(Ring::wrap(REGS), 0);
+        assert_eq!(Ring::wrap(2 * REGS - 1), REGS - 1);
+        assert_eq!(Ring::used(3, 3), 0);
+        assert_eq!(Ring::used(0, REGS - 1), REGS - 1);
+        assert_eq!(Ring::used(REGS - 1, 0), 1);
+        assert_eq!(Ring::used(6, 2), 4);
+        assert_eq!(Ring::used(REGS - 1, REGS - 2), Ring::CAPACITY);
+    }
+
+    #[test]
+    fn push_and_read_across_wrap() {
+        let (mut tx, mut rx) = pair();
+        let mut dst = [0u64; REGS];
+        assert_eq!(tx.tx_free(1), Ring::CAPACITY);
+
+        tx.tx_push(&words(100, 5));
+        assert_eq!(rx.rx_read(&mut dst).0, 5);
+        rx.rx_release(5);
+
+        // tail从5开始写6个，回绕到3
+        assert_eq!(tx.tx_free(6), Ring::CAPACITY);
+        tx.tx_push(&words(200, 6));
+        assert_eq!(tx.tx_tail(), 3);
+        let (n, peer_ir) = rx.rx_read(&mut dst);
+        assert_eq!(n, 6);
+        assert_eq!(&dst[..n], &words(200, 6)[..]);
+        assert_eq!((peer_ir & IR_TAIL_MASK) >> IR_TAIL_SHIFT, 3);
+        rx.rx_release(n);
+        assert_eq!(rx.rx_read(&mut dst).0, 0);
+    }
+
+    #[test]
+    fn tx_free_rereads_head_only_when_short() {
+        let (mut tx, mut rx) = pair();
+        let mut dst = [0u64; REGS];
+        assert_eq!(tx.tx_free(Ring::CAPACITY), Ring::CAPACITY);
+        tx.tx_push(&words(0, Ring::CAPACITY));
+        assert_eq!(tx.tx_free(1), 0);
+
+        rx.rx_read(&mut dst);
+        rx.rx_release(4);
+        // 缓存的head放得下时不读对方的IR，返回的空闲数偏少
+        assert_eq!(tx.tx_free(0), 0);
+        assert_eq!(tx.tx_free(1), 4);
+
+        rx.rx_release(3);
+        assert_eq!(tx.tx_free(4), 4);
+        assert_eq!(tx.tx_free(5), Ring::CAPACITY);
+
+        // 对方IR中越界的head视为没有空间
+        rx.bank().write(Ring::OWN_IR, 0xff);
+        tx.tx_push(&words(0, Ring::CAPACITY));
+        assert_eq!(tx.tx_free(1), 0);
+    }
+
+    /// 两个分片的消息、一个ABORT、一个bank 2的块模式分片、一条描述符消息与一个交还
+    fn sample_stream() -> Vec<u64> {
+        let mut s = Vec::new();
+        s.push(frag_header(0, 1, 3, FRAG_FIRST, 30));
+        s.extend(words(10, 3));
+        s.push(frag_header(0, 1, 2, FRAG_LAST, 1));
+        s.extend(words(20, 2));
+        s.push(frag_header(0, 2, 0, FRAG_LAST | FRAG_ABORT, 4));
+        s.push(frag_header(1, 3, 2, FRAG_FIRST | FRAG_LAST | FRAG_BLOCK, 16) | 2 << 28);
+        s.extend(words(30, 2));
+        s.extend(desc_frame(2, 4, 0, 64, desc_word(5, 7, 0)));
+        s.extend(desc_frame(2, 4, FRAG_DONE, 0, desc_word(6, 9, 0)));
+        s
+    }
+
+    #[test]
+    fn frame_parser_across_reads() {
+        let stream = sample_stream();
+        for chunk in 1..=stream.len() {
+            let mut parser = FrameParser::new();
+            let mut total = ParseResult::default();
+            let mut descs = Vec::new();
+            for part in stream.chunks(chunk) {
+                let r = parser.parse_with(part, |hdr, desc| descs.push((hdr & FRAG_DONE != 0, desc)));
+                total.msgs += r.msgs;
+                total.aborts += r.aborts;
+                total.bank_acks |= r.bank_acks;
+            }
+            assert_eq!(total, ParseResult { msgs: 3, aborts: 1, bank_acks: 1 << (CSR_BANK_SHIFT + 2) }, "chunk {}", chunk);
+            assert_eq!(descs, [(false, desc_word(5, 7, 0)), (true, desc_word(6, 9, 0))], "chunk {}", chunk);
+        }
+    }
+
+    #[test]
+    fn frag_collector_interleaved_tasks() {
+        // task 1与task 2的分片交错，task 1中途放弃
+        let frags: [&[u64]; 4] = [
+            &[frag_header(0, 1, 2, FRAG_FIRST, 40), 1, 2],
+            &[frag_header(0, 2, 1, FRAG_FIRST | FRAG_LAST, 8), 3],
+            &[frag_header(0, 1, 0, FRAG_LAST | FRAG_ABORT, 1)],
+            &[frag_header(0, 2, 3, FRAG_FIRST | FRAG_LAST, 24), 4, 5, 6],
+        ];
+        let stream: Vec<u64> = frags.concat();
+        for chunk in 1..=stream.len() {
+            let mut collector = FragCollector::<8>::new();
+            let mut got: Vec<Vec<u64>> = Vec::new();
+            for part in stream.chunks(chunk) {
+                collector.feed(part, |f| got.push(f.to_vec()));
+            }
+            assert_eq!(got, frags.iter().map(|f| f.to_vec()).collect::<Vec<_>>(), "chunk {}", chunk);
+            assert_eq!(collector.overflows, 0);
+        }
+
+        // 放不下的分片只计数，之后的分片照常攒出
+        let mut collector = FragCollector::<3>::new();
+        let mut got = Vec::new();
+        collector.feed(&[frag_header(0, 1, 3, FRAG_FIRST, 24), 1, 2, 3, frag_header(0, 2, 1, FRAG_FIRST | FRAG_LAST, 8), 9], |f| {
+            got.push(f.to_vec())
+        });
+        assert_eq!(collector.overflows, 1);
+        assert_eq!(got, [vec![frag_header(0, 2, 1, FRAG_FIRST | FRAG_LAST, 8), 9]]);
+    }
+
+    #[test]
+    fn frag_collector_feed_while_stops_after_frag() {
+        let stream = [frag_header(0, 1, 1, FRAG_FIRST | FRAG_LAST, 8), 1, frag_header(0, 2, 2, FRAG_FIRST | FRAG_LAST, 16), 2, 3];
+        let mut collector = FragCollector::<8>::new();
+        let mut got = Vec::new();
+        // 第一个分片之后停下，剩下的寄存器下一次从头喂入
+        let used = collector.feed_while(&stream, |f| {
+            got.push(f.to_vec());
+            false
+        });
+        assert_eq!(used, 2);
+        assert_eq!(collector.feed_while(&stream[used..], |f| {
+            got.push(f.to_vec());
+            true
+        }), 3);
+        assert_eq!(got, [stream[..2].to_vec(), stream[2..].to_vec()]);
+    }
+
+    #[test]
+    fn desc_pool_seq_and_stale_done() {
+        let pool = DescPool::new(3);
+        assert_eq!(pool.alloc(), Some((0, 1)));
+        assert_eq!(pool.alloc(), Some((1, 1)));
+        assert_eq!(pool.alloc(), Some((2, 1)));
+        assert_eq!(pool.alloc(), None);
+
+        assert!(pool.complete(desc_word(1, 1, 0)));
+        assert!(!pool.complete(desc_word(1, 1, 0)));
+        assert_eq!(pool.alloc(), Some((1, 2)));
+        // 上一轮的交还迟到，序号不符不释放
+        assert!(!pool.complete(desc_word(1, 1, 0)));
+        assert_eq!(pool.alloc(), None);
+        assert!(pool.complete(desc_word(1, 2, 64)));
+        assert!(!pool.complete(desc_word(3, 1, 0)));
+
+        pool.free(0);
+        assert_eq!(pool.alloc(), Some((0, 2)));
+        assert_eq!(pool.seq(0), 2);
+    }
+
+    #[test]
+    fn mock_own_csr_write_one_to_clear() {
+        let (tx, rx) = pair();
+        let bell = DOORBELL_BIT;
+        assert_eq!(tx.doorbell(HEAD_NOTIFY_BIT | bell), ENABLE_BIT | HEAD_NOTIFY_BIT | bell);
+        assert_eq!(rx.own_csr(), ENABLE_BIT | HEAD_NOTIFY_BIT | bell);
+
+        // 写1清掉HEAD_NOTIFY，门铃位保留，使能位按写入的值
+        rx.set_own_csr(ENABLE_BIT | HEAD_NOTIFY_BIT);
+        assert_eq!(rx.own_csr(), ENABLE_BIT | bell);
+        rx.set_own_csr(0);
+        assert_eq!(rx.own_csr(), bell);
+        rx.set_own_csr(ENABLE_BIT | VALID_MASK);
+        assert_eq!(rx.own_csr(), ENABLE_BIT);
+
+        // 写对方的CSR是普通写入，停止标志原样保留
+        assert!(!tx.peer_stopped());
+        tx.bank().write(Ring::PEER_CSR, CSR_STOPPED);
+        assert!(tx.peer_stopped());
+        assert_eq!(rx.own_csr(), CSR_STOPPED);
+    }
+}
@@ -0,0 +1,92 @@
+//! 主机上模拟的寄存器窗口：两端共享同一组寄存器，每端的视图都把自己的发送区放在前半。
+//! 自己CSR的写1清零与使能位按硬件约定模拟，中断不模拟，使用者轮询tail即可。
+
+use crate::{RegisterBank, ENABLE_BIT, VALID_MASK};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::vec::Vec;
+
+/// 两个接收区，每个为regs个消息寄存器加IR与CSR
+pub struct MockRegisters {
+    half: usize,
+    regs: Vec<AtomicU64>,
+}
+
+impl MockRegisters {
+    /// 两端的CSR都处于开中断状态
+    pub fn new(regs: usize) -> Arc<Self> {
+        let half = regs + 2;
+        let regs: Vec<AtomicU64> = (0..2 * half).map(|_| AtomicU64::new(0)).collect();
+        regs[half - 1].store(ENABLE_BIT, Ordering::Relaxed);
+        regs[2 * half - 1].store(ENABLE_BIT, Ordering::Relaxed);
+        Arc::new(MockRegisters { half, regs })
+    }
+
+    /// side为0或1，两端的视图互为镜像
+    pub fn endpoint(self: &Arc<Self>, side: usize) -> MockBank {
+        MockBank { regs: self.clone(), offset: if side == 0 { 0 } else { self.half } }
+    }
+}
+
+/// 一端看到的寄存器窗口
+pub struct MockBank {
+    regs: Arc<MockRegisters>,
+    offset: usize,
+}
+
+impl MockBank {
+    #[inline(always)]
+    fn map(&self, index: usize) -> usize {
+        let window = 2 * self.regs.half;
+        let i = index + self.offset;
+        if i >= window { i - window } else { i }
+    }
+
+    #[inline(always)]
+    fn reg(&self, index: usize) -> &AtomicU64 {
+        &self.regs.regs[self.map(index)]
+    }
+
+    /// 同一个接收区中从index开始的len个寄存器
+    #[inline(always)]
+    fn run(&self, index: usize, len: usize) -> &[AtomicU64] {
+        let base = self.map(index);
+        &self.regs.regs[base..base + len]
+    }
+}
+
+impl RegisterBank for MockBank {
+    #[inline]
+    fn read(&self, index: usize) -> u64 {
+        self.reg(index).load(Ordering::Acquire)
+    }
+
+    #[inline]
+    fn write(&self, index: usize, val: u64) {
+        let reg = self.reg(index);
+        if index != 2 * self.regs.half - 1 {
+            reg.store(val, Ordering::Release);
+            return;
+        }
+        // 自己的CSR：使能位按普通位写入，其余位写1清零
+        let _ = reg.fetch_update(Ordering::AcqRel, Ordering::Relaxed, |old| {
+            Some((old & VALID_MASK & !(val & VALID_MASK)) | (val & ENABLE_BIT))
+        });
+    }
+
+    #[inline]
+    fn write_run(&self, index: usize, src: &[u64]) {
+        // 随后对IR的Release写保证这些寄存器先被对方看到
+        for (reg, &val) in self.run(index, src.len()).iter().zip(src) {
+            reg.store(val, Ordering::Relaxed);
+        }
+    }
+
+    #[inline]
+    fn read_run(&self, index: usize, dst: &mut [u64]) {
+        let len = dst.len();
+        for (val, reg) in dst.iter_mut().zip(self.run(index, len)) {
+            *val = reg.load(Ordering::Relaxed);
+        }
+    }
+}
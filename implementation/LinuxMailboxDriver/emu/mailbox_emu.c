@@ -0,0 +1,718 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include "mailbox_emu.h"
+
+/* 等待对方时让出CPU之前的空转次数，只有一个在线CPU时不空转 */
+#define EMU_SPIN_LOOPS 1024
+
+static inline void emu_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * 等待对方的一次空转：先忙等spin_loops次，之后每次让出CPU。
+ * 两端共用一个CPU时忙等只会推迟对方，单CPU上spin_loops为0。
+ */
+static inline void emu_spin_wait(struct emu_endpoint *ep, unsigned int *spins)
+{
+    if (++*spins < ep->spin_loops)
+        emu_cpu_relax();
+    else
+        sched_yield();
+}
+
+static uint64_t emu_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* 把端点窗口中的地址翻译成寄存器堆中的寄存器，bank返回该寄存器所在的接收区 */
+static inline uint64_t *emu_reg(const volatile void *addr, struct emu_endpoint **epp, int *bank)
+{
+    uintptr_t a = (uintptr_t)addr;
+    struct emu_endpoint *ep = *(struct emu_endpoint **)(a & ~(uintptr_t)(EMU_VIEW_SIZE - 1));
+    unsigned int off = a & (EMU_VIEW_SIZE - 1);
+
+    *epp = ep;
+    *bank = off >= EMU_VIEW_RX_BASE ? ep->self : !ep->self;
+    return &ep->rf->bank[*bank].regs[(off & (EMU_VIEW_RX_BASE - 1)) / 8];
+}
+
+static inline bool emu_irq_cond(uint64_t csr)
+{
+    return (csr & A2CMAILBOX_INT_ENA) && (csr & MAILBOX_CSR_VALID_MASK);
+}
+
+/* 向bank的所有者投递中断，与硬件一样只在条件由假变真时触发 */
+static void emu_raise(struct emu_endpoint *ep, int bank)
+{
+    uint64_t one = 1;
+    int fd = bank == ep->self ? ep->irq_fd : ep->peer_irq_fd;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        abort();
+}
+
+uint64_t emu_readq(const volatile void *addr)
+{
+    struct emu_endpoint *ep;
+    int bank;
+    uint64_t *reg = emu_reg(addr, &ep, &bank);
+
+    ep->mmio_reads++;
+    return __atomic_load_n(reg, __ATOMIC_ACQUIRE);
+}
+
+void emu_writeq(uint64_t val, volatile void *addr)
+{
+    struct emu_endpoint *ep;
+    int bank;
+    uint64_t *reg = emu_reg(addr, &ep, &bank);
+    uint64_t old, new;
+
+    ep->mmio_writes++;
+    if (reg != &ep->rf->bank[bank].regs[ep->rf->reg_num + 1])
+    {
+        __atomic_store_n(reg, val, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (bank == ep->self)
+    {
+        // 自己的CSR：使能位按普通位写入，其余位写1清零
+        old = __atomic_load_n(reg, __ATOMIC_RELAXED);
+        do
+            new = ((old & MAILBOX_CSR_VALID_MASK) & ~(val & MAILBOX_CSR_VALID_MASK)) | (val & A2CMAILBOX_INT_ENA);
+        while (!__atomic_compare_exchange_n(reg, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    }
+    else
+    {
+        // 对方的CSR：写1就是真的写1
+        new = val;
+        old = __atomic_exchange_n(reg, new, __ATOMIC_ACQ_REL);
+    }
+    if (!emu_irq_cond(old) && emu_irq_cond(new))
+        emu_raise(ep, bank);
+}
+
+/* 连续写入count个消息寄存器，只翻译一次地址，调用者保证不跨越IR与CSR */
+void emu_write_copy(volatile void *to, const uint64_t *from, size_t count)
+{
+    struct emu_endpoint *ep;
+    int bank;
+    uint64_t *reg = emu_reg(to, &ep, &bank);
+    size_t i;
+
+    ep->mmio_writes += count;
+    for (i = 0; i < count; ++i)
+        __atomic_store_n(&reg[i], from[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void emu_regfile_init(struct emu_regfile *rf, unsigned int reg_num)
+{
+    memset(rf, 0, sizeof(*rf));
+    rf->reg_num = reg_num;
+    rf->bank[0].regs[reg_num + 1] = A2CMAILBOX_INT_ENA;
+    rf->bank[1].regs[reg_num + 1] = C2AMAILBOX_INT_ENA;
+}
+
+int emu_endpoint_init(struct emu_endpoint *ep, struct emu_regfile *rf, int self, int irq_fd, int peer_irq_fd)
+{
+    memset(ep, 0, sizeof(*ep));
+    ep->membase = aligned_alloc(EMU_VIEW_SIZE, EMU_VIEW_SIZE);
+    if (!ep->membase)
+        return -ENOMEM;
+    *(struct emu_endpoint **)ep->membase = ep;
+    ep->rf = rf;
+    ep->self = self;
+    ep->irq_fd = irq_fd;
+    ep->peer_irq_fd = peer_irq_fd;
+    ep->rx_idle_us = 50;
+    ep->block_banks = 2;
+    ep->spin_loops = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? EMU_SPIN_LOOPS : 0;
+    mailbox_ring_setup(&ep->ring, ep->membase, 0, rf->reg_num, EMU_VIEW_RX_BASE, rf->reg_num);
+    pthread_spin_init(&ep->ir_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&ep->tx_lock, NULL);
+    ep->ir_shadow = readq(ep->membase + ep->ring.own_ir) & ~MAILBOX_IR_TX_WAIT;
+    ep->tx_peer_head = mailbox_ring_tx_head_init(&ep->ring, ep->ir_shadow);
+    ep->tx_peer_stopped = readq(ep->membase + ep->ring.peer_csr) == MAILBOX_CSR_STOPPED;
+    return 0;
+}
+
+void emu_endpoint_destroy(struct emu_endpoint *ep)
+{
+    unsigned int c, t;
+
+    for (c = 0; c < MAILBOX_MAX_CHANNELS; ++c)
+        for (t = 0; t < 256; ++t)
+            free(ep->rx_partial[c][t]);
+    free(ep->desc_busy);
+    free(ep->desc_seq);
+    free(ep->txq.words);
+    pthread_mutex_destroy(&ep->tx_lock);
+    pthread_spin_destroy(&ep->ir_lock);
+    free(ep->membase);
+}
+
+/* 修改自己IR中的字段并写回 */
+static void emu_update_ir(struct emu_endpoint *ep, uint64_t mask, uint64_t val)
+{
+    pthread_spin_lock(&ep->ir_lock);
+    ep->ir_shadow = (ep->ir_shadow & ~mask) | val;
+    writeq(ep->ir_shadow, ep->membase + ep->ring.own_ir);
+    pthread_spin_unlock(&ep->ir_lock);
+}
+
+/*
+ * 写入words，对方接收区满时原地重读head，分片可以跨越两次写入。
+ * banks不为0时按块模式写入：每个分片等对方接收区放得下整个分片后写入。停等（banks为1）时每个分片单独写入；
+ * 流水线时与mailbox_tx_gather相同，放得下的若干个bank一次写入、敲一次门铃，门铃位按mailbox_block_doorbell选择。
+ */
+static void emu_tx_push_all(struct emu_endpoint *ep, const uint64_t *words, unsigned int count, uint64_t bits, unsigned int banks)
+{
+    unsigned int done = 0, spins = 0, frag;
+    int tail, free_regs, n;
+    uint64_t kick;
+
+    while (done < count)
+    {
+        frag = 1 + MAILBOX_FRAG_WORDS(words[done]);
+        // 与mailbox_tx_drain相同：流式写入时缓存的head显示已满才读对方IR，块模式分片要整片放得下
+        free_regs = mailbox_ring_tx_free(&ep->ring, ep->ir_shadow, &ep->tx_peer_head, &tail, banks ? (int)frag : 1, NULL);
+        if (free_regs == 0 || (banks && free_regs < (int)frag))
+        {
+            ep->tx_full_spins++;
+            emu_spin_wait(ep, &spins);
+            continue;
+        }
+        spins = 0;
+        kick = bits;
+        if (!banks)
+        {
+            n = count - done < (unsigned int)free_regs ? (int)(count - done) : free_regs;
+        }
+        else
+        {
+            // 对方读前一个bank时接着写后面放得下的bank
+            n = 0;
+            do
+            {
+                n += frag;
+                ep->tx_blocks++;
+                if (mailbox_block_doorbell(&ep->ring, words[done + n - frag]))
+                    kick |= MAILBOX_CSR_BLOCK;
+            } while (banks > 1 && done + n < count && n + (frag = 1 + MAILBOX_FRAG_WORDS(words[done + n])) <= (unsigned int)free_regs);
+        }
+        tail = mailbox_ring_write(&ep->ring, tail, words + done, n);
+        emu_update_ir(ep, MAILBOX_IR_TAIL_MASK, (uint64_t)tail << MAILBOX_IR_TAIL_SHIFT);
+        ep->tx_peer_stopped = mailbox_ring_kick(&ep->ring, kick) == MAILBOX_CSR_STOPPED;
+        done += n;
+    }
+}
+
+/*
+ * 写出接收线程攒下的交还分片，只在持有发送锁且分片之间调用。
+ * 对方接收区放不下时留到下一次，不在这里等待：对方可能也在等我们读空接收区。
+ */
+static void emu_desc_done_flush(struct emu_endpoint *ep)
+{
+    unsigned int head = __atomic_load_n(&ep->desc_done_head, __ATOMIC_ACQUIRE), n = 0;
+    uint64_t frame[2];
+    int tail;
+
+    while (ep->desc_done_tail != head)
+    {
+        if (mailbox_ring_tx_free(&ep->ring, ep->ir_shadow, &ep->tx_peer_head, &tail, 2, NULL) < 2)
+            break;
+        mailbox_desc_frame(frame, 0, 0, MAILBOX_FRAG_DONE, 0, ep->desc_done[ep->desc_done_tail % EMU_DESC_DONE_MAX]);
+        tail = mailbox_ring_write(&ep->ring, tail, frame, 2);
+        emu_update_ir(ep, MAILBOX_IR_TAIL_MASK, (uint64_t)tail << MAILBOX_IR_TAIL_SHIFT);
+        __atomic_store_n(&ep->desc_done_tail, ep->desc_done_tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    if (n)
+        ep->tx_peer_stopped = mailbox_ring_kick(&ep->ring, MAILBOX_CSR_DOORBELL) == MAILBOX_CSR_STOPPED;
+}
+
+/* 接收线程中调用：发送线程持有锁时由它在下一次发送后写出 */
+static void emu_desc_done_try_flush(struct emu_endpoint *ep)
+{
+    if (pthread_mutex_trylock(&ep->tx_lock))
+        return;
+    emu_desc_done_flush(ep);
+    pthread_mutex_unlock(&ep->tx_lock);
+}
+
+static bool emu_desc_done_pending(struct emu_endpoint *ep)
+{
+    return __atomic_load_n(&ep->desc_done_tail, __ATOMIC_ACQUIRE) != ep->desc_done_head;
+}
+
+int emu_desc_init(struct emu_endpoint *ep, void *shm, size_t shm_size, size_t slot_size)
+{
+    size_t half = shm_size / 2;
+
+    if (slot_size == 0 || slot_size % 4096 || half % 4096 || half < slot_size ||
+        half / slot_size > EMU_DESC_DONE_MAX || half / slot_size > MAILBOX_DESC_MAX_SLOTS)
+        return -EINVAL;
+    ep->desc_slots = half / slot_size;
+    ep->desc_slot_size = slot_size;
+    ep->desc_busy = calloc(ep->desc_slots, sizeof(*ep->desc_busy));
+    ep->desc_seq = calloc(ep->desc_slots, sizeof(*ep->desc_seq));
+    if (!ep->desc_busy || !ep->desc_seq)
+        return -ENOMEM;
+    // Linux端写C2A池，ASP端写A2C池
+    ep->desc_tx_pool = (uint8_t *)shm + (ep->self ? half : 0);
+    ep->desc_rx_pool = (uint8_t *)shm + (ep->self ? 0 : half);
+    return 0;
+}
+
+unsigned int emu_desc_alloc(struct emu_endpoint *ep)
+{
+    unsigned int b, spins = 0;
+
+    for (;;)
+    {
+        for (b = 0; b < ep->desc_slots; ++b)
+        {
+            if (__atomic_load_n(&ep->desc_busy[b], __ATOMIC_ACQUIRE))
+                continue;
+            ep->desc_busy[b] = 1;
+            ep->desc_seq[b]++;
+            return b;
+        }
+        ep->tx_desc_waits++;
+        emu_spin_wait(ep, &spins);
+    }
+}
+
+int emu_desc_submit(struct emu_endpoint *ep, unsigned int chan, uint8_t task, unsigned int buf, size_t len)
+{
+    uint64_t frame[2];
+
+    if (chan >= MAILBOX_MAX_CHANNELS || buf >= ep->desc_slots || len > ep->desc_slot_size)
+        return -EINVAL;
+    if (ep->tx_peer_stopped)
+        return -EPIPE;
+    // 描述符分片写入前缓冲区的内容已经可见，emu_tx_push_all中IR的release写保证这一点
+    mailbox_desc_frame(frame, chan, task, 0, len, MAILBOX_DESC(buf, ep->desc_seq[buf], 0));
+    pthread_mutex_lock(&ep->tx_lock);
+    emu_tx_push_all(ep, frame, 2, MAILBOX_CSR_DOORBELL, 0);
+    emu_desc_done_flush(ep);
+    pthread_mutex_unlock(&ep->tx_lock);
+    ep->tx_descs++;
+    return 0;
+}
+
+int emu_txq_init(struct emu_endpoint *ep, unsigned long size)
+{
+    if (size < 2 * (1 + MAILBOX_MAX_REG_NUM) || (size & (size - 1)))
+        return -EINVAL;
+    ep->txq.words = calloc(size, sizeof(uint64_t));
+    if (!ep->txq.words)
+        return -ENOMEM;
+    ep->txq.size = size;
+    return 0;
+}
+
+/* 与mailbox_tx_drain相同：按完整分片把提交环中已提交的内容搬进对方接收区，调用者持有tx_lock */
+static void emu_txq_drain(struct emu_endpoint *ep)
+{
+    unsigned int n, frag, spins = 0;
+    int tail, free_regs;
+    uint64_t hdr;
+
+    while (mailbox_txq_peek(&ep->txq, &hdr))
+    {
+        frag = 1 + MAILBOX_FRAG_WORDS(hdr);
+        free_regs = mailbox_ring_tx_free(&ep->ring, ep->ir_shadow, &ep->tx_peer_head, &tail, frag, NULL);
+        if (free_regs < (int)frag)
+        {
+            ep->tx_full_spins++;
+            emu_spin_wait(ep, &spins);
+            continue;
+        }
+        spins = 0;
+        n = 0;
+        do
+        {
+            n += mailbox_txq_out(&ep->txq, ep->tx_chunk + n, frag);
+        } while (mailbox_txq_peek(&ep->txq, &hdr) && n + (frag = 1 + MAILBOX_FRAG_WORDS(hdr)) <= (unsigned int)free_regs);
+        tail = mailbox_ring_write(&ep->ring, tail, ep->tx_chunk, n);
+        emu_update_ir(ep, MAILBOX_IR_TAIL_MASK, (uint64_t)tail << MAILBOX_IR_TAIL_SHIFT);
+        ep->tx_peer_stopped = mailbox_ring_kick(&ep->ring, MAILBOX_CSR_DOORBELL) == MAILBOX_CSR_STOPPED;
+    }
+}
+
+/* 与mailbox_tx_pump相同：抢不到tx_lock时留下请求，由持有者再搬运一轮 */
+static void emu_tx_pump(struct emu_endpoint *ep)
+{
+    __atomic_store_n(&ep->tx_pump_req, 1, __ATOMIC_SEQ_CST);
+    while (pthread_mutex_trylock(&ep->tx_lock) == 0)
+    {
+        __atomic_store_n(&ep->tx_pump_req, 0, __ATOMIC_SEQ_CST);
+        emu_txq_drain(ep);
+        emu_desc_done_flush(ep);
+        pthread_mutex_unlock(&ep->tx_lock);
+        if (!__atomic_load_n(&ep->tx_pump_req, __ATOMIC_SEQ_CST))
+            break;
+    }
+}
+
+/* 把len字节拷进提交环中pos开始的寄存器，未提交的位置总是0，不满8字节的末尾自然补0 */
+static void emu_txq_copy(struct mailbox_txq *q, unsigned long pos, const uint8_t *src, size_t len)
+{
+    unsigned long off = pos & (q->size - 1);
+    size_t first = len < (q->size - off) * sizeof(uint64_t) ? len : (q->size - off) * sizeof(uint64_t);
+
+    memcpy(&q->words[off], src, first);
+    memcpy(q->words, src + first, len - first);
+}
+
+/* 与mailbox_send_iter的无锁路径相同：直接在预留的条目中组帧，提交环容纳不下的消息拆成多个条目 */
+static int emu_txq_send(struct emu_endpoint *ep, unsigned int chan, uint8_t task, const uint8_t *src, size_t len)
+{
+    unsigned int frag_words = mailbox_frag_max_words(&ep->ring), frag = 0, w;
+    size_t per_entry = ep->txq.size / 2 / (1 + frag_words) * frag_words * sizeof(uint64_t);
+    size_t staged = 0, bytes, n;
+    unsigned long pos, p, words;
+    uint64_t hdr;
+
+    do
+    {
+        bytes = len - staged < per_entry ? len - staged : per_entry;
+        words = mailbox_frame_words(bytes, frag_words);
+        while (!mailbox_txq_reserve(&ep->txq, words, &pos))
+        {
+            __atomic_fetch_add(&ep->tx_txq_waits, 1, __ATOMIC_RELAXED);
+            emu_tx_pump(ep);
+            sched_yield();
+        }
+        for (p = pos + 1; p < pos + 1 + words; p += 1 + w)
+        {
+            n = len - staged < frag_words * sizeof(uint64_t) ? len - staged : frag_words * sizeof(uint64_t);
+            w = (n + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            hdr = MAILBOX_FRAG_HEADER(chan, task, w, (frag == 0 ? MAILBOX_FRAG_FIRST : 0) | (staged + n == len ? MAILBOX_FRAG_LAST : 0),
+                                      frag == 0 ? len : frag);
+            mailbox_txq_put(&ep->txq, p, &hdr, 1);
+            emu_txq_copy(&ep->txq, p + 1, src + staged, n);
+            staged += n;
+            frag++;
+        }
+        mailbox_txq_commit(&ep->txq, pos, words, false);
+        emu_tx_pump(ep);
+    } while (staged < len);
+    return 0;
+}
+
+int emu_send(struct emu_endpoint *ep, unsigned int chan, uint8_t task, const void *buf, size_t len)
+{
+    uint64_t frame[512];
+    const uint8_t *src = buf;
+    size_t staged = 0, n;
+    unsigned int frag = 0, words, w;
+    uint64_t flags, mode;
+    bool block = ep->block_threshold && len >= ep->block_threshold;
+    unsigned int banks = ep->block_banks < 1 ? 1 : ep->block_banks > MAILBOX_MAX_BANKS ? MAILBOX_MAX_BANKS : ep->block_banks;
+    unsigned int frag_words = block ? mailbox_block_frag_words(&ep->ring, banks) : mailbox_frag_max_words(&ep->ring);
+
+    if (chan >= MAILBOX_MAX_CHANNELS || len > UINT32_MAX)
+        return -EINVAL;
+    if (ep->tx_peer_stopped)
+        return -EPIPE;
+    if (ep->tx_mpsc)
+        return emu_txq_send(ep, chan, task, buf, len);
+    if (ep->desc_slots && ep->desc_threshold && len >= ep->desc_threshold && len <= ep->desc_slot_size)
+    {
+        w = emu_desc_alloc(ep);
+        memcpy(emu_desc_buf(ep, w), buf, len);
+        return emu_desc_submit(ep, chan, task, w, len);
+    }
+
+    // 与mailbox_send_iter相同：按中转页组帧，只有整条消息的最后一个寄存器补0
+    mode = block ? MAILBOX_FRAG_BLOCK : 0;
+    do
+    {
+        w = 0;
+        while (w + 1 < 512 && (staged < len || frag == 0))
+        {
+            n = len - staged;
+            if (n > frag_words * sizeof(uint64_t))
+                n = frag_words * sizeof(uint64_t);
+            if (n > (512 - w - 1) * sizeof(uint64_t))
+                n = (512 - w - 1) * sizeof(uint64_t);
+            words = (n + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            flags = mode | (frag == 0 ? MAILBOX_FRAG_FIRST : 0) | (staged + n == len ? MAILBOX_FRAG_LAST : 0);
+            if (block)
+                flags |= MAILBOX_FRAG_SET_BANK(frag % banks);
+            frame[w] = MAILBOX_FRAG_HEADER(chan, task, words, flags, frag == 0 ? len : frag);
+            if (n % sizeof(uint64_t))
+                frame[w + words] = 0;
+            memcpy(&frame[w + 1], src + staged, n);
+            w += 1 + words;
+            staged += n;
+            frag++;
+        }
+        pthread_mutex_lock(&ep->tx_lock);
+        emu_tx_push_all(ep, frame, w, MAILBOX_CSR_DOORBELL, block ? banks : 0);
+        emu_desc_done_flush(ep);
+        pthread_mutex_unlock(&ep->tx_lock);
+    } while (staged < len);
+    return 0;
+}
+
+static void emu_rx_drop_partial(struct emu_endpoint *ep, unsigned int chan, uint8_t task)
+{
+    if (!ep->rx_partial[chan][task])
+        return;
+    free(ep->rx_partial[chan][task]);
+    ep->rx_partial[chan][task] = NULL;
+    ep->rx_drops++;
+}
+
+/*
+ * 描述符分片：交还分片释放自己的缓冲区；描述符消息直接把对方池中的缓冲区交给回调，
+ * 回调返回后缓冲区即归还对方，回调需要保留数据时自行拷贝。
+ */
+static void emu_rx_desc(struct emu_endpoint *ep)
+{
+    uint64_t hdr = ep->rx_frag_hdr, desc = ep->rx_desc;
+    unsigned int buf = MAILBOX_DESC_BUF(desc), off = MAILBOX_DESC_OFF(desc), len = MAILBOX_FRAG_INFO(hdr);
+
+    if (hdr & MAILBOX_FRAG_DONE)
+    {
+        if (buf < ep->desc_slots && ep->desc_seq[buf] == MAILBOX_DESC_SEQ(desc))
+            __atomic_store_n(&ep->desc_busy[buf], 0, __ATOMIC_RELEASE);
+        else
+            ep->rx_desc_bad++;
+        return;
+    }
+    if (buf >= ep->desc_slots || off > ep->desc_slot_size || len > ep->desc_slot_size - off)
+    {
+        ep->rx_desc_bad++;
+        return;
+    }
+    ep->rx_descs++;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (ep->on_msg)
+        ep->on_msg(ep, MAILBOX_FRAG_CHAN(hdr), ep->desc_rx_pool + buf * ep->desc_slot_size + off, len, ep->on_msg_arg);
+    // 队列的容量不小于对方的缓冲区数，不会溢出
+    ep->desc_done[ep->desc_done_head % EMU_DESC_DONE_MAX] = desc;
+    __atomic_store_n(&ep->desc_done_head, ep->desc_done_head + 1, __ATOMIC_RELEASE);
+}
+
+/* 与驱动的mailbox_rx_frag_end相同，消息完整时交给回调 */
+static void emu_rx_frag_end(struct emu_endpoint *ep)
+{
+    unsigned int chan = MAILBOX_FRAG_CHAN(ep->rx_frag_hdr);
+    uint8_t task = MAILBOX_FRAG_TASK(ep->rx_frag_hdr);
+    struct emu_rx_msg *msg = ep->rx_partial[chan][task];
+
+    if (ep->rx_frag_hdr & MAILBOX_FRAG_BLOCK)
+        ep->rx_bank_acks |= MAILBOX_CSR_BANK_ACK(MAILBOX_FRAG_BANK(ep->rx_frag_hdr) % MAILBOX_MAX_BANKS);
+    if (ep->rx_frag_hdr & MAILBOX_FRAG_DESC)
+    {
+        emu_rx_desc(ep);
+        return;
+    }
+    if (!msg)
+        return;
+    if ((ep->rx_frag_hdr & MAILBOX_FRAG_ABORT) || ((ep->rx_frag_hdr & MAILBOX_FRAG_LAST) && msg->filled != msg->len))
+    {
+        emu_rx_drop_partial(ep, chan, task);
+        return;
+    }
+    if (!(ep->rx_frag_hdr & MAILBOX_FRAG_LAST))
+        return;
+    ep->rx_partial[chan][task] = NULL;
+    if (ep->on_msg)
+        ep->on_msg(ep, chan, msg->data, msg->len, ep->on_msg_arg);
+    free(msg);
+}
+
+static void emu_rx_frag_start(struct emu_endpoint *ep, uint64_t hdr)
+{
+    unsigned int chan = MAILBOX_FRAG_CHAN(hdr);
+    uint8_t task = MAILBOX_FRAG_TASK(hdr);
+    struct emu_rx_msg *msg;
+
+    ep->rx_frag_hdr = hdr;
+    ep->rx_frag_left = MAILBOX_FRAG_WORDS(hdr);
+    // 描述符分片不经过重组，唯一的payload寄存器是描述符
+    if (hdr & MAILBOX_FRAG_DESC)
+    {
+        if (ep->rx_frag_left == 0)
+            ep->rx_desc_bad++;
+        return;
+    }
+    if (hdr & MAILBOX_FRAG_FIRST)
+    {
+        emu_rx_drop_partial(ep, chan, task);
+        msg = malloc(sizeof(*msg) + MAILBOX_FRAG_INFO(hdr));
+        if (msg)
+        {
+            msg->len = MAILBOX_FRAG_INFO(hdr);
+            msg->filled = 0;
+            msg->next_frag = 1;
+        }
+        else
+        {
+            ep->rx_drops++;
+        }
+        ep->rx_partial[chan][task] = msg;
+    }
+    else if (ep->rx_partial[chan][task])
+    {
+        if (MAILBOX_FRAG_INFO(hdr) == ep->rx_partial[chan][task]->next_frag)
+            ep->rx_partial[chan][task]->next_frag++;
+        else
+            emu_rx_drop_partial(ep, chan, task);
+    }
+    if (ep->rx_frag_left == 0)
+        emu_rx_frag_end(ep);
+}
+
+static void emu_rx_reassemble(struct emu_endpoint *ep, const uint64_t *words, int count)
+{
+    struct emu_rx_msg *msg;
+    int i = 0, n;
+    size_t bytes;
+
+    while (i < count)
+    {
+        if (ep->rx_frag_left == 0)
+        {
+            emu_rx_frag_start(ep, words[i++]);
+            continue;
+        }
+        n = (int)ep->rx_frag_left < count - i ? (int)ep->rx_frag_left : count - i;
+        if (ep->rx_frag_hdr & MAILBOX_FRAG_DESC)
+            ep->rx_desc = words[i + n - 1];
+        msg = ep->rx_partial[MAILBOX_FRAG_CHAN(ep->rx_frag_hdr)][MAILBOX_FRAG_TASK(ep->rx_frag_hdr)];
+        if (msg && !(ep->rx_frag_hdr & MAILBOX_FRAG_DESC))
+        {
+            bytes = n * sizeof(uint64_t);
+            if (bytes > msg->len - msg->filled)
+                bytes = msg->len - msg->filled;
+            memcpy(msg->data + msg->filled, words + i, bytes);
+            msg->filled += bytes;
+        }
+        i += n;
+        ep->rx_frag_left -= n;
+        if (ep->rx_frag_left == 0)
+            emu_rx_frag_end(ep);
+    }
+}
+
+/* 与mailbox_rx_drain相同：读出head到tail之间的全部寄存器，先归还接收区再重组 */
+static int emu_rx_drain(struct emu_endpoint *ep)
+{
+    uint64_t receive_info_reg = readq(ep->membase + ep->ring.peer_ir);
+    int tail = mailbox_ring_rx_tail(receive_info_reg);
+    uint64_t msgs[MAILBOX_MAX_REG_NUM];
+    int n;
+
+    n = mailbox_ring_read(&ep->ring, ep->ir_shadow & MAILBOX_IR_HEAD_MASK, tail, msgs);
+    if (n <= 0)
+        return 0;
+    emu_update_ir(ep, MAILBOX_IR_HEAD_MASK, tail);
+    if (receive_info_reg & MAILBOX_IR_TX_WAIT)
+        mailbox_ring_kick(&ep->ring, MAILBOX_CSR_HEAD_NOTIFY);
+    emu_rx_reassemble(ep, msgs, n);
+    if (emu_desc_done_pending(ep))
+        emu_desc_done_try_flush(ep);
+    if (ep->rx_bank_acks)
+    {
+        mailbox_ring_kick(&ep->ring, ep->rx_bank_acks);
+        ep->rx_bank_acks = 0;
+    }
+    return n;
+}
+
+static bool emu_rx_pending(struct emu_endpoint *ep)
+{
+    return mailbox_ring_rx_tail(readq(ep->membase + ep->ring.peer_ir)) != (int)(ep->ir_shadow & MAILBOX_IR_HEAD_MASK);
+}
+
+void *emu_rx_thread(void *arg)
+{
+    struct emu_endpoint *ep = arg;
+    uint64_t count, csr, pending, idle_since, idle_ns = ep->rx_idle_us * 1000ull;
+    unsigned int spins;
+    bool block;
+
+    while (!ep->stop)
+    {
+        if (read(ep->irq_fd, &count, sizeof(count)) != sizeof(count))
+            continue;
+
+        // 与mailbox_interrupt相同：清门铃并屏蔽中断
+        csr = readq(ep->membase + ep->ring.own_csr);
+        pending = csr & MAILBOX_CSR_VALID_MASK;
+        if (!pending)
+            continue;
+        writeq(pending, ep->membase + ep->ring.own_csr);
+        ep->irqs++;
+        block = pending & MAILBOX_CSR_BLOCK;
+        if (block)
+            ep->rx_blocks++;
+
+        // 与mailbox_rx_thread相同：一直读到对方rx_idle_us内没有推进tail，开中断后再检查一次
+        idle_since = emu_now_ns();
+        spins = 0;
+        while (!ep->stop)
+        {
+            if (emu_rx_drain(ep))
+            {
+                idle_since = emu_now_ns();
+                spins = 0;
+                continue;
+            }
+            // 交还分片写出前不开中断，否则对方等缓冲区而本端在等中断
+            if (emu_desc_done_pending(ep))
+            {
+                emu_desc_done_try_flush(ep);
+                if (emu_desc_done_pending(ep))
+                {
+                    sched_yield();
+                    continue;
+                }
+            }
+            // 与mailbox_rx_thread相同：门铃带MAILBOX_CSR_BLOCK时发送方要等应答才写下一个分片，读空后立即开中断；
+            // 流水线中间的bank不带该位，按空闲时间接着轮询
+            if (!block && !(readq(ep->membase + ep->ring.own_csr) & MAILBOX_CSR_BLOCK) && emu_now_ns() - idle_since < idle_ns)
+            {
+                // 两端共用一个CPU时，空闲等待中忙等会让发送方整段时间都推进不了tail
+                emu_spin_wait(ep, &spins);
+                continue;
+            }
+            block = false;
+            writeq(A2CMAILBOX_INT_ENA | MAILBOX_CSR_VALID_MASK, ep->membase + ep->ring.own_csr);
+            if (!emu_rx_pending(ep))
+                break;
+            writeq(MAILBOX_CSR_VALID_MASK, ep->membase + ep->ring.own_csr);
+            idle_since = emu_now_ns();
+        }
+        ep->rx_rearms++;
+    }
+    return NULL;
+}
+
+void emu_rx_stop(struct emu_endpoint *ep)
+{
+    uint64_t one = 1;
+
+    ep->stop = true;
+    if (write(ep->irq_fd, &one, sizeof(one)) != sizeof(one))
+        abort();
+}
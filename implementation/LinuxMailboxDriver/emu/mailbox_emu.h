@@ -0,0 +1,170 @@
+/*
+ * 用户态mailbox寄存器堆模拟器：两个端点共享两个接收区，每个接收区的消息寄存器数在初始化时给出，
+ * 自己CSR的写1清零、中断使能位与IR中的head/tail按硬件约定模拟，中断通过eventfd投递。
+ * 端点的收发直接调用驱动使用的sw_mailbox_ring.h，协议改动可以在任意Linux机器上对比。
+ */
+#ifndef _MAILBOX_EMU_H
+#define _MAILBOX_EMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "sw_mailbox.h"
+
+#define __iomem
+
+uint64_t emu_readq(const volatile void *addr);
+void emu_writeq(uint64_t val, volatile void *addr);
+void emu_write_copy(volatile void *to, const uint64_t *from, size_t count);
+
+static inline uint64_t readq(const volatile void *addr)
+{
+    return emu_readq(addr);
+}
+
+static inline void writeq(uint64_t val, volatile void *addr)
+{
+    emu_writeq(val, addr);
+}
+
+static inline void __iowrite64_copy(volatile void *to, const void *from, size_t count)
+{
+    emu_write_copy(to, from, count);
+}
+
+#include "sw_mailbox_ring.h"
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define cmpxchg(p, o, n) __sync_val_compare_and_swap(p, o, n)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#include "sw_mailbox_txq.h"
+
+/* 端点看到的地址窗口大小，窗口按该大小对齐，首个指针指向所属端点 */
+#define EMU_VIEW_SIZE 0x1000
+/* 窗口前半映射到对方的接收区，后半映射到自己的接收区 */
+#define EMU_VIEW_RX_BASE 0x800
+
+/* 描述符模式中待交还的描述符，接收线程产生，持有发送锁者写入对方接收区 */
+#define EMU_DESC_DONE_MAX 1024
+
+/* 一个接收区：reg_num个消息寄存器、IR与CSR */
+struct emu_bank
+{
+    uint64_t regs[MAILBOX_MAX_REG_NUM + 2];
+};
+
+/* 两端共享的寄存器堆，可以放在进程间共享的内存中 */
+struct emu_regfile
+{
+    unsigned int reg_num;
+    struct emu_bank bank[2];
+};
+
+struct emu_endpoint;
+/* 收到一条完整消息时在接收线程中调用 */
+typedef void (*emu_msg_fn)(struct emu_endpoint *ep, unsigned int chan, const void *data, size_t len, void *arg);
+
+struct emu_rx_msg
+{
+    size_t len;
+    size_t filled;
+    unsigned int next_frag;
+    uint8_t data[];
+};
+
+struct emu_endpoint
+{
+    unsigned char *membase; /* 按驱动的寄存器偏移访问的窗口，readq/writeq把它翻译到寄存器堆 */
+    struct mailbox_ring ring; /* 窗口中两个接收区的布局 */
+    struct emu_regfile *rf;
+    int self;     /* 自己的接收区所在的bank */
+    int irq_fd;   /* 自己的中断 */
+    int peer_irq_fd;
+
+    /* 与驱动相同：IR只由本端写，收发两侧分别修改head与tail字段 */
+    uint64_t ir_shadow;
+    pthread_spinlock_t ir_lock;
+    pthread_mutex_t tx_lock; /* 发送线程与交还描述符的接收线程之间保证分片不交错 */
+    /* 与驱动相同的多写者提交环：tx_mpsc时emu_send无锁预留条目，由抢到tx_lock的一方搬运 */
+    struct mailbox_txq txq;
+    bool tx_mpsc;
+    int tx_pump_req;
+    uint64_t tx_chunk[MAILBOX_MAX_REG_NUM];
+    int tx_peer_head;     /* 上次读到的对方head */
+    bool tx_peer_stopped; /* 敲门铃时读到对方CSR为停止标志 */
+
+    /* 描述符模式：与驱动相同，共享内存前半为C2A池，后半为A2C池，每个池切成desc_slot_size字节的缓冲区 */
+    uint8_t *desc_tx_pool;
+    const uint8_t *desc_rx_pool;
+    size_t desc_slot_size;
+    unsigned int desc_slots;
+    uint8_t *desc_busy; /* 发送线程置位，收到对方的交还分片时由接收线程清零 */
+    uint16_t *desc_seq;
+    size_t desc_threshold; /* emu_send中不小于该字节数的消息拷进缓冲区后以描述符发送，0表示不使用 */
+    uint64_t desc_done[EMU_DESC_DONE_MAX];
+    unsigned int desc_done_head, desc_done_tail;
+
+    /* 发送：不小于block_threshold字节的消息按块模式发送，0表示总是流式发送；block_banks为1时停等 */
+    size_t block_threshold;
+    unsigned int block_banks;
+
+    unsigned int spin_loops; /* 等待对方时让出CPU之前的忙等次数，初始化时按在线CPU数选择 */
+
+    /* 接收 */
+    unsigned int rx_idle_us;
+    volatile bool stop;
+    emu_msg_fn on_msg;
+    void *on_msg_arg;
+    uint64_t rx_frag_hdr;
+    unsigned int rx_frag_left;
+    uint64_t rx_bank_acks;
+    uint64_t rx_desc;
+    struct emu_rx_msg *rx_partial[MAILBOX_MAX_CHANNELS][256];
+
+    /* 统计 */
+    uint64_t tx_full_spins;
+    uint64_t tx_blocks;
+    uint64_t rx_blocks;
+    uint64_t irqs;
+    uint64_t rx_rearms;
+    uint64_t rx_drops;
+    uint64_t tx_txq_waits; /* 提交环满时写者等待的次数 */
+    uint64_t tx_descs;
+    uint64_t tx_desc_waits; /* 分配缓冲区时全部在对方手中而空转的次数 */
+    uint64_t rx_descs;
+    uint64_t rx_desc_bad;
+    uint64_t mmio_reads;  /* 经本端窗口的寄存器读写次数，块拷贝按寄存器数计 */
+    uint64_t mmio_writes;
+};
+
+/* 初始化寄存器堆：每个接收区reg_num个消息寄存器，两端都处于监听中断状态 */
+void emu_regfile_init(struct emu_regfile *rf, unsigned int reg_num);
+/* self为0时端点扮演Linux端（自己的接收区为A2C），为1时扮演ASP端 */
+int emu_endpoint_init(struct emu_endpoint *ep, struct emu_regfile *rf, int self, int irq_fd, int peer_irq_fd);
+void emu_endpoint_destroy(struct emu_endpoint *ep);
+
+/* 使用shm中的描述符缓冲池，两端传入同一块共享内存，大小与slot_size为页大小的倍数 */
+int emu_desc_init(struct emu_endpoint *ep, void *shm, size_t shm_size, size_t slot_size);
+/* 分配一个自己方向的缓冲区，全部在对方手中时原地等待交还，返回缓冲区号 */
+unsigned int emu_desc_alloc(struct emu_endpoint *ep);
+static inline void *emu_desc_buf(struct emu_endpoint *ep, unsigned int buf)
+{
+    return ep->desc_tx_pool + buf * ep->desc_slot_size;
+}
+/* 把缓冲区buf中的len字节以描述符发给对方，缓冲区在对方交还前不能再写，返回0或-errno */
+int emu_desc_submit(struct emu_endpoint *ep, unsigned int chan, uint8_t task, unsigned int buf, size_t len);
+
+/* 分配size个寄存器（2的幂）的提交环，之后置tx_mpsc即可让多个线程同时调用emu_send */
+int emu_txq_init(struct emu_endpoint *ep, unsigned long size);
+
+/* 与mailbox_send_iter相同的分片格式，对方接收区满时原地等待，返回0或-errno */
+int emu_send(struct emu_endpoint *ep, unsigned int chan, uint8_t task, const void *buf, size_t len);
+/* 接收线程：等待中断，之后与mailbox_rx_thread一样轮询到接收区空闲再开中断，直到stop被置位 */
+void *emu_rx_thread(void *arg);
+void emu_rx_stop(struct emu_endpoint *ep);
+
+#endif /* _MAILBOX_EMU_H */
@@ -0,0 +1,457 @@
+/*
+ * 在模拟的寄存器堆上测量Linux端到ASP端的单向传输：
+ * 吞吐阶段连续发送，统计msgs/s、bytes/s与发送端每KiB的寄存器读写次数；延迟阶段每次只有一条消息在途，统计p50/p99/p999。
+ * 默认两端为两个进程，-t时为同一进程中的两个线程；-r改变每个接收区的消息寄存器数，对比更大的寄存器窗口。
+ * 每个大小分别以环形FIFO流式发送、停等的块模式（每个分片独占接收区并等待应答）
+ * 与流水线块模式（接收区分成多个bank，对方读bank N时写bank N+1）各跑一遍，-m只跑其中一种。
+ * 描述符模式在其余模式之后单独跑：发送端直接在共享缓冲区中组好消息（每次只写入时间戳），寄存器中只有描述符，
+ * 接收端的回调直接读缓冲区，超过缓冲区大小的消息跳过。
+ * 多写者（-m mpsc）最后单独跑：1到32个写线程各用一个task同时发送同样大小的消息，只统计合计吞吐，
+ * 对比整条消息持有一把锁的串行发送（mutex）与无锁预留提交环条目的并发提交（mpsc）。
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mailbox_emu.h"
+
+#define BENCH_CHAN_DATA 0
+#define BENCH_CHAN_CTRL 1
+#define BENCH_MAX_SAMPLES 20000
+/* 描述符模式的共享内存：每个方向8个1MiB的缓冲区 */
+#define BENCH_DESC_SLOT_SIZE (1 << 20)
+#define BENCH_DESC_SHM_SIZE (16 << 20)
+/* 多写者模式：写线程数从1翻倍到32，提交环与驱动的TX_FIFO_SIZE相同 */
+#define BENCH_MAX_WRITERS 32
+#define BENCH_TXQ_SIZE 4096
+
+/* 两端共享的计数与延迟样本，放在进程间共享的内存中 */
+struct bench_shared
+{
+    struct emu_regfile rf;
+    volatile uint64_t rx_msgs;
+    volatile uint64_t rx_errors;
+    volatile uint64_t rx_last_ns;
+    volatile size_t expect_len;
+    uint64_t lat_ns[BENCH_MAX_SAMPLES];
+};
+
+static struct bench_shared *shared;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* 接收端回调：消息的前8字节为发送时间，最后一个字节为固定的填充值 */
+static void bench_on_msg(struct emu_endpoint *ep, unsigned int chan, const void *data, size_t len, void *arg)
+{
+    const uint8_t *p = data;
+    uint64_t sent, now = now_ns();
+    uint64_t n = shared->rx_msgs;
+
+    (void)arg;
+    if (chan == BENCH_CHAN_CTRL)
+    {
+        ep->stop = true;
+        return;
+    }
+    if (len != shared->expect_len || (len > 8 && p[len - 1] != 0xa5))
+        shared->rx_errors++;
+    if (len >= sizeof(sent))
+    {
+        memcpy(&sent, p, sizeof(sent));
+        if (n < BENCH_MAX_SAMPLES)
+            shared->lat_ns[n] = now - sent;
+    }
+    shared->rx_last_ns = now;
+    __atomic_store_n(&shared->rx_msgs, n + 1, __ATOMIC_RELEASE);
+}
+
+static void wait_rx(uint64_t target)
+{
+    while (__atomic_load_n(&shared->rx_msgs, __ATOMIC_ACQUIRE) < target)
+        sched_yield();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static void send_msg(struct emu_endpoint *ep, uint8_t *buf, size_t size, bool desc, uint8_t task)
+{
+    uint64_t t = now_ns();
+    unsigned int b;
+    int ret;
+
+    if (desc)
+    {
+        b = emu_desc_alloc(ep);
+        buf = emu_desc_buf(ep, b);
+    }
+    memcpy(buf, &t, size < sizeof(t) ? size : sizeof(t));
+    ret = desc ? emu_desc_submit(ep, BENCH_CHAN_DATA, task, b, size) : emu_send(ep, BENCH_CHAN_DATA, task, buf, size);
+    if (ret)
+    {
+        fprintf(stderr, "mailbox_emu_bench: peer stopped\n");
+        exit(1);
+    }
+}
+
+/* 对一个消息大小跑完吞吐与延迟两个阶段并打印一行结果，desc时banks不起作用 */
+static void bench_size(struct emu_endpoint *ep, size_t size, uint64_t count, const char *mode, unsigned int banks, bool desc)
+{
+    uint8_t *buf = malloc(size);
+    uint64_t samples = count < BENCH_MAX_SAMPLES ? count : BENCH_MAX_SAMPLES;
+    uint64_t i, t0, reads, writes, spins;
+    double secs, kib;
+
+    memset(buf, 0xa5, size);
+    shared->expect_len = size;
+    ep->block_threshold = banks ? 1 : 0;
+    ep->block_banks = banks;
+
+    // 吞吐：连续发送count条消息，以最后一条到达的时间为结束
+    shared->rx_msgs = 0;
+    reads = ep->mmio_reads;
+    writes = ep->mmio_writes;
+    spins = ep->tx_full_spins;
+    t0 = now_ns();
+    for (i = 0; i < count; ++i)
+        send_msg(ep, buf, size, desc, 1);
+    wait_rx(count);
+    secs = (shared->rx_last_ns - t0) / 1e9;
+    // 发送端每KiB消息的寄存器读写次数，不含对方接收区满时每次空转的重读
+    kib = count * (size ? size : 1) / 1024.0;
+    reads = ep->mmio_reads - reads - (ep->tx_full_spins - spins);
+    writes = ep->mmio_writes - writes;
+
+    // 延迟：每次只有一条消息在途
+    shared->rx_msgs = 0;
+    for (i = 0; i < samples; ++i)
+    {
+        send_msg(ep, buf, size, desc, 1);
+        wait_rx(i + 1);
+    }
+    qsort(shared->lat_ns, samples, sizeof(uint64_t), cmp_u64);
+
+    printf("%6s %10zu %10llu %12.0f %12.2f %8.1f %8.1f %10.2f %10.2f %10.2f\n", mode, size, (unsigned long long)count,
+           count / secs, count * size / secs / (1 << 20), reads / kib, writes / kib,
+           percentile_us(shared->lat_ns, samples, 0.50),
+           percentile_us(shared->lat_ns, samples, 0.99),
+           percentile_us(shared->lat_ns, samples, 0.999));
+    fflush(stdout);
+    free(buf);
+}
+
+struct bench_writer
+{
+    pthread_t thread;
+    struct emu_endpoint *ep;
+    pthread_mutex_t *lock; /* 非NULL时整条消息在锁内发送 */
+    uint8_t task;
+    size_t size;
+    uint64_t count;
+};
+
+static void *bench_writer_thread(void *arg)
+{
+    struct bench_writer *w = arg;
+    uint8_t *buf = malloc(w->size);
+    uint64_t i;
+
+    memset(buf, 0xa5, w->size);
+    for (i = 0; i < w->count; ++i)
+    {
+        if (w->lock)
+            pthread_mutex_lock(w->lock);
+        send_msg(w->ep, buf, w->size, false, w->task);
+        if (w->lock)
+            pthread_mutex_unlock(w->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* writers个线程合计发送约count条size字节的消息，打印合计吞吐 */
+static void bench_writers(struct emu_endpoint *ep, size_t size, uint64_t count, unsigned int writers, bool mpsc)
+{
+    static struct bench_writer w[BENCH_MAX_WRITERS];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t total, spins = ep->tx_full_spins, waits = ep->tx_txq_waits, t0;
+    unsigned int i;
+    double secs;
+
+    shared->expect_len = size;
+    shared->rx_msgs = 0;
+    ep->block_threshold = 0;
+    ep->tx_mpsc = mpsc;
+    total = (count + writers - 1) / writers * writers;
+    t0 = now_ns();
+    for (i = 0; i < writers; ++i)
+    {
+        w[i].ep = ep;
+        w[i].lock = mpsc ? NULL : &lock;
+        w[i].task = i + 1;
+        w[i].size = size;
+        w[i].count = total / writers;
+        pthread_create(&w[i].thread, NULL, bench_writer_thread, &w[i]);
+    }
+    for (i = 0; i < writers; ++i)
+        pthread_join(w[i].thread, NULL);
+    wait_rx(total);
+    secs = (shared->rx_last_ns - t0) / 1e9;
+    ep->tx_mpsc = false;
+
+    printf("%6s %8u %10zu %10llu %12.0f %12.2f %12llu %12llu\n", mpsc ? "mpsc" : "mutex", writers, size, (unsigned long long)total,
+           total / secs, total * size / secs / (1 << 20), (unsigned long long)(ep->tx_full_spins - spins),
+           (unsigned long long)(ep->tx_txq_waits - waits));
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mailbox_emu_bench [-t] [-m fifo|block|pipe|desc|mpsc] [-k banks] [-r regs] [-n count] [-b budget_mb] [-i rx_idle_us] [size...]\n"
+                    "  -t  run both endpoints as threads of one process instead of two processes\n"
+                    "  -m  only run one transfer mode: ring streaming, stop-and-wait blocks, pipelined banks shared-memory descriptors\n"
+                    "      or 1..32 concurrent writers with and without the lock-free submission ring (default: all)\n"
+                    "  -k  banks used by the pipelined mode (default 2, at most 4)\n"
+                    "  -r  message registers per area (default 62, at most 254)\n"
+                    "  -n  messages per size (default: budget / size, between 100 and 200000)\n"
+                    "  -b  bytes per size in MiB when -n is not given (default 64)\n"
+                    "  -i  receiver idle time before re-arming the interrupt (default 50)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t default_sizes[] = {8, 64, 512, 4096, 32768, 262144, 1048576};
+    struct emu_endpoint tx, rx;
+    size_t sizes[32], nsizes = 0, i;
+    uint64_t count = 0, budget = 64ull << 20;
+    unsigned int rx_idle_us = 50;
+    bool threads = false;
+    int modes = 31; /* bit0: fifo, bit1: block, bit2: pipe, bit3: desc, bit4: mpsc */
+    unsigned int pipe_banks = 2;
+    unsigned int reg_num = C2AMAILBOX_REG_NUM;
+    pthread_t rx_thread, done_thread;
+    uint8_t *desc_shm = NULL;
+    int fd_linux, fd_asp, opt, status;
+    pid_t child = 0;
+
+    while ((opt = getopt(argc, argv, "tm:k:r:n:b:i:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "fifo") == 0)
+                modes = 1;
+            else if (strcmp(optarg, "block") == 0)
+                modes = 2;
+            else if (strcmp(optarg, "pipe") == 0)
+                modes = 4;
+            else if (strcmp(optarg, "desc") == 0)
+                modes = 8;
+            else if (strcmp(optarg, "mpsc") == 0)
+                modes = 16;
+            else
+                usage();
+            break;
+        case 'k':
+            pipe_banks = strtoul(optarg, NULL, 0);
+            if (pipe_banks < 2 || pipe_banks > MAILBOX_MAX_BANKS)
+                usage();
+            break;
+        case 'r':
+            reg_num = strtoul(optarg, NULL, 0);
+            if (reg_num < 2 * MAILBOX_MAX_BANKS + 1 || reg_num > MAILBOX_MAX_REG_NUM)
+                usage();
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            budget = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'i':
+            rx_idle_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    for (; optind < argc && nsizes < 32; ++optind)
+        sizes[nsizes++] = strtoull(argv[optind], NULL, 0);
+    if (nsizes == 0)
+    {
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+        nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    }
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    emu_regfile_init(&shared->rf, reg_num);
+    if (modes & 8)
+    {
+        desc_shm = mmap(NULL, BENCH_DESC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (desc_shm == MAP_FAILED)
+        {
+            perror("mmap");
+            return 1;
+        }
+        memset(desc_shm, 0xa5, BENCH_DESC_SHM_SIZE);
+    }
+    fd_linux = eventfd(0, 0);
+    fd_asp = eventfd(0, 0);
+    if (fd_linux < 0 || fd_asp < 0)
+    {
+        perror("eventfd");
+        return 1;
+    }
+
+    // ASP端只接收，Linux端只发送
+    if (!threads)
+    {
+        child = fork();
+        if (child < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0)
+        {
+            emu_endpoint_init(&rx, &shared->rf, 1, fd_asp, fd_linux);
+            rx.rx_idle_us = rx_idle_us;
+            rx.on_msg = bench_on_msg;
+            if (desc_shm)
+                emu_desc_init(&rx, desc_shm, BENCH_DESC_SHM_SIZE, BENCH_DESC_SLOT_SIZE);
+            emu_rx_thread(&rx);
+            emu_endpoint_destroy(&rx);
+            _exit(0);
+        }
+    }
+    else
+    {
+        emu_endpoint_init(&rx, &shared->rf, 1, fd_asp, fd_linux);
+        rx.rx_idle_us = rx_idle_us;
+        rx.on_msg = bench_on_msg;
+        if (desc_shm)
+            emu_desc_init(&rx, desc_shm, BENCH_DESC_SHM_SIZE, BENCH_DESC_SLOT_SIZE);
+        pthread_create(&rx_thread, NULL, emu_rx_thread, &rx);
+    }
+    emu_endpoint_init(&tx, &shared->rf, 0, fd_linux, fd_asp);
+    if (desc_shm)
+        emu_desc_init(&tx, desc_shm, BENCH_DESC_SHM_SIZE, BENCH_DESC_SLOT_SIZE);
+    if ((modes & 16) && emu_txq_init(&tx, BENCH_TXQ_SIZE))
+    {
+        fprintf(stderr, "mailbox_emu_bench: no memory for the submission ring\n");
+        return 1;
+    }
+
+    printf("# mode=%s rx_idle_us=%u reg_num=%u spin_loops=%u\n", threads ? "threads" : "processes", rx_idle_us, reg_num, tx.spin_loops);
+    if (modes & 15)
+        printf("%6s %10s %10s %12s %12s %8s %8s %10s %10s %10s\n", "mode", "size", "msgs", "msgs/s", "MiB/s", "rd/KiB", "wr/KiB", "p50_us", "p99_us", "p999_us");
+    for (i = 0; i < nsizes; ++i)
+    {
+        uint64_t n = count;
+        if (n == 0)
+        {
+            n = budget / (sizes[i] ? sizes[i] : 1);
+            n = n < 100 ? 100 : n > 200000 ? 200000 : n;
+        }
+        if (modes & 1)
+            bench_size(&tx, sizes[i], n, "fifo", 0, false);
+        if (modes & 2)
+            bench_size(&tx, sizes[i], n, "block", 1, false);
+        if (modes & 4)
+            bench_size(&tx, sizes[i], n, "pipe", pipe_banks, false);
+    }
+    // 发送端要接收交还分片，这个接收线程只在描述符模式下启动，以免影响其余模式的结果
+    if (modes & 8)
+    {
+        tx.rx_idle_us = rx_idle_us;
+        pthread_create(&done_thread, NULL, emu_rx_thread, &tx);
+        for (i = 0; i < nsizes; ++i)
+        {
+            uint64_t n = count;
+            if (sizes[i] > BENCH_DESC_SLOT_SIZE)
+                continue;
+            if (n == 0)
+            {
+                n = budget / (sizes[i] ? sizes[i] : 1);
+                n = n < 100 ? 100 : n > 200000 ? 200000 : n;
+            }
+            bench_size(&tx, sizes[i], n, "desc", 0, true);
+        }
+        printf("# tx_descs=%llu tx_desc_waits=%llu\n", (unsigned long long)tx.tx_descs, (unsigned long long)tx.tx_desc_waits);
+    }
+    if (modes & 16)
+    {
+        unsigned int writers;
+
+        printf("%6s %8s %10s %10s %12s %12s %12s %12s\n", "mode", "writers", "size", "msgs", "msgs/s", "MiB/s", "full_spins", "txq_waits");
+        for (i = 0; i < nsizes; ++i)
+        {
+            uint64_t n = count;
+            if (n == 0)
+            {
+                n = budget / (sizes[i] ? sizes[i] : 1);
+                n = n < 100 ? 100 : n > 200000 ? 200000 : n;
+            }
+            for (writers = 1; writers <= BENCH_MAX_WRITERS; writers *= 2)
+            {
+                bench_writers(&tx, sizes[i], n, writers, false);
+                bench_writers(&tx, sizes[i], n, writers, true);
+            }
+        }
+    }
+    if (shared->rx_errors)
+        printf("# rx_errors=%llu\n", (unsigned long long)shared->rx_errors);
+    printf("# tx_full_spins=%llu tx_blocks=%llu\n", (unsigned long long)tx.tx_full_spins, (unsigned long long)tx.tx_blocks);
+
+    // 控制通道上的一条消息让接收端退出
+    emu_send(&tx, BENCH_CHAN_CTRL, 0, "", 0);
+    if (modes & 8)
+    {
+        emu_rx_stop(&tx);
+        pthread_join(done_thread, NULL);
+    }
+    if (threads)
+    {
+        pthread_join(rx_thread, NULL);
+        printf("# rx_irqs=%llu rx_rearms=%llu rx_drops=%llu rx_blocks=%llu rx_descs=%llu rx_desc_bad=%llu\n", (unsigned long long)rx.irqs,
+               (unsigned long long)rx.rx_rearms, (unsigned long long)rx.rx_drops, (unsigned long long)rx.rx_blocks,
+               (unsigned long long)rx.rx_descs, (unsigned long long)rx.rx_desc_bad);
+        emu_endpoint_destroy(&rx);
+    }
+    else
+    {
+        waitpid(child, &status, 0);
+    }
+    emu_endpoint_destroy(&tx);
+    return shared->rx_errors ? 1 : 0;
+}
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "libmailbox.h"
+#include "sw_mailbox.h"
+
+#define __iomem
+
+/* 与内核riscv的readq/writeq相同：读之后的访问不提前到读之前，写之前的普通写先于这次写被设备看到 */
+#if defined(__riscv)
+#define lmb_io_ar() __asm__ __volatile__("fence i,r" ::: "memory")
+#define lmb_io_bw() __asm__ __volatile__("fence w,o" ::: "memory")
+#else
+#define lmb_io_ar() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define lmb_io_bw() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+static inline uint64_t readq(const volatile void *addr)
+{
+    uint64_t val = *(const volatile uint64_t *)addr;
+    lmb_io_ar();
+    return val;
+}
+
+static inline void writeq(uint64_t val, volatile void *addr)
+{
+    lmb_io_bw();
+    *(volatile uint64_t *)addr = val;
+}
+
+/* 消息寄存器之间不需要顺序，之后对IR的writeq保证它们先于新的tail被对方看到 */
+static inline void __iowrite64_copy(volatile void *to, const void *from, size_t count)
+{
+    volatile uint64_t *dst = to;
+    const uint64_t *src = from;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        dst[i] = src[i];
+}
+
+#include "sw_mailbox_ring.h"
+
+/* 对方接收区满时每重试这么多次重读一次对方CSR，确认对方没有停止接收 */
+#define LMB_STOP_CHECK_SPINS 4096
+
+struct lmb_rx_msg
+{
+    size_t len;
+    size_t filled;
+    unsigned int next_frag;
+    uint8_t data[];
+};
+
+struct lmb
+{
+    int fd;
+    int efd;
+    void *map;
+    size_t map_size;
+    struct mailbox_ring ring;
+    uint8_t task;
+
+    /* 自己的IR：发送方向改tail，接收方向改head，用影子寄存器加锁合并 */
+    uint64_t ir_shadow;
+    pthread_spinlock_t ir_lock;
+
+    /* 发送方向 */
+    int tx_peer_head; /* 上次读到的对方head，空间不够时才重读 */
+    bool tx_peer_stopped;
+    uint64_t tx_frame[MAILBOX_MAX_REG_NUM];
+
+    /* 接收方向 */
+    unsigned int rx_skip; /* 驱动读了一半的分片还剩的寄存器数 */
+    uint64_t rx_buf[MAILBOX_MAX_REG_NUM];
+    struct lmb_rx_msg *rx_partial[MAILBOX_MAX_CHANNELS][256];
+
+    struct lmb_stats stats;
+};
+
+static inline void lmb_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static uint64_t lmb_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* 修改自己IR中的字段并写回 */
+static void lmb_update_ir(struct lmb *mb, uint64_t mask, uint64_t val)
+{
+    pthread_spin_lock(&mb->ir_lock);
+    mb->ir_shadow = (mb->ir_shadow & ~mask) | val;
+    writeq(mb->ir_shadow, mb->ring.base + mb->ring.own_ir);
+    pthread_spin_unlock(&mb->ir_lock);
+}
+
+struct lmb *lmb_open(const char *path, int flags)
+{
+    struct mailbox_bypass bp;
+    struct lmb *mb;
+    int err;
+
+    mb = calloc(1, sizeof(*mb));
+    if (!mb)
+        return NULL;
+    mb->efd = -1;
+    memset(&bp, 0, sizeof(bp));
+    bp.eventfd = -1;
+    mb->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (mb->fd < 0)
+        goto fail;
+    if (!(flags & LMB_BUSY_POLL))
+    {
+        mb->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (mb->efd < 0)
+            goto fail;
+        bp.eventfd = mb->efd;
+    }
+    if (ioctl(mb->fd, MAILBOX_IOC_BYPASS, &bp) < 0)
+        goto fail;
+    mb->map = mmap(NULL, bp.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mb->fd, MAILBOX_MMAP_REGS);
+    if (mb->map == MAP_FAILED)
+    {
+        mb->map = NULL;
+        goto fail;
+    }
+    mb->map_size = bp.map_size;
+    mailbox_ring_setup(&mb->ring, (unsigned char *)mb->map + bp.reg_offset, bp.tx_base, bp.tx_regs, bp.rx_base, bp.rx_regs);
+    mb->task = bp.task;
+    mb->rx_skip = bp.rx_skip;
+    pthread_spin_init(&mb->ir_lock, PTHREAD_PROCESS_PRIVATE);
+    mb->ir_shadow = readq(mb->ring.base + mb->ring.own_ir) & ~MAILBOX_IR_TX_WAIT;
+    mb->tx_peer_head = mailbox_ring_tx_head_init(&mb->ring, mb->ir_shadow);
+    mb->tx_peer_stopped = readq(mb->ring.base + mb->ring.peer_csr) == MAILBOX_CSR_STOPPED;
+    return mb;
+
+fail:
+    err = errno;
+    lmb_close(mb);
+    errno = err;
+    return NULL;
+}
+
+void lmb_close(struct lmb *mb)
+{
+    unsigned int c, t;
+
+    if (!mb)
+        return;
+    if (mb->map)
+    {
+        munmap(mb->map, mb->map_size);
+        pthread_spin_destroy(&mb->ir_lock);
+    }
+    if (mb->efd >= 0)
+        close(mb->efd);
+    if (mb->fd >= 0)
+        close(mb->fd); // 驱动在文件的最后一个引用释放时结束旁路
+    for (c = 0; c < MAILBOX_MAX_CHANNELS; ++c)
+    {
+        for (t = 0; t < 256; ++t)
+            free(mb->rx_partial[c][t]);
+    }
+    free(mb);
+}
+
+int lmb_eventfd(const struct lmb *mb)
+{
+    return mb->efd;
+}
+
+const struct lmb_stats *lmb_stats(const struct lmb *mb)
+{
+    return &mb->stats;
+}
+
+/* 等对方接收区放得下need个寄存器，返回自己的tail；对方停止接收时返回-EPIPE，nonblock时返回-EAGAIN */
+static int lmb_tx_wait(struct lmb *mb, int need, bool nonblock)
+{
+    uint64_t ir = __atomic_load_n(&mb->ir_shadow, __ATOMIC_RELAXED);
+    unsigned int spins = 0;
+    int tail;
+
+    while (mailbox_ring_tx_free(&mb->ring, ir, &mb->tx_peer_head, &tail, need, &mb->stats.tx_head_reads) < need)
+    {
+        if (nonblock)
+            return -EAGAIN;
+        if (++spins % LMB_STOP_CHECK_SPINS == 0 && readq(mb->ring.base + mb->ring.peer_csr) == MAILBOX_CSR_STOPPED)
+        {
+            mb->tx_peer_stopped = true;
+            return -EPIPE;
+        }
+        mb->stats.tx_full_spins++;
+        lmb_cpu_relax();
+    }
+    return tail;
+}
+
+/* 与mailbox_send_iter相同的分片：帧头加payload不超过对方接收区的容量，只有最后一个寄存器补0 */
+int lmb_send(struct lmb *mb, unsigned int chan, const void *buf, size_t len, int flags)
+{
+    const uint8_t *src = buf;
+    size_t frag_bytes = mailbox_frag_max_words(&mb->ring) * sizeof(uint64_t);
+    uint64_t *frame = mb->tx_frame;
+    unsigned int frag = 0, words;
+    size_t sent = 0, n;
+    uint64_t fl;
+    int tail;
+
+    if (chan >= MAILBOX_MAX_CHANNELS || len > UINT32_MAX)
+        return -EINVAL;
+    if (mb->tx_peer_stopped)
+    {
+        // 对方可能已经重新开始接收
+        mb->tx_peer_stopped = readq(mb->ring.base + mb->ring.peer_csr) == MAILBOX_CSR_STOPPED;
+        if (mb->tx_peer_stopped)
+            return -EPIPE;
+    }
+    do
+    {
+        n = len - sent < frag_bytes ? len - sent : frag_bytes;
+        words = (n + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        fl = (frag == 0 ? MAILBOX_FRAG_FIRST : 0) | (sent + n == len ? MAILBOX_FRAG_LAST : 0);
+        frame[0] = MAILBOX_FRAG_HEADER(chan, mb->task, words, fl, frag == 0 ? len : frag);
+        if (n % sizeof(uint64_t))
+            frame[words] = 0;
+        memcpy(&frame[1], src + sent, n);
+
+        // 已经发出的分片不能收回，只有第一个分片可以不等
+        tail = lmb_tx_wait(mb, 1 + words, frag == 0 && (flags & LMB_NONBLOCK));
+        if (tail < 0)
+            return tail;
+        tail = mailbox_ring_write(&mb->ring, tail, frame, 1 + words);
+        lmb_update_ir(mb, MAILBOX_IR_TAIL_MASK, (uint64_t)tail << MAILBOX_IR_TAIL_SHIFT);
+        mb->tx_peer_stopped = mailbox_ring_kick(&mb->ring, MAILBOX_CSR_DOORBELL) == MAILBOX_CSR_STOPPED;
+        sent += n;
+        frag++;
+    } while (sent < len);
+    mb->stats.tx_msgs++;
+    mb->stats.tx_bytes += len;
+    return 0;
+}
+
+static void lmb_rx_deliver(struct lmb *mb, lmb_msg_fn fn, void *arg, unsigned int chan, const void *data, size_t len)
+{
+    mb->stats.rx_msgs++;
+    mb->stats.rx_bytes += len;
+    fn(chan, data, len, arg);
+}
+
+static void lmb_rx_drop_partial(struct lmb *mb, struct lmb_rx_msg **slot)
+{
+    if (!*slot)
+        return;
+    free(*slot);
+    *slot = NULL;
+    mb->stats.rx_drops++;
+}
+
+/* 合并分片：长度前缀加消息内容紧凑排列，直接从读出的寄存器交给回调 */
+static int lmb_rx_unpack(struct lmb *mb, unsigned int chan, const uint8_t *p, size_t bytes, lmb_msg_fn fn, void *arg)
+{
+    const uint8_t *end = p + bytes;
+    unsigned int k;
+    size_t len;
+    int msgs = 0;
+
+    while (p < end)
+    {
+        k = mailbox_pack_get_len(p, end - p, &len);
+        if (k == 0 || len > (size_t)(end - p - k))
+        {
+            mb->stats.rx_drops++;
+            break;
+        }
+        lmb_rx_deliver(mb, fn, arg, chan, p + k, len);
+        p += k + len;
+        msgs++;
+    }
+    return msgs;
+}
+
+/* 处理一个完整的分片，返回完成的消息数 */
+static int lmb_rx_frag(struct lmb *mb, uint64_t hdr, const uint64_t *payload, lmb_msg_fn fn, void *arg)
+{
+    unsigned int chan = MAILBOX_FRAG_CHAN(hdr), words = MAILBOX_FRAG_WORDS(hdr);
+    struct lmb_rx_msg **slot = &mb->rx_partial[chan][MAILBOX_FRAG_TASK(hdr)], *msg;
+    size_t len = MAILBOX_FRAG_INFO(hdr), bytes;
+
+    if (hdr & MAILBOX_FRAG_DESC)
+    {
+        // 描述符所指的缓冲区在共享内存中，旁路时无法访问
+        if (!(hdr & MAILBOX_FRAG_DONE))
+            mb->stats.rx_desc_drops++;
+        return 0;
+    }
+    if (hdr & MAILBOX_FRAG_PACKED)
+        return lmb_rx_unpack(mb, chan, (const uint8_t *)payload, len < words * sizeof(uint64_t) ? len : words * sizeof(uint64_t), fn, arg);
+    if ((hdr & (MAILBOX_FRAG_FIRST | MAILBOX_FRAG_LAST)) == (MAILBOX_FRAG_FIRST | MAILBOX_FRAG_LAST) && !(hdr & MAILBOX_FRAG_ABORT))
+    {
+        // 单分片的消息不经过重组
+        lmb_rx_drop_partial(mb, slot);
+        if (len > words * sizeof(uint64_t))
+        {
+            mb->stats.rx_drops++;
+            return 0;
+        }
+        lmb_rx_deliver(mb, fn, arg, chan, payload, len);
+        return 1;
+    }
+    if (hdr & MAILBOX_FRAG_FIRST)
+    {
+        lmb_rx_drop_partial(mb, slot); // 上一条消息的后续分片丢失
+        msg = malloc(sizeof(*msg) + len);
+        if (!msg)
+        {
+            mb->stats.rx_drops++;
+            return 0;
+        }
+        msg->len = len;
+        msg->filled = 0;
+        msg->next_frag = 1;
+        *slot = msg;
+    }
+    else
+    {
+        msg = *slot;
+        if (!msg)
+            return 0;
+        if (MAILBOX_FRAG_INFO(hdr) != msg->next_frag++)
+        {
+            lmb_rx_drop_partial(mb, slot);
+            return 0;
+        }
+    }
+    if (hdr & MAILBOX_FRAG_ABORT)
+    {
+        lmb_rx_drop_partial(mb, slot);
+        return 0;
+    }
+    bytes = words * sizeof(uint64_t);
+    if (bytes > msg->len - msg->filled)
+        bytes = msg->len - msg->filled;
+    memcpy(msg->data + msg->filled, payload, bytes);
+    msg->filled += bytes;
+    if (!(hdr & MAILBOX_FRAG_LAST))
+        return 0;
+    if (msg->filled != msg->len)
+    {
+        lmb_rx_drop_partial(mb, slot);
+        return 0;
+    }
+    *slot = NULL;
+    lmb_rx_deliver(mb, fn, arg, chan, msg->data, msg->len);
+    free(msg);
+    return 1;
+}
+
+/*
+ * 读出head到tail之间的寄存器，只消费其中写完的分片：head总停在分片边界上，
+ * lmb_close之后驱动可以直接接着解析。先归还接收区再处理，处理期间对方可以继续写。
+ */
+int lmb_poll(struct lmb *mb, lmb_msg_fn fn, void *arg)
+{
+    uint64_t peer_ir = readq(mb->ring.base + mb->ring.peer_ir);
+    int head = mb->ir_shadow & MAILBOX_IR_HEAD_MASK;
+    unsigned int cap = mailbox_ring_capacity(&mb->ring);
+    uint64_t hdr, acks = 0;
+    int n, done = 0, skip = 0, i, msgs = 0;
+
+    n = mailbox_ring_read(&mb->ring, head, mailbox_ring_rx_tail(peer_ir), mb->rx_buf);
+    if (n <= 0)
+        return n < 0 ? -EIO : 0;
+    if (mb->rx_skip)
+    {
+        skip = n < (int)mb->rx_skip ? n : (int)mb->rx_skip;
+        mb->rx_skip -= skip;
+        done = skip;
+    }
+    while (done < n)
+    {
+        hdr = mb->rx_buf[done];
+        if (1 + MAILBOX_FRAG_WORDS(hdr) > cap)
+        {
+            done = n; // 帧头已损坏，丢弃读出的全部寄存器
+            mb->stats.rx_drops++;
+            break;
+        }
+        if (done + 1 + (int)MAILBOX_FRAG_WORDS(hdr) > n)
+            break; // 分片还没写完，下次从它的帧头重读
+        if (hdr & MAILBOX_FRAG_BLOCK)
+            acks |= MAILBOX_CSR_BANK_ACK(MAILBOX_FRAG_BANK(hdr) % MAILBOX_MAX_BANKS);
+        done += 1 + MAILBOX_FRAG_WORDS(hdr);
+    }
+    if (done == 0)
+        return 0;
+
+    lmb_update_ir(mb, MAILBOX_IR_HEAD_MASK, (head + done) % mb->ring.rx_regs);
+    if (peer_ir & MAILBOX_IR_TX_WAIT)
+        mailbox_ring_kick(&mb->ring, MAILBOX_CSR_HEAD_NOTIFY); // 对方在等待空间
+    if (acks)
+    {
+        mailbox_ring_kick(&mb->ring, acks);
+        mb->stats.rx_blocks += __builtin_popcountll(acks);
+    }
+    for (i = skip; i < done; i += 1 + MAILBOX_FRAG_WORDS(mb->rx_buf[i]))
+    {
+        if (1 + MAILBOX_FRAG_WORDS(mb->rx_buf[i]) > cap)
+            break;
+        msgs += lmb_rx_frag(mb, mb->rx_buf[i], &mb->rx_buf[i + 1], fn, arg);
+    }
+    return msgs;
+}
+
+int lmb_recv(struct lmb *mb, lmb_msg_fn fn, void *arg, int spin_us, int timeout_ms)
+{
+    uint64_t start = lmb_now_ns(), now, count;
+    struct pollfd pfd;
+    int n, wait_ms;
+
+    for (;;)
+    {
+        n = lmb_poll(mb, fn, arg);
+        if (n != 0)
+            return n;
+        now = lmb_now_ns();
+        if (timeout_ms >= 0 && now - start >= (uint64_t)timeout_ms * 1000000)
+            return 0;
+        if (mb->efd < 0 || now - start < (uint64_t)spin_us * 1000)
+        {
+            lmb_cpu_relax();
+            continue;
+        }
+        // eventfd的计数在读出之前一直有效，检查接收区之后才到达的门铃不会丢失
+        wait_ms = timeout_ms < 0 ? -1 : timeout_ms - (int)((now - start) / 1000000);
+        pfd.fd = mb->efd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, wait_ms);
+        if (n < 0 && errno != EINTR)
+            return -errno;
+        if (n > 0 && read(mb->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -errno;
+    }
+}
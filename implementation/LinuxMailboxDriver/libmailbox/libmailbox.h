@@ -0,0 +1,56 @@
+/*
+ * libmailbox：在用户态直接收发寄存器环，发送与忙等接收的路径上没有系统调用。
+ * 驱动以bypass=1加载，进程需要CAP_SYS_RAWIO。lmb_open通过MAILBOX_IOC_BYPASS接管实例的寄存器环并映射寄存器窗口，
+ * 初始化、中断使能与lmb_close之后的恢复仍由驱动负责，见sw_mailbox.h。
+ * 分片格式与驱动相同，发送时不合并、不走描述符、不用块模式；收到的描述符消息无法访问共享内存，只计数丢弃。
+ * 发送与接收可以各在一个线程中进行，同一方向不能并发。
+ */
+#ifndef _LIBMAILBOX_H
+#define _LIBMAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* lmb_open：不创建eventfd，驱动关掉本实例的中断，接收只能忙等 */
+#define LMB_BUSY_POLL 1
+/* lmb_send：对方接收区放不下第一个分片时返回-EAGAIN，不原地等待 */
+#define LMB_NONBLOCK 1
+
+struct lmb;
+
+/* 收到一条完整的消息时调用，data只在回调期间有效 */
+typedef void (*lmb_msg_fn)(unsigned int chan, const void *data, size_t len, void *arg);
+
+struct lmb_stats
+{
+    uint64_t tx_msgs;
+    uint64_t tx_bytes;
+    uint64_t tx_full_spins; /* 对方接收区满时的原地重试 */
+    uint64_t tx_head_reads; /* 重读对方head的次数 */
+    uint64_t rx_msgs;
+    uint64_t rx_bytes;
+    uint64_t rx_drops;      /* 分片不连续、被放弃、长度不符或内存不足 */
+    uint64_t rx_desc_drops; /* 描述符消息 */
+    uint64_t rx_blocks;     /* 已应答的块模式分片 */
+};
+
+/* 打开设备节点并接管它所属实例的寄存器环，失败时返回NULL并设置errno */
+struct lmb *lmb_open(const char *path, int flags);
+/* 解除映射并关闭设备节点，驱动从留下的head与tail接着收发 */
+void lmb_close(struct lmb *mb);
+
+/* 发送一条消息，写完最后一个分片并敲门铃后返回0；对方停止接收时返回-EPIPE */
+int lmb_send(struct lmb *mb, unsigned int chan, const void *buf, size_t len, int flags);
+/* 读出接收区中已写完的分片，每条完整的消息调用一次fn，返回消息数，不等待 */
+int lmb_poll(struct lmb *mb, lmb_msg_fn fn, void *arg);
+/*
+ * 等待至少一条消息：先忙等spin_us微秒，之后在eventfd上睡眠（LMB_BUSY_POLL时一直忙等），
+ * timeout_ms为负时不超时，超时返回0。
+ */
+int lmb_recv(struct lmb *mb, lmb_msg_fn fn, void *arg, int spin_us, int timeout_ms);
+
+/* 中断转发到的eventfd，可以加入应用自己的epoll，LMB_BUSY_POLL时为-1 */
+int lmb_eventfd(const struct lmb *mb);
+const struct lmb_stats *lmb_stats(const struct lmb *mb);
+
+#endif /* _LIBMAILBOX_H */
@@ -0,0 +1,148 @@
+/*
+ * 旁路收发的延迟，驱动需要以bypass=1加载：
+ *   send      每次lmb_send的耗时，即组帧、写寄存器、推进tail到敲完门铃，两次发送之间读空对方回显的消息
+ *   pingpong  每次只有一条消息在途，忙等读回，统计往返延迟，需要对端回显（ASP端echo特性或set_echo）
+ * 用法：mailbox_bypass_bench [-d 设备] [-c 通道] [-n 次数] [-m send|pingpong] [大小]
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libmailbox.h"
+
+#define BENCH_RX_TIMEOUT_MS 2000
+
+struct bench_echo
+{
+    size_t len;
+    bool got;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void on_msg(unsigned int chan, const void *data, size_t len, void *arg)
+{
+    struct bench_echo *echo = arg;
+
+    (void)chan;
+    (void)data;
+    echo->len = len;
+    echo->got = true;
+}
+
+static void print_lat(const char *mode, size_t size, uint64_t *samples, uint64_t n)
+{
+    double sum = 0;
+    uint64_t i;
+
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    for (i = 0; i < n; ++i)
+        sum += samples[i];
+    printf("%-9s %8zu B  n %-8llu p50 %8llu  p99 %8llu  p999 %8llu  max %8llu  mean %8.0f ns\n", mode, size,
+           (unsigned long long)n, (unsigned long long)samples[n / 2], (unsigned long long)samples[n * 99 / 100],
+           (unsigned long long)samples[n * 999 / 1000], (unsigned long long)samples[n - 1], sum / n);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dev = "/dev/sw_mailbox/ch0", *mode = "send";
+    struct bench_echo echo;
+    const struct lmb_stats *st;
+    uint64_t count = 100000, i, n = 0, t0, *samples;
+    unsigned int chan = 0;
+    size_t size = 8;
+    uint8_t *buf;
+    struct lmb *mb;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "d:c:n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'c':
+            chan = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d dev] [-c chan] [-n count] [-m send|pingpong] [size]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc)
+        size = strtoull(argv[optind], NULL, 0);
+    if (count == 0 || (strcmp(mode, "send") && strcmp(mode, "pingpong")))
+    {
+        fprintf(stderr, "bad count or mode\n");
+        return 2;
+    }
+
+    buf = malloc(size ? size : 1);
+    samples = malloc(count * sizeof(*samples));
+    if (!buf || !samples)
+        return 1;
+    memset(buf, 0xa5, size);
+    mb = lmb_open(dev, strcmp(mode, "pingpong") == 0 ? LMB_BUSY_POLL : 0);
+    if (!mb)
+    {
+        fprintf(stderr, "lmb_open %s: %s\n", dev, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        echo.got = false;
+        t0 = now_ns();
+        ret = lmb_send(mb, chan, buf, size, 0);
+        if (ret < 0)
+        {
+            fprintf(stderr, "lmb_send: %s\n", strerror(-ret));
+            break;
+        }
+        if (strcmp(mode, "send") == 0)
+        {
+            samples[n++] = now_ns() - t0;
+            lmb_poll(mb, on_msg, &echo);
+            continue;
+        }
+        ret = lmb_recv(mb, on_msg, &echo, 0, BENCH_RX_TIMEOUT_MS);
+        if (ret <= 0 || echo.len != size)
+        {
+            fprintf(stderr, "no echo for message %llu\n", (unsigned long long)i);
+            break;
+        }
+        samples[n++] = now_ns() - t0;
+    }
+    if (n)
+        print_lat(mode, size, samples, n);
+    st = lmb_stats(mb);
+    printf("tx_msgs %llu tx_full_spins %llu tx_head_reads %llu rx_msgs %llu rx_drops %llu rx_desc_drops %llu\n",
+           (unsigned long long)st->tx_msgs, (unsigned long long)st->tx_full_spins, (unsigned long long)st->tx_head_reads,
+           (unsigned long long)st->rx_msgs, (unsigned long long)st->rx_drops, (unsigned long long)st->rx_desc_drops);
+    lmb_close(mb);
+    free(samples);
+    free(buf);
+    return n == count ? 0 : 1;
+}
@@ -1,312 +1,625 @@
-#include  <linux/cdev.h>
-#include  <linux/module.h>
-#include  <linux/kernel.h>
-#include  <linux/init.h>
-#include  <linux/fs.h>
-#include  <linux/irq.h>
-#include  <linux/platform_device.h>
-#include  <linux/of_irq.h>
-#include  <linux/poll.h>
-#include  <linux/io.h>
-#include  <asm/io.h>
-#include <linux/mutex.h>
+/*
+ * 模拟的ASP端：注册instances个名为sw_mailbox的platform设备，寄存器窗口是vmalloc出来的普通内存，
+ * 中断由irq_sim注入。sw_mailbox.ko不做修改地绑定到这些设备上，每个设备成为一个mailbox实例，
+ * 在没有板子的x86机器或QEMU中即可测量 syscall -> MMIO -> IRQ -> read() 的整条路径。
+ *
+ * 每个实例的对端由一个内核线程驱动：消费C2A接收区，按mode把消息原样回显、只计数丢弃，
+ * 或以gen_rate的速率向A2C接收区生成gen_size字节的消息。
+ * 需要内核打开CONFIG_IRQ_SIM；先加载本模块，再加载sw_mailbox.ko，两者顺序颠倒也可以。
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irq_sim.h>
+#include <linux/irqdomain.h>
+#include <linux/platform_device.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/kthread.h>
 #include <linux/kfifo.h>
 #include <linux/delay.h>
-#include <linux/list.h>
-static DECLARE_WAIT_QUEUE_HEAD(mailbox_waitq);
-/* lock for procfs read access */
-static DEFINE_MUTEX(read_lock);
-/* lock for procfs write access */
-static DEFINE_MUTEX(write_lock);
-
-/* fifo size in elements (bytes) */
-#define FIFO_SIZE	512
-/* define name for device and driver */
-#define DEVICE_NAME "sw_mailbox"
-#define DEVICE_INTERRUPT 3
-/* mailbox address space*/
-#define C2AMAILBOX_REG_NUM 63
-#define C2AMAILBOX_CSR 0x3F8
-#define C2AMAILBOX_BASE 0x200
-#define C2AMAILBOX_INT_ENA 0x8000000000000000ull
-
-#define A2CMAILBOX_REG_NUM 63
-#define A2CMAILBOX_CSR 0x1F8
-#define A2CMAILBOX_BASE 0x000
-#define A2CMAILBOX_INT_ENA 0x8000000000000000ull
-
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include "sw_mailbox.h"
+#include "sw_mailbox_ring.h"
 
+#define DEVICE_NAME "sw_mailbox"
+/* 模拟的实例数上限，与驱动支持的实例数一致 */
+#define FAKE_MAX_INSTANCES 16
+/* 回显或生成的寄存器先放入发送队列，再按A2C接收区的空闲空间写入 */
+#define FAKE_TX_FIFO_SIZE 16384
+/* 生成的消息使用的task id，与Linux端open分配的id区分开 */
+#define FAKE_GEN_TASK 0xfe
+
+enum fake_mode
+{
+    FAKE_MODE_SINK,
+    FAKE_MODE_ECHO,
+    FAKE_MODE_GEN,
+};
 
-static int irq;
-static size_t start, end, size;
-static unsigned char __iomem	*membase; /* read/write[bwl] */
-static struct cdev mailbox_cdev;
-static struct class *mailbox_class = NULL;
-static struct device *mailbox_device = NULL;
-
-static int mailbox_major = 0;
-static int mailbox_minor = 0;
-static volatile int mailbox_event = 0;
-//static char mailbox_buf[568];
-//static uint64_t count,max_msg;
-//struct kfifo_rec_ptr_2 mailbox_fifo;
+static char *mode = "echo";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "peer behaviour: echo (send every message back), sink (consume only) or gen (generate traffic)");
 
-//struct kfifo mailbox_fifo;
+static unsigned int gen_rate = 1000;
+module_param(gen_rate, uint, 0644);
+MODULE_PARM_DESC(gen_rate, "messages per second generated in gen mode, 0 for as fast as the ring drains");
 
-typedef  struct {uint64_t idx;uint64_t val ;} Msg;
-static DECLARE_KFIFO_PTR(mailbox_fifo, Msg);
+static unsigned int gen_size = 64;
+module_param(gen_size, uint, 0444);
+MODULE_PARM_DESC(gen_size, "bytes per generated message in gen mode");
 
-#define UINT64(addr,offset) ((uint64_t*)(size_t)(addr))[offset]
+static unsigned int gen_chan = 0;
+module_param(gen_chan, uint, 0444);
+MODULE_PARM_DESC(gen_chan, "logical channel of generated messages");
 
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "number of emulated mailbox instances, each with its own register window, irq and peer thread");
 
+static unsigned int reg_num = C2AMAILBOX_REG_NUM;
+module_param(reg_num, uint, 0444);
+MODULE_PARM_DESC(reg_num, "message registers per area, passed to the driver through platform data");
 
+static unsigned int shm_kb = 1024;
+module_param(shm_kb, uint, 0444);
+MODULE_PARM_DESC(shm_kb, "KiB of shared memory for descriptor mode, split evenly between the two directions, 0 to disable");
 
+static unsigned int desc_slot_size = MAILBOX_DESC_SLOT_SIZE;
+module_param(desc_slot_size, uint, 0444);
+MODULE_PARM_DESC(desc_slot_size, "bytes per descriptor-mode buffer, a multiple of the page size");
 
+static unsigned int peer_poll_us = 20;
+module_param(peer_poll_us, uint, 0644);
+MODULE_PARM_DESC(peer_poll_us, "peer thread sleep when both rings are idle, 0 to busy-poll");
 
+/* 对端的运行统计，通过debugfs导出 */
+struct fake_stats
+{
+    u64 rx_regs;
+    u64 rx_msgs;
+    u64 rx_doorbells;
+    u64 tx_regs;
+    u64 tx_msgs;
+    u64 tx_full;
+    u64 irqs;
+    u64 rx_descs;
+    u64 tx_descs;
+    u64 desc_done;
+    u64 desc_drops; /* 回显模式下A2C池没有空闲缓冲区而丢弃的描述符消息 */
+};
 
+struct mailbox_fake
+{
+    unsigned int id;
+    u64 *regs; /* 寄存器窗口，按64位寄存器下标访问 */
+    struct mailbox_ring ring; /* 对端看到的寄存器环：向A2C接收区发送，从C2A接收区接收 */
+    struct sw_mailbox_platform_data pdata;
+    enum fake_mode mode;
+    struct irq_domain *irq_domain;
+    int irq;
+    struct platform_device *pdev;
+    struct task_struct *thread;
+    struct dentry *debugfs;
+
+    /* Linux端CSR的读改写与中断注入，Linux端在中断上下文中也会写 */
+    spinlock_t csr_lock;
+
+    /* 对端的IR只由对端写：[7:0]为对端在C2A中的head，[15:8]为对端在A2C中的tail */
+    u64 ir;
+
+    /* 接收分片的解析状态，用于统计消息数与应答块模式分片 */
+    u64 rx_frag_hdr;
+    unsigned int rx_frag_left;
+    u64 rx_bank_acks;
+    u64 rx_desc;
+
+    /* 描述符模式：共享内存前半为C2A池，后半为A2C池，对端在A2C池中分配缓冲区回显描述符消息 */
+    u8 *shm;
+    unsigned int desc_slots;
+    unsigned long *desc_busy;
+    u16 *desc_seq;
+
+    DECLARE_KFIFO_PTR(tx_fifo, u64);
+    u64 *gen_buf;
+    u64 gen_start_ns;
+
+    struct fake_stats stats;
+};
 
+static struct mailbox_fake *fakes[FAKE_MAX_INSTANCES];
 
+static inline u64 fake_readq(struct mailbox_fake *f, unsigned int off)
+{
+    return READ_ONCE(f->regs[off / sizeof(u64)]);
+}
 
-static int mailbox_open(struct inode *inode, struct file *file)
+static inline void fake_writeq(struct mailbox_fake *f, u64 val, unsigned int off)
 {
-    if(inode == NULL || file == NULL)
-        return -1;
-    
-    return 0;
+    WRITE_ONCE(f->regs[off / sizeof(u64)], val);
 }
 
-static int mailbox_close(struct inode *inode, struct file *file)
+/* 使能位为1且有任何门铃位时中断线有效 */
+static inline bool fake_csr_asserted(u64 csr)
 {
-    
-    return 0;
+    return (csr & A2CMAILBOX_INT_ENA) && (csr & MAILBOX_CSR_VALID_MASK);
 }
 
+/* 更新Linux端的CSR，中断线由无效变为有效时注入一次中断 */
+static void fake_csr_update(struct mailbox_fake *f, u64 clear, u64 set, bool set_ena, bool ena)
+{
+    unsigned long flags;
+    bool raise;
+    u64 old, csr;
+
+    spin_lock_irqsave(&f->csr_lock, flags);
+    old = fake_readq(f, f->ring.peer_csr);
+    csr = ((old & ~clear) | set) & MAILBOX_CSR_VALID_MASK;
+    if (set_ena ? ena : (old & A2CMAILBOX_INT_ENA))
+        csr |= A2CMAILBOX_INT_ENA;
+    fake_writeq(f, csr, f->ring.peer_csr);
+    raise = !fake_csr_asserted(old) && fake_csr_asserted(csr);
+    spin_unlock_irqrestore(&f->csr_lock, flags);
+
+    if (raise)
+    {
+        f->stats.irqs++;
+        irq_set_irqchip_state(f->irq, IRQCHIP_STATE_PENDING, true);
+    }
+}
 
+/* Linux端写自己的CSR：使能位直接写入，其余位写1清零 */
+static void fake_csr_write(void *ctx, uint64_t val)
+{
+    fake_csr_update(ctx, val & MAILBOX_CSR_VALID_MASK, 0, true, val & A2CMAILBOX_INT_ENA);
+}
 
+/* 对端置Linux端CSR中的门铃位，保留其使能位 */
+static inline void fake_ring_doorbell(struct mailbox_fake *f, u64 bits)
+{
+    fake_csr_update(f, 0, bits, false, false);
+}
 
-static ssize_t mailbox_write(struct file *file, const char __user * buf, size_t size, loff_t * ppos)
+/*
+ * 描述符分片：交还分片释放A2C池中的缓冲区；描述符消息在回显模式下拷进A2C池的一个缓冲区再以描述符发回，
+ * 之后无论是否回显都交还Linux端的缓冲区。调用者保证发送队列放得下两个分片。
+ */
+static void fake_rx_desc(struct mailbox_fake *f)
 {
-    Msg msg;
-    //sbi_printf("pos %lx\n",*ppos);
-    if(*ppos == 0 )
-    {
+    u64 hdr = f->rx_frag_hdr, desc = f->rx_desc, frame[2];
+    unsigned int buf = MAILBOX_DESC_BUF(desc), off = MAILBOX_DESC_OFF(desc), len = MAILBOX_FRAG_INFO(hdr), b;
+    size_t half = f->pdata.shm_size / 2;
 
-        if(size != sizeof(Msg))
-            return 0;
-        if(kfifo_avail(&mailbox_fifo) > 0)
+    if (hdr & MAILBOX_FRAG_DONE)
+    {
+        if (buf < f->desc_slots && test_bit(buf, f->desc_busy) && f->desc_seq[buf] == MAILBOX_DESC_SEQ(desc))
+        {
+            __clear_bit(buf, f->desc_busy);
+            f->stats.desc_done++;
+        }
+        return;
+    }
+    if (buf >= f->desc_slots || off > desc_slot_size || len > desc_slot_size - off)
+        return;
+    f->stats.rx_descs++;
+    f->stats.rx_msgs++;
+    if (f->mode == FAKE_MODE_ECHO)
+    {
+        b = find_first_zero_bit(f->desc_busy, f->desc_slots);
+        if (b < f->desc_slots)
         {
-            copy_from_user(&msg,buf,size);
-            kfifo_put(&mailbox_fifo,msg);
-            if(kfifo_len (&mailbox_fifo) >0)
-            {
-                wake_up_interruptible(&mailbox_waitq);
-            }
-            
-            return size;
+            __set_bit(b, f->desc_busy);
+            memcpy(f->shm + half + (size_t)b * desc_slot_size, f->shm + (size_t)buf * desc_slot_size + off, len);
+            smp_wmb(); // 缓冲区先于描述符可见
+            mailbox_desc_frame(frame, MAILBOX_FRAG_CHAN(hdr), MAILBOX_FRAG_TASK(hdr), 0, len, MAILBOX_DESC(b, ++f->desc_seq[b], 0));
+            kfifo_in(&f->tx_fifo, frame, 2);
+            f->stats.tx_descs++;
         }
         else
         {
-            return 0;
-        }  
+            f->stats.desc_drops++;
+        }
+    }
+    mailbox_desc_frame(frame, 0, 0, MAILBOX_FRAG_DONE, 0, desc);
+    kfifo_in(&f->tx_fifo, frame, 2);
+}
+
+/* 只为统计消息数、应答块模式分片与处理描述符解析分片头，内容不做检查，返回回显模式下是否原样回显这个寄存器 */
+static bool fake_rx_parse(struct mailbox_fake *f, u64 word)
+{
+    bool desc;
 
+    if (f->rx_frag_left == 0)
+    {
+        f->rx_frag_hdr = word;
+        f->rx_frag_left = MAILBOX_FRAG_WORDS(word);
+        desc = word & MAILBOX_FRAG_DESC;
     }
-    else if(*ppos == 1)
+    else
     {
-        
-        kfifo_reset(&mailbox_fifo);
-        sbi_printf("mailbox:kfifo cleared\n");
-        
+        f->rx_frag_left--;
+        desc = f->rx_frag_hdr & MAILBOX_FRAG_DESC;
+        if (desc)
+            f->rx_desc = word;
     }
-    
-
-    (* ppos) = 0;//seek to 0
-    return size;
-
+    if (f->rx_frag_left != 0)
+        return !desc;
+    if (f->rx_frag_hdr & MAILBOX_FRAG_BLOCK)
+        f->rx_bank_acks |= MAILBOX_CSR_BANK_ACK(MAILBOX_FRAG_BANK(f->rx_frag_hdr) % MAILBOX_MAX_BANKS);
+    if (desc)
+        fake_rx_desc(f);
+    else if ((f->rx_frag_hdr & MAILBOX_FRAG_LAST) && !(f->rx_frag_hdr & MAILBOX_FRAG_ABORT))
+        f->stats.rx_msgs++;
+    return !desc;
 }
 
+/* 消费C2A接收区，发送队列满时只读一部分，形成对Linux端的反压 */
+static bool fake_peer_rx(struct mailbox_fake *f)
+{
+    u64 linux_ir, csr, bits;
+    unsigned int head, tail, n, i;
+    u64 word;
+
+    csr = fake_readq(f, f->ring.own_csr);
+    if (csr == MAILBOX_CSR_STOPPED)
+        return false;
+    if (csr & MAILBOX_CSR_VALID_MASK)
+    {
+        // 门铃只用于统计，对端本身一直在轮询tail
+        fake_writeq(f, csr & C2AMAILBOX_INT_ENA, f->ring.own_csr);
+        f->stats.rx_doorbells++;
+    }
 
+    linux_ir = fake_readq(f, f->ring.peer_ir);
+    tail = mailbox_ring_rx_tail(linux_ir);
+    head = f->ir & MAILBOX_IR_HEAD_MASK;
+    if (tail >= f->ring.rx_regs || head == tail)
+        return false;
+    smp_rmb(); // 先看到tail，再读tail之前写入的寄存器
+
+    n = (tail + f->ring.rx_regs - head) % f->ring.rx_regs;
+    // 回显的寄存器不超过读出的寄存器，每个描述符分片至多换来两个分片
+    n = min(n, kfifo_avail(&f->tx_fifo) / 2);
+    if (n == 0)
+        return false;
+    for (i = 0; i < n; ++i)
+    {
+        word = fake_readq(f, f->ring.rx_base + ((head + i) % f->ring.rx_regs) * 8);
+        if (fake_rx_parse(f, word) && f->mode == FAKE_MODE_ECHO)
+            kfifo_put(&f->tx_fifo, word);
+    }
+    f->stats.rx_regs += n;
+
+    head = (head + n) % f->ring.rx_regs;
+    f->ir = (f->ir & ~MAILBOX_IR_HEAD_MASK) | head;
+    fake_writeq(f, f->ir, f->ring.own_ir);
+    // head通知与bank应答合并成一次写
+    bits = f->rx_bank_acks | (linux_ir & MAILBOX_IR_TX_WAIT ? MAILBOX_CSR_HEAD_NOTIFY : 0);
+    f->rx_bank_acks = 0;
+    if (bits)
+        fake_ring_doorbell(f, bits);
+    return true;
+}
 
-static ssize_t mailbox_read(struct file *file, char __user * buf, size_t size, loff_t *offp)
+/* 按gen_rate把到期的消息分片放入发送队列，首8字节为生成时刻，便于用户态计算延迟 */
+static bool fake_peer_generate(struct mailbox_fake *f)
 {
+    size_t words = mailbox_frame_words(gen_size, mailbox_frag_max_words(&f->ring));
+    u64 now = ktime_get_ns();
+    u64 *buf = f->gen_buf;
+    size_t sent = 0, n;
+    unsigned int frag = 0, w, flags;
+    bool work = false;
+
+    while (kfifo_avail(&f->tx_fifo) >= words)
+    {
+        if (gen_rate && f->stats.tx_msgs >= div_u64((now - f->gen_start_ns) * gen_rate, NSEC_PER_SEC))
+            break;
 
-    int err;
-    int msg_size;
-    Msg msg;
-    
-    
-    msg_size=sizeof(Msg);
-    loff_t n; n = min(size/msg_size,kfifo_len (&mailbox_fifo));
-    loff_t len= n*msg_size;
-    err=0;
-    int copied;
-    if(len != 0)
-        err = kfifo_to_user(&mailbox_fifo, buf, len, &copied);
-    (* offp) = 0;//seek to 0
-    return err ? -EFAULT: len;
+        w = 0;
+        sent = 0;
+        frag = 0;
+        do
+        {
+            n = min_t(size_t, gen_size - sent, mailbox_frag_max_words(&f->ring) * sizeof(u64));
+            flags = (frag == 0 ? MAILBOX_FRAG_FIRST : 0) | (sent + n == gen_size ? MAILBOX_FRAG_LAST : 0);
+            buf[w] = MAILBOX_FRAG_HEADER(gen_chan, FAKE_GEN_TASK, DIV_ROUND_UP(n, sizeof(u64)), flags, frag == 0 ? gen_size : frag);
+            memset(&buf[w + 1], 0xa5, DIV_ROUND_UP(n, sizeof(u64)) * sizeof(u64));
+            if (frag == 0)
+                memcpy(&buf[w + 1], &now, min_t(size_t, n, sizeof(now)));
+            w += 1 + DIV_ROUND_UP(n, sizeof(u64));
+            sent += n;
+            frag++;
+        } while (sent < gen_size);
+        kfifo_in(&f->tx_fifo, buf, w);
+        f->stats.tx_msgs++;
+        work = true;
+    }
+    return work;
 }
 
-static unsigned int mailbox_poll(struct file *file, struct poll_table_struct *wait)
+/* 把发送队列搬进A2C接收区，写完寄存器再推进tail并敲门铃 */
+static bool fake_peer_tx(struct mailbox_fake *f)
 {
+    unsigned int head, tail, free, n, i;
+    u64 word;
+
+    if (kfifo_is_empty(&f->tx_fifo))
+        return false;
+    head = fake_readq(f, f->ring.peer_ir) & MAILBOX_IR_HEAD_MASK;
+    tail = (f->ir & MAILBOX_IR_TAIL_MASK) >> MAILBOX_IR_TAIL_SHIFT;
+    if (head >= f->ring.tx_regs)
+        return false;
+    free = f->ring.tx_regs - 1 - (tail + f->ring.tx_regs - head) % f->ring.tx_regs;
+    if (free == 0)
+    {
+        f->stats.tx_full++;
+        return false;
+    }
 
-    bool readable;
-    unsigned int mask = 0;
-
-    
-    poll_wait(file, &mailbox_waitq, wait);
-    
-    readable = kfifo_len(&mailbox_fifo) != 0;
-   if(readable){
-        mask = POLLIN | POLLRDNORM;
+    n = min(free, kfifo_len(&f->tx_fifo));
+    for (i = 0; i < n; ++i)
+    {
+        if (!kfifo_get(&f->tx_fifo, &word))
+            break;
+        fake_writeq(f, word, f->ring.tx_base + ((tail + i) % f->ring.tx_regs) * 8);
     }
+    f->stats.tx_regs += i;
+    smp_wmb(); // 寄存器先于tail可见
+
+    tail = (tail + i) % f->ring.tx_regs;
+    f->ir = (f->ir & ~MAILBOX_IR_TAIL_MASK) | ((u64)tail << MAILBOX_IR_TAIL_SHIFT);
+    fake_writeq(f, f->ir, f->ring.own_ir);
+    // 回显的寄存器不一定是完整的分片，使用不区分通道的门铃
+    fake_ring_doorbell(f, MAILBOX_CSR_DOORBELL);
+    return true;
+}
 
-    //sbi_printf("poll waked\n");
+static int fake_peer_thread(void *data)
+{
+    struct mailbox_fake *f = data;
+    bool work;
 
-    return mask;
+    f->gen_start_ns = ktime_get_ns();
+    while (!kthread_should_stop())
+    {
+        work = fake_peer_rx(f);
+        if (f->mode == FAKE_MODE_GEN)
+            work |= fake_peer_generate(f);
+        work |= fake_peer_tx(f);
+        if (work)
+            cond_resched();
+        else if (peer_poll_us)
+            usleep_range(peer_poll_us, peer_poll_us + peer_poll_us / 4 + 1);
+        else
+            cond_resched();
+    }
+    return 0;
 }
 
-/* probe platform driver */
-static int mailbox_probe(struct platform_device *pdev)
+/* 实例0的目录为sw_mailbox_fake，其余为sw_mailbox_fakeI，与驱动的实例名对应 */
+static void fake_debugfs_init(struct mailbox_fake *f)
 {
-    return 0;
+    char name[24];
+
+    if (f->id)
+        snprintf(name, sizeof(name), "sw_mailbox_fake%u", f->id);
+    else
+        strscpy(name, "sw_mailbox_fake", sizeof(name));
+    f->debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_u64("rx_regs", 0444, f->debugfs, &f->stats.rx_regs);
+    debugfs_create_u64("rx_msgs", 0444, f->debugfs, &f->stats.rx_msgs);
+    debugfs_create_u64("rx_doorbells", 0444, f->debugfs, &f->stats.rx_doorbells);
+    debugfs_create_u64("tx_regs", 0444, f->debugfs, &f->stats.tx_regs);
+    debugfs_create_u64("tx_msgs", 0444, f->debugfs, &f->stats.tx_msgs);
+    debugfs_create_u64("tx_full", 0444, f->debugfs, &f->stats.tx_full);
+    debugfs_create_u64("irqs", 0444, f->debugfs, &f->stats.irqs);
+    debugfs_create_u64("rx_descs", 0444, f->debugfs, &f->stats.rx_descs);
+    debugfs_create_u64("tx_descs", 0444, f->debugfs, &f->stats.tx_descs);
+    debugfs_create_u64("desc_done", 0444, f->debugfs, &f->stats.desc_done);
+    debugfs_create_u64("desc_drops", 0444, f->debugfs, &f->stats.desc_drops);
 }
 
-// /* remove platform driver */
-static int mailbox_remove(struct platform_device *pdev)
+static int fake_parse_mode(enum fake_mode *m)
 {
+    if (sysfs_streq(mode, "echo"))
+        *m = FAKE_MODE_ECHO;
+    else if (sysfs_streq(mode, "sink"))
+        *m = FAKE_MODE_SINK;
+    else if (sysfs_streq(mode, "gen"))
+        *m = FAKE_MODE_GEN;
+    else
+        return -EINVAL;
     return 0;
 }
 
-static const struct of_device_id mailbox_of_match[] = {
-    { .compatible = "asp,asp_mailbox", },
-    { },
-};
-MODULE_DEVICE_TABLE(of, mailbox_of_match);
-
-/* platform driver information */
-static struct platform_driver mailbox_driver = {
-    .probe  = mailbox_probe,
-    .remove = mailbox_remove,
-    .driver = {
-        .name = DEVICE_NAME, 
-        .of_match_table = mailbox_of_match,
-    },
-};
-
-static const struct file_operations mailbox_fops = {
-    .owner = THIS_MODULE,
-    .open = mailbox_open,
-    .read = mailbox_read,
-    .write = mailbox_write,
-    .poll = mailbox_poll,
-    .release = mailbox_close,
-    .llseek = default_llseek
-};
-
-static int mailbox_setup_cdev(struct cdev *cdev, dev_t devno)
+static void fake_destroy(struct mailbox_fake *f)
 {
-    int ret = 0;
-
-    cdev_init(cdev, &mailbox_fops);
-    cdev->owner = THIS_MODULE;
-    ret = cdev_add(cdev,devno, 1);
-
-    return ret;
+    // 先解绑驱动，驱动释放中断之后才能拆掉中断域与寄存器窗口
+    platform_device_unregister(f->pdev);
+    kthread_stop(f->thread);
+    debugfs_remove_recursive(f->debugfs);
+    printk("sw_mailbox: fake peer %u exit, rx %llu msgs, tx %llu msgs, %llu irqs\n",
+           f->id, f->stats.rx_msgs, f->stats.tx_msgs, f->stats.irqs);
+    irq_dispose_mapping(f->irq);
+    irq_domain_remove_sim(f->irq_domain);
+    kfifo_free(&f->tx_fifo);
+    vfree(f->gen_buf);
+    vfree(f->regs);
+    vfree(f->shm);
+    bitmap_free(f->desc_busy);
+    kfree(f->desc_seq);
+    kfree(f);
 }
 
-static int __init mailbox_init(void)
+/* 一个实例：两个接收区按默认方式排列，C2A在前，A2C紧随其后 */
+static struct mailbox_fake *fake_create(unsigned int id, enum fake_mode m)
 {
-    
-
-
+    struct platform_device_info info;
+    struct mailbox_fake *f;
+    struct resource res;
+    unsigned int area = mailbox_ring_area_size(reg_num);
     int ret;
-    dev_t devno;
-    
-    printk("fake sw_mailbox: mailbox 20210322 driver init...\n");
-
-    platform_driver_register(&mailbox_driver);
-
-    // get devno
-    if(mailbox_major){
-        devno = MKDEV(mailbox_major, mailbox_minor);
-        ret = register_chrdev_region(devno, 1, DEVICE_NAME);
-    } else {
-        ret = alloc_chrdev_region(&devno, mailbox_minor, 1, DEVICE_NAME);
-        mailbox_major = MAJOR(devno);
-    }
-    printk("sw_mailbox: mailbox - major: %d\n", mailbox_major);
 
-    if(ret <0){
-        printk("sw_mailbox: get mailbox major failed\n");
-        return ret;
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (!f)
+        return ERR_PTR(-ENOMEM);
+    f->id = id;
+    f->mode = m;
+    spin_lock_init(&f->csr_lock);
+
+    f->regs = vzalloc(2 * area);
+    mailbox_ring_setup(&f->ring, (unsigned char __iomem *)f->regs, area, reg_num, 0, reg_num);
+    f->gen_buf = vmalloc(mailbox_frame_words(gen_size, mailbox_frag_max_words(&f->ring)) * sizeof(u64));
+    if (!f->regs || !f->gen_buf || kfifo_alloc(&f->tx_fifo, FAKE_TX_FIFO_SIZE, GFP_KERNEL))
+    {
+        ret = -ENOMEM;
+        goto alloc_fail;
     }
- 
-    // setup cdev
-    ret = mailbox_setup_cdev(&mailbox_cdev, devno);
-    if(ret) {
-        printk("sw_mailbox: mailbox setup cdev failed, ret = %d\n",ret);
-        goto cdev_add_fail;
+    if (shm_kb)
+    {
+        // vmalloc_user的内存可以被驱动remap_vmalloc_range给应用
+        f->pdata.shm_size = (size_t)shm_kb << 10;
+        f->desc_slots = f->pdata.shm_size / 2 / desc_slot_size;
+        f->shm = vmalloc_user(f->pdata.shm_size);
+        f->desc_busy = bitmap_zalloc(f->desc_slots, GFP_KERNEL);
+        f->desc_seq = kcalloc(f->desc_slots, sizeof(*f->desc_seq), GFP_KERNEL);
+        if (!f->shm || !f->desc_busy || !f->desc_seq)
+        {
+            ret = -ENOMEM;
+            goto alloc_fail;
+        }
     }
+    // 对端一开始就在监听中断，Linux端的使能位由驱动probe时写入
+    fake_writeq(f, C2AMAILBOX_INT_ENA, f->ring.own_csr);
 
-    // create class
-    mailbox_class = class_create(THIS_MODULE, DEVICE_NAME);
-    ret = IS_ERR(mailbox_class);
-    if(ret)
+    f->irq_domain = irq_domain_create_sim(NULL, 1);
+    if (IS_ERR(f->irq_domain))
     {
-        printk(KERN_WARNING "sw_mailbox: class create failed\n");
-        goto class_create_fail;
+        ret = PTR_ERR(f->irq_domain);
+        goto alloc_fail;
+    }
+    f->irq = irq_create_mapping(f->irq_domain, 0);
+    if (!f->irq)
+    {
+        ret = -ENXIO;
+        goto irq_fail;
     }
 
-    // create device
-    mailbox_device = device_create(mailbox_class, NULL, devno, NULL, DEVICE_NAME);
-    ret = IS_ERR(mailbox_device);
-    if(ret)
+    f->thread = kthread_run(fake_peer_thread, f, "sw_mailbox_fake%u", id);
+    if (IS_ERR(f->thread))
     {
-        printk(KERN_WARNING "sw_mailbox: mailbox device create failed, error code %ld \n", PTR_ERR(mailbox_device));
-        goto device_create_fail;
-    } 
-    else 
+        ret = PTR_ERR(f->thread);
+        goto thread_fail;
+    }
+
+    // 驱动按名字绑定到这个设备，寄存器窗口、寄存器数与中断通过platform_data与IRQ资源传过去
+    memset(&res, 0, sizeof(res));
+    res.start = res.end = f->irq;
+    res.flags = IORESOURCE_IRQ;
+    res.name = DEVICE_NAME;
+    f->pdata.regs = (unsigned char __iomem *)f->regs;
+    f->pdata.reg_num = reg_num;
+    f->pdata.csr_write = fake_csr_write;
+    f->pdata.ctx = f;
+    f->pdata.shm = f->shm;
+    f->pdata.desc_slot_size = desc_slot_size;
+    memset(&info, 0, sizeof(info));
+    info.name = DEVICE_NAME;
+    info.id = id;
+    info.res = &res;
+    info.num_res = 1;
+    info.data = &f->pdata;
+    info.size_data = sizeof(f->pdata);
+    f->pdev = platform_device_register_full(&info);
+    if (IS_ERR(f->pdev))
     {
-        printk("sw_mailbox: succeed to create /dev/%s \n",DEVICE_NAME);
+        ret = PTR_ERR(f->pdev);
+        goto pdev_fail;
     }
-    //create kfifo
-    ret = kfifo_alloc(&mailbox_fifo, FIFO_SIZE, GFP_KERNEL); 
-    if(ret)
+
+    fake_debugfs_init(f);
+    printk("sw_mailbox: fake peer %u ready, mode %s, %u registers, irq %d\n", id, mode, reg_num, f->irq);
+    return f;
+
+pdev_fail:
+    kthread_stop(f->thread);
+thread_fail:
+    irq_dispose_mapping(f->irq);
+irq_fail:
+    irq_domain_remove_sim(f->irq_domain);
+alloc_fail:
+    kfifo_free(&f->tx_fifo);
+    vfree(f->gen_buf);
+    vfree(f->regs);
+    vfree(f->shm);
+    bitmap_free(f->desc_busy);
+    kfree(f->desc_seq);
+    kfree(f);
+    return ERR_PTR(ret);
+}
+
+static int __init mailbox_fake_init(void)
+{
+    enum fake_mode m;
+    unsigned int i;
+    int ret;
+
+    ret = fake_parse_mode(&m);
+    if (ret)
     {
-        printk(KERN_ERR "sw_mailbox: error kfifo_alloc\n");
+        printk(KERN_ERR "sw_mailbox: fake peer: unknown mode %s\n", mode);
         return ret;
     }
-    printk("sw_mailbox: kfifo_size = %#x\n",kfifo_size(&mailbox_fifo));
+    if (gen_chan >= MAILBOX_MAX_CHANNELS || gen_size > FAKE_TX_FIFO_SIZE / 2 * sizeof(u64))
+    {
+        printk(KERN_ERR "sw_mailbox: fake peer: gen_chan or gen_size out of range\n");
+        return -EINVAL;
+    }
+    if (instances < 1 || instances > FAKE_MAX_INSTANCES || reg_num < 2 * MAILBOX_MAX_BANKS + 1 || reg_num > MAILBOX_MAX_REG_NUM)
+    {
+        printk(KERN_ERR "sw_mailbox: fake peer: instances or reg_num out of range\n");
+        return -EINVAL;
+    }
+    if (shm_kb && (desc_slot_size == 0 || desc_slot_size % PAGE_SIZE || ((size_t)shm_kb << 10) / 2 % PAGE_SIZE ||
+                   ((size_t)shm_kb << 10) / 2 < desc_slot_size))
+    {
+        printk(KERN_ERR "sw_mailbox: fake peer: shm_kb cannot hold buffers of desc_slot_size\n");
+        return -EINVAL;
+    }
 
-    
+    for (i = 0; i < instances; ++i)
+    {
+        fakes[i] = fake_create(i, m);
+        if (IS_ERR(fakes[i]))
+        {
+            ret = PTR_ERR(fakes[i]);
+            while (i--)
+                fake_destroy(fakes[i]);
+            return ret;
+        }
+    }
     return 0;
-device_create_fail:
-    class_destroy(mailbox_class);
-class_create_fail:
-    cdev_del(&mailbox_cdev);
-cdev_add_fail:
-    unregister_chrdev_region(devno, 1);
-    return ret;
 }
- 
-static void __exit mailbox_exit(void)
+
+static void __exit mailbox_fake_exit(void)
 {
-    dev_t devno;
- 
-    printk("sw_mailbox: mailbox driver exit...\n");
-    
-    devno = MKDEV(mailbox_major, mailbox_minor);
-    device_destroy(mailbox_class, devno);
-    class_destroy(mailbox_class);
-    cdev_del(&mailbox_cdev);
-    unregister_chrdev_region(devno, 1);
-    platform_driver_unregister(&mailbox_driver);
-}
+    unsigned int i;
 
-// module_platform_driver(mailbox_driver);
-module_init(mailbox_init);
-module_exit(mailbox_exit);
+    for (i = instances; i-- > 0;)
+        fake_destroy(fakes[i]);
+}
 
+module_init(mailbox_fake_init);
+module_exit(mailbox_fake_exit);
 
-MODULE_LICENSE("GPL");                
-MODULE_AUTHOR("LPN BYK YCC");               
-MODULE_DESCRIPTION("ASP mailbox");
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("LPN BYK YCC XZY");
+MODULE_DESCRIPTION("Emulated ASP peer for the sw_mailbox driver");
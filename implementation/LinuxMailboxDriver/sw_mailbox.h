@@ -0,0 +1,185 @@
+/* sw_mailbox驱动与用户态共享的ioctl接口定义 */
+#ifndef _SW_MAILBOX_H
+#define _SW_MAILBOX_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MAILBOX_IOC_MAGIC 'M'
+
+/*
+ * 分片帧头：每条消息被切成若干分片，每个分片的第一个寄存器为帧头，之后是payload寄存器。
+ * 一条消息只有最后一个寄存器补0对齐。不同task的分片可以交错，接收方按task重组。
+ *   [7:0]   task id
+ *   [15:8]  本分片payload寄存器数
+ *   [16]    FIRST：消息的第一个分片
+ *   [17]    LAST：消息的最后一个分片
+ *   [18]    ABORT：发送方放弃了该消息，接收方丢弃已收到的部分
+ *   [19]    BLOCK：块模式分片，每个分片单独写入并敲一次门铃，接收方读完后在发送方CSR中置所在bank的应答位
+ *   [20]    PACKED：合并分片，payload为若干条完整小消息紧凑排列的字节流，同时置FIRST与LAST，不参与按task重组
+ *   [21]    DESC：描述符分片，消息内容在共享内存中，payload为一个描述符寄存器，同时置FIRST与LAST
+ *   [22]    DONE：与DESC同时置位，接收方用完了描述符所指的缓冲区，把它原样交还发送方
+ *   [27:24] 逻辑通道号，对应/dev/sw_mailbox/chN
+ *   [31:28] 块模式分片所在的bank，发送方按分片序号轮流使用各bank
+ *   [63:32] FIRST分片中为消息字节数，其余分片中为分片序号；合并分片中为字节流的字节数
+ *
+ * 合并分片中每条消息为长度前缀加消息内容，消息之间不对齐，只有分片末尾补0。
+ * 长度小于128时前缀为1个字节；否则为2个字节，先放低7位并置最高位，再放其余的高位。
+ *
+ * 描述符模式：共享内存平分为两个缓冲池，前半为C2A池（Linux写入、ASP读出），后半为A2C池，
+ * 每个池切成大小相同的缓冲区。发送方在自己的池中分配缓冲区、填好内容，只把描述符写进寄存器环；
+ * 描述符分片的[63:32]为消息字节数。接收方读完后以DONE分片交还，发送方收到后才能重用该缓冲区。
+ *   描述符 [15:0] 缓冲区号，[31:16] 该缓冲区的发送序号，用于识别过期的交还，[63:32] 消息在缓冲区中的字节偏移
+ */
+#define MAILBOX_FRAG_TASK(hdr) ((hdr) & 0xff)
+#define MAILBOX_FRAG_WORDS(hdr) (((hdr) >> 8) & 0xff)
+#define MAILBOX_FRAG_FIRST (1ull << 16)
+#define MAILBOX_FRAG_LAST (1ull << 17)
+#define MAILBOX_FRAG_ABORT (1ull << 18)
+#define MAILBOX_FRAG_BLOCK (1ull << 19)
+#define MAILBOX_FRAG_PACKED (1ull << 20)
+#define MAILBOX_FRAG_DESC (1ull << 21)
+#define MAILBOX_FRAG_DONE (1ull << 22)
+#define MAILBOX_FRAG_CHAN(hdr) (((hdr) >> 24) & 0xf)
+#define MAILBOX_FRAG_BANK(hdr) (((hdr) >> 28) & 0xf)
+#define MAILBOX_FRAG_SET_BANK(bank) ((__u64)(bank) << 28)
+#define MAILBOX_FRAG_INFO(hdr) ((hdr) >> 32)
+#define MAILBOX_FRAG_HEADER(chan, task, words, flags, info) \
+    ((__u64)(task) | ((__u64)(words) << 8) | (flags) | ((__u64)(chan) << 24) | ((__u64)(info) << 32))
+
+#define MAILBOX_DESC(buf, seq, off) ((__u64)((buf) & 0xffff) | ((__u64)((seq) & 0xffff) << 16) | ((__u64)(off) << 32))
+#define MAILBOX_DESC_BUF(desc) ((desc) & 0xffff)
+#define MAILBOX_DESC_SEQ(desc) (((desc) >> 16) & 0xffff)
+#define MAILBOX_DESC_OFF(desc) ((desc) >> 32)
+
+/* 逻辑通道数的上限，受帧头中通道号的位宽限制 */
+#define MAILBOX_MAX_CHANNELS 16
+
+/*
+ * 发送优先级：每个通道每个类别一个发送队列，驱动每写一个分片都先看高优先级队列，
+ * 大消息在分片之间让出寄存器环，高优先级的消息进入下一次写入。同一文件两个类别的消息用不同的task发送，接收方分别重组；
+ * 高优先级的消息不合并发送。文件的类别由MAILBOX_IOC_SET_PRIO设置，默认为NORMAL，
+ * MAILBOX_IOC_SENDV中的单条消息还可以用MAILBOX_MSG_HIGH指定为高优先级。
+ */
+#define MAILBOX_PRIO_NORMAL 0
+#define MAILBOX_PRIO_HIGH 1
+#define MAILBOX_PRIO_NUM 2
+
+/* mailbox_msg.flags */
+#define MAILBOX_MSG_HIGH 0x1
+
+/* 单条消息描述符：buf为用户态缓冲区地址，len为字节数（接收时输入缓冲区容量，返回消息长度） */
+struct mailbox_msg
+{
+    __u64 buf;
+    __u32 len;
+    __u32 flags;
+};
+
+/* 批量收发：msgs指向count个mailbox_msg，done返回已处理的消息数，每个描述符对应一条完整消息 */
+struct mailbox_msgv
+{
+    __u64 msgs;
+    __u32 count;
+    __u32 done;
+};
+
+/* 收发两端的状态快照，长度均以字节计，队列长度为发起ioctl的通道的 */
+struct mailbox_status
+{
+    __u64 own_csr;  /* 自己接收区的CSR */
+    __u64 peer_csr; /* 对方接收区的CSR */
+    __u32 rx_queued;
+    __u32 tx_queued;
+    __u32 tx_free;
+    __u32 next_msg_len; /* 接收队列中下一条消息的字节数，队列为空时为0 */
+};
+
+/*
+ * 描述符模式的缓冲区：mmap设备节点得到本实例的发送缓冲池，缓冲区buf位于映射的buf * slot_size处。
+ * ALLOC返回一个空闲的缓冲区（buf与len = slot_size），应用直接在映射中填写内容；
+ * SEND把缓冲区中[off, off + len)作为一条消息发出，之后缓冲区归对方所有，对方交还后自动回到空闲状态；
+ * FREE放弃一个没有发出的缓冲区，关闭文件时同样会释放它分配而未发出的缓冲区。
+ */
+struct mailbox_desc
+{
+    __u32 buf;
+    __u32 off;
+    __u32 len;
+    __u32 flags;
+};
+
+struct mailbox_desc_info
+{
+    __u64 pool_size; /* 发送缓冲池的字节数，即mmap的最大长度 */
+    __u32 slot_size;
+    __u32 slots;
+    __u32 free_slots;
+    __u32 reserved;
+};
+
+/*
+ * 映射到用户态的接收环：以MAILBOX_MMAP_RX_RING为偏移mmap设备节点，长度为一页头部加数据区（2的幂，至少一页），
+ * 第一次映射的长度决定数据区大小，同一时刻只能有一个映射。映射期间本通道的消息由接收线程直接写进环中，
+ * read()与MAILBOX_IOC_RECVV返回-EBUSY。环放不下时驱动暂存消息并停止读寄存器环，对方随之在发送侧等待；
+ * 应用推进cons后再次poll()时恢复，暂存的消息按顺序搬进环。
+ * 数据区由若干8字节对齐的记录组成，记录不跨越数据区末尾：8字节记录头之后为消息内容，补齐到8字节。
+ * 内核预留记录后推进prod，消息完整后以release写记录头提交；应用按顺序读记录，遇到未提交的记录头（为0）即停，
+ * 用完后推进cons。环中没有已提交的记录时poll()等待POLLIN。
+ *   记录头 [31:0] 消息字节数，[61] PAD：填充到数据区末尾的空记录，[62] DISCARD：接收失败的消息，跳过，[63] COMMIT
+ */
+#define MAILBOX_MMAP_RX_RING 0x40000000ull
+#define MAILBOX_RXR_COMMIT (1ull << 63)
+#define MAILBOX_RXR_DISCARD (1ull << 62)
+#define MAILBOX_RXR_PAD (1ull << 61)
+#define MAILBOX_RXR_LEN(rec) ((rec) & 0xffffffff)
+#define MAILBOX_RXR_SIZE(len) (8 + (((__u64)(len) + 7) & ~7ull)) /* 记录占用的字节数 */
+
+struct mailbox_rx_ring
+{
+    __u64 prod; /* 内核写：已预留到的字节位置，单调增加 */
+    __u64 pad0[7];
+    __u64 cons; /* 应用写：已消费到的字节位置 */
+    __u64 pad1[7];
+    __u64 size;  /* 数据区字节数，数据区从头部之后的下一页开始 */
+    __u64 drops; /* 环满时暂存也超过rx_queue_max而被丢弃的消息数 */
+};
+
+/*
+ * 旁路：驱动以bypass=1加载时，一个有CAP_SYS_RAWIO的进程可以独占实例的寄存器环，在用户态按同样的协议收发（见libmailbox/）。
+ * BYPASS之后以MAILBOX_MMAP_REGS为偏移mmap同一个文件，得到寄存器窗口所在的页；中断到达时驱动清掉门铃、保持中断使能，
+ * 向eventfd加1，不再读接收区。旁路期间本实例的write()与发送类ioctl返回-EBUSY，已在接收队列中的消息仍可read()。
+ * 进入旁路时驱动的发送队列必须为空、没有在对方手中的描述符缓冲区，否则返回-EBUSY；驱动重组了一半的消息被丢弃。
+ * 应用只在分片边界推进head与tail，发起BYPASS的文件关闭（映射随之解除）后驱动从IR中的head与tail接着收发。
+ */
+#define MAILBOX_MMAP_REGS 0x80000000ull
+
+struct mailbox_bypass
+{
+    __s32 eventfd;    /* 输入：转发中断的eventfd，-1为不转发，应用忙等 */
+    __u32 task;       /* 本文件发送用的task id */
+    __u64 map_size;   /* 以MAILBOX_MMAP_REGS为偏移mmap的长度 */
+    __u32 reg_offset; /* 寄存器窗口在映射中的字节偏移 */
+    __u32 tx_base;    /* 对方接收区在寄存器窗口中的字节偏移 */
+    __u32 tx_regs;
+    __u32 rx_base;    /* 自己接收区在寄存器窗口中的字节偏移 */
+    __u32 rx_regs;
+    __u32 rx_skip;    /* head处驱动读了一半的分片还剩的寄存器数，应用先跳过它们 */
+};
+
+#define MAILBOX_IOC_START _IO(MAILBOX_IOC_MAGIC, 1)
+#define MAILBOX_IOC_STOP _IO(MAILBOX_IOC_MAGIC, 2)
+#define MAILBOX_IOC_STATUS _IOR(MAILBOX_IOC_MAGIC, 3, struct mailbox_status)
+#define MAILBOX_IOC_SENDV _IOWR(MAILBOX_IOC_MAGIC, 4, struct mailbox_msgv)
+#define MAILBOX_IOC_RECVV _IOWR(MAILBOX_IOC_MAGIC, 5, struct mailbox_msgv)
+/* 立即发出本通道合并中的小消息，不等字节数、消息数或定时器 */
+#define MAILBOX_IOC_FLUSH _IO(MAILBOX_IOC_MAGIC, 6)
+#define MAILBOX_IOC_DESC_INFO _IOR(MAILBOX_IOC_MAGIC, 7, struct mailbox_desc_info)
+#define MAILBOX_IOC_DESC_ALLOC _IOR(MAILBOX_IOC_MAGIC, 8, struct mailbox_desc)
+#define MAILBOX_IOC_DESC_SEND _IOW(MAILBOX_IOC_MAGIC, 9, struct mailbox_desc)
+#define MAILBOX_IOC_DESC_FREE _IOW(MAILBOX_IOC_MAGIC, 10, struct mailbox_desc)
+#define MAILBOX_IOC_BYPASS _IOWR(MAILBOX_IOC_MAGIC, 11, struct mailbox_bypass)
+/* 设置本文件的发送优先级，参数为MAILBOX_PRIO_* */
+#define MAILBOX_IOC_SET_PRIO _IOW(MAILBOX_IOC_MAGIC, 12, __u32)
+
+#endif /* _SW_MAILBOX_H */
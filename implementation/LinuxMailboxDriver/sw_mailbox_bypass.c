@@ -0,0 +1,149 @@
+/* 旁路：把寄存器环交给一个特权进程在用户态收发，驱动只转发中断 */
+#include "sw_mailbox_priv.h"
+
+static DEFINE_MUTEX(mailbox_bypass_lock); /* 进入与退出旁路 */
+
+/* 旁路映射的长度：寄存器窗口所在的整页 */
+static size_t mailbox_bypass_map_size(struct mailbox_dev *md)
+{
+    return PAGE_ALIGN(offset_in_page(md->regs_phys) + md->regs_size);
+}
+
+/* 发送方向是否已经静止：提交环为空、没有写了一半的分片、没有在对方手中的描述符缓冲区，调用者持有tx_lock */
+static bool mailbox_bypass_tx_idle(struct mailbox_dev *md)
+{
+    unsigned int b;
+
+    if (mailbox_tx_queued(md) || md->tx_frag_left || !kfifo_is_empty(&md->desc_done))
+        return false;
+    for_each_set_bit(b, md->desc_busy, md->desc_slots)
+    {
+        if (!md->desc_owner[b])
+            return false;
+    }
+    return true;
+}
+
+/* 旁路结束：驱动从应用留在IR中的head与tail接着收发，读出期间到达的数据 */
+void mailbox_bypass_exit(struct mailbox_dev *md)
+{
+    unsigned long flags;
+
+    mutex_lock(&mailbox_bypass_lock);
+    // 旁路标志清掉之前发送队列不会被搬运，先恢复影子寄存器与缓存的对方head
+    spin_lock_irqsave(&md->tx_lock, flags);
+    spin_lock(&md->ir_lock);
+    md->ir_shadow = readq(md->ring.base + md->ring.own_ir) & ~MAILBOX_IR_TX_WAIT;
+    writeq(md->ir_shadow, md->ring.base + md->ring.own_ir);
+    spin_unlock(&md->ir_lock);
+    md->tx_peer_head = mailbox_ring_tx_head_init(&md->ring, md->ir_shadow);
+    md->tx_waiting = false;
+    spin_unlock_irqrestore(&md->tx_lock, flags);
+    WRITE_ONCE(md->bypass_file, NULL);
+    synchronize_irq(md->irq); // 之后中断处理不再使用eventfd
+    if (md->bypass_efd)
+        eventfd_ctx_put(md->bypass_efd);
+    md->bypass_efd = NULL;
+    mutex_unlock(&mailbox_bypass_lock);
+    printk("sw_mailbox: %s: bypass ended\n", md->name);
+    mailbox_write_csr(md, A2CMAILBOX_INT_ENA | MAILBOX_CSR_VALID_MASK);
+    mailbox_tx_pump(md);
+    irq_wake_thread(md->irq, md);
+}
+
+/* 把实例的寄存器环交给发起ioctl的进程，成功后它才能以MAILBOX_MMAP_REGS映射寄存器窗口 */
+long mailbox_ioctl_bypass(struct file *file, struct mailbox_bypass __user *argp)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    struct mailbox_dev *md = ch->md;
+    struct eventfd_ctx *efd = NULL;
+    struct mailbox_bypass bp;
+    unsigned long flags;
+    unsigned int c, t;
+    bool idle;
+
+    if (!bypass || !capable(CAP_SYS_RAWIO))
+        return -EPERM;
+    if (!md->regs_phys)
+        return -EOPNOTSUPP; // 模拟的窗口要由对端模拟CSR的写1清零，应用无法直接访问
+    if (copy_from_user(&bp, argp, sizeof(bp)))
+        return -EFAULT;
+    if (bp.eventfd >= 0)
+    {
+        efd = eventfd_ctx_fdget(bp.eventfd);
+        if (IS_ERR(efd))
+            return PTR_ERR(efd);
+    }
+
+    mutex_lock(&mailbox_bypass_lock);
+    if (md->bypass_file)
+    {
+        mutex_unlock(&mailbox_bypass_lock);
+        if (efd)
+            eventfd_ctx_put(efd);
+        return -EBUSY;
+    }
+    // 在tx_lock下确认已经发完再开始旁路，之后搬运者看到旁路不再搬运；没发完时什么都没有改变
+    spin_lock_irqsave(&md->tx_lock, flags);
+    spin_lock(&md->desc_lock);
+    idle = mailbox_bypass_tx_idle(md);
+    if (idle)
+    {
+        md->bypass_efd = efd;
+        WRITE_ONCE(md->bypass_file, file);
+    }
+    spin_unlock(&md->desc_lock);
+    spin_unlock_irqrestore(&md->tx_lock, flags);
+    if (!idle)
+    {
+        mutex_unlock(&mailbox_bypass_lock);
+        if (efd)
+            eventfd_ctx_put(efd);
+        return -EBUSY;
+    }
+    // 接收线程看到旁路后开中断退出，之后分片解析状态不再变化；应用忙等时不需要中断
+    synchronize_irq(md->irq);
+    if (!efd)
+        mailbox_write_csr(md, MAILBOX_CSR_VALID_MASK);
+    memset(&bp, 0, sizeof(bp));
+    bp.rx_skip = md->rx_frag_left;
+    md->rx_frag_left = 0;
+    md->rx_packed_filled = 0;
+    for (c = 0; c < nr_channels; ++c)
+    {
+        for (t = 0; t < MAILBOX_TASK_NUM; ++t)
+            mailbox_rx_drop_partial(&md->chans[c], t);
+    }
+    md->stats.bypass_entries++;
+    mutex_unlock(&mailbox_bypass_lock);
+
+    bp.eventfd = efd ? 0 : -1;
+    bp.task = mailbox_file_task(file);
+    bp.map_size = mailbox_bypass_map_size(md);
+    bp.reg_offset = offset_in_page(md->regs_phys);
+    bp.tx_base = md->ring.tx_base;
+    bp.tx_regs = md->ring.tx_regs;
+    bp.rx_base = md->ring.rx_base;
+    bp.rx_regs = md->ring.rx_regs;
+    if (copy_to_user(argp, &bp, sizeof(bp)))
+    {
+        mailbox_bypass_exit(md);
+        return -EFAULT;
+    }
+    printk("sw_mailbox: %s: bypass to pid %d\n", md->name, task_pid_nr(current));
+    return 0;
+}
+
+/* 把寄存器窗口所在的页映射给旁路的进程，子进程不继承 */
+int mailbox_bypass_mmap(struct file *file, struct mailbox_dev *md, struct vm_area_struct *vma)
+{
+    size_t size = vma->vm_end - vma->vm_start;
+
+    if (READ_ONCE(md->bypass_file) != file)
+        return -EPERM;
+    if (size != mailbox_bypass_map_size(md))
+        return -EINVAL;
+    vma->vm_flags |= VM_IO | VM_DONTCOPY | VM_DONTEXPAND;
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    return io_remap_pfn_range(vma, vma->vm_start, PHYS_PFN(md->regs_phys), size, vma->vm_page_prot);
+}
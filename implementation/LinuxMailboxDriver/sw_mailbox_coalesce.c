@@ -0,0 +1,133 @@
+/* 合并发送：不大于coalesce_bytes的消息以长度前缀紧凑排列在一个合并分片中发出，接收方按长度前缀拆回 */
+#include "sw_mailbox_priv.h"
+
+/* 把合并分片的字节流拆成一条条消息放入通道的接收队列，返回完成的消息数 */
+int mailbox_rx_unpack(struct mailbox_chan *ch)
+{
+    struct mailbox_dev *md = ch->md;
+    const u8 *p = (const u8 *)md->rx_packed, *end = p + md->rx_packed_len;
+    struct mailbox_rx_msg *msg;
+    unsigned int k;
+    int completed = 0;
+    size_t len;
+
+    md->stats.rx_packed_frags++;
+    while (p < end)
+    {
+        k = mailbox_pack_get_len(p, end - p, &len);
+        if (k == 0 || len > end - p - k)
+        {
+            md->stats.rx_drops++; // 字节流与帧头中的长度不符
+            break;
+        }
+        p += k;
+        msg = mailbox_rx_msg_alloc(ch, len);
+        if (!msg)
+        {
+            md->stats.rx_drops++;
+            p += len;
+            continue;
+        }
+        msg->filled = len;
+        memcpy(msg->data, p, len);
+        p += len;
+        completed += mailbox_rx_enqueue(ch, msg);
+    }
+    return completed;
+}
+
+/* 把通道的合并分片交给发送队列，发送队列放不下时返回false，调用者持有co_lock */
+static bool mailbox_co_flush_locked(struct mailbox_chan *ch)
+{
+    unsigned int words = DIV_ROUND_UP(ch->co_bytes, sizeof(uint64_t));
+
+    if (ch->co_msgs == 0)
+        return true;
+    memset((u8 *)&ch->co_frag[1] + ch->co_bytes, 0, words * sizeof(uint64_t) - ch->co_bytes); // 只有分片末尾补0
+    ch->co_frag[0] = MAILBOX_FRAG_HEADER(ch->id, 0, words,
+                                         MAILBOX_FRAG_FIRST | MAILBOX_FRAG_LAST | MAILBOX_FRAG_PACKED, ch->co_bytes);
+    if (mailbox_tx_submit(ch, MAILBOX_PRIO_NORMAL, ch->co_frag, 1 + words) == 0)
+        return false;
+    ch->md->stats.tx_packed_frags++;
+    ch->co_bytes = 0;
+    ch->co_msgs = 0;
+    hrtimer_try_to_cancel(&ch->co_timer);
+    return true;
+}
+
+/* 立即发出通道合并中的消息，发送队列满时等待，非阻塞时返回-EAGAIN */
+int mailbox_co_flush(struct mailbox_chan *ch, bool nonblock)
+{
+    unsigned long flags;
+    bool done;
+    int ret;
+
+    for (;;)
+    {
+        spin_lock_irqsave(&ch->co_lock, flags);
+        done = mailbox_co_flush_locked(ch);
+        spin_unlock_irqrestore(&ch->co_lock, flags);
+        if (done)
+            return 0;
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_killable(ch->tx_waitq, mailbox_tx_frag_room(ch, MAILBOX_PRIO_NORMAL));
+        if (ret)
+            return ret;
+    }
+}
+
+/* 第一条消息等满coalesce_us，发送队列满时稍后再试 */
+enum hrtimer_restart mailbox_co_timer_fn(struct hrtimer *timer)
+{
+    struct mailbox_chan *ch = container_of(timer, struct mailbox_chan, co_timer);
+    unsigned long flags;
+    bool done;
+
+    spin_lock_irqsave(&ch->co_lock, flags);
+    done = mailbox_co_flush_locked(ch);
+    spin_unlock_irqrestore(&ch->co_lock, flags);
+    if (done)
+        return HRTIMER_NORESTART;
+    hrtimer_forward_now(timer, us_to_ktime(max(coalesce_us, tx_poll_min_us)));
+    return HRTIMER_RESTART;
+}
+
+/* 把size字节的小消息追加到通道的合并分片，达到字节数或消息数阈值时交给发送队列，返回消息字节数，调用者持有ch->write_lock */
+ssize_t mailbox_co_send(struct mailbox_chan *ch, struct iov_iter *from, size_t size, bool nonblock)
+{
+    unsigned int capacity = mailbox_pack_capacity(&ch->md->ring);
+    unsigned int threshold = min(coalesce_bytes, capacity);
+    u8 *data = (u8 *)ch->tx_bounce;
+    unsigned long flags;
+    u8 *p;
+    int ret;
+
+    // 先拷到中转页，co_lock下不能访问用户内存
+    if (copy_from_iter(data, size, from) != size)
+        return -EFAULT;
+
+    spin_lock_irqsave(&ch->co_lock, flags);
+    while (ch->co_bytes + mailbox_pack_prefix_len(size) + size > capacity && !mailbox_co_flush_locked(ch))
+    {
+        spin_unlock_irqrestore(&ch->co_lock, flags);
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_killable(ch->tx_waitq, mailbox_tx_frag_room(ch, MAILBOX_PRIO_NORMAL));
+        if (ret)
+            return ret;
+        spin_lock_irqsave(&ch->co_lock, flags);
+    }
+    p = (u8 *)&ch->co_frag[1] + ch->co_bytes;
+    p += mailbox_pack_put_len(p, size);
+    memcpy(p, data, size);
+    ch->co_bytes = p + size - (u8 *)&ch->co_frag[1];
+    if (ch->co_msgs++ == 0)
+        hrtimer_start(&ch->co_timer, us_to_ktime(coalesce_us), HRTIMER_MODE_REL);
+    // 发送队列满时留给定时器重试
+    if (ch->co_bytes >= threshold || ch->co_msgs >= coalesce_msgs)
+        mailbox_co_flush_locked(ch);
+    spin_unlock_irqrestore(&ch->co_lock, flags);
+    ch->md->stats.tx_packed_msgs++;
+    return size;
+}
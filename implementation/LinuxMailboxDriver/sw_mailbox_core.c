@@ -0,0 +1,1892 @@
+#include "sw_mailbox_priv.h"
+
+#define CREATE_TRACE_POINTS
+#include "sw_mailbox_trace.h"
+
+/* 每个通道的发送提交环大小（寄存器个数），必须是2的幂 */
+#define TX_FIFO_SIZE 4096
+/* 单个提交环条目的寄存器数上限，更大的消息拆成多个条目 */
+#define TX_ENTRY_MAX_WORDS (TX_FIFO_SIZE / 2)
+/* define name for device and driver */
+#define DEVICE_NAME "sw_mailbox"
+#define DEVICE_INTERRUPT 3
+/* mailbox实例数的上限，实例i的通道c为次设备号i * MAILBOX_MAX_CHANNELS + c */
+#define MAILBOX_MAX_DEVICES 16
+
+static struct class *mailbox_class = NULL;
+static DEFINE_IDA(mailbox_ida);
+
+static int mailbox_major = 0;
+static volatile int mailbox_event = 0;
+
+unsigned int nr_channels = 4;
+module_param(nr_channels, uint, 0444);
+MODULE_PARM_DESC(nr_channels, "logical channels multiplexed over each register ring, one device node each");
+
+static int irq_cpus[MAILBOX_MAX_DEVICES] = {[0 ... MAILBOX_MAX_DEVICES - 1] = -1};
+module_param_array(irq_cpus, int, NULL, 0444);
+MODULE_PARM_DESC(irq_cpus, "cpu for each mailbox instance's interrupt and receive thread, overrides asp,irq-cpu, -1 to leave it alone");
+
+#define UINT64(addr, offset) ((uint64_t *)(size_t)(addr))[offset]
+
+/* NAPI式接收：第一次中断后屏蔽中断，由轮询线程持续读取，直到接收区空闲后才重新开中断 */
+static unsigned int rx_poll_budget = 256;
+module_param(rx_poll_budget, uint, 0644);
+MODULE_PARM_DESC(rx_poll_budget, "registers drained per poll pass before yielding the cpu");
+
+static unsigned int rx_idle_us = 50;
+module_param(rx_idle_us, uint, 0644);
+MODULE_PARM_DESC(rx_idle_us, "microseconds without a tail update before interrupts are re-armed");
+
+/* 对方接收区满时先原地重读head，之后挂起等待标志并用指数退避的hrtimer兜底 */
+static unsigned int tx_spin_loops = 64;
+module_param(tx_spin_loops, uint, 0644);
+MODULE_PARM_DESC(tx_spin_loops, "head re-reads while the peer ring is full before falling back to the timer");
+
+unsigned int tx_poll_min_us = 2;
+module_param(tx_poll_min_us, uint, 0644);
+MODULE_PARM_DESC(tx_poll_min_us, "initial hrtimer interval while waiting for the peer to advance its head");
+
+static unsigned int tx_poll_max_us = 1000;
+module_param(tx_poll_max_us, uint, 0644);
+MODULE_PARM_DESC(tx_poll_max_us, "maximum hrtimer backoff interval while waiting for the peer");
+
+/* 接收队列以完整消息为单位，每条消息单独分配，超出上限的消息被丢弃 */
+static unsigned int rx_queue_max = 1 << 20;
+module_param(rx_queue_max, uint, 0644);
+MODULE_PARM_DESC(rx_queue_max, "bytes of complete messages queued for readers before new messages are dropped");
+
+/*
+ * 接收背压：某个通道的接收队列超过高水位后接收线程不再读接收区，head停止推进，对方写满后停在源头；
+ * 该通道的读者把队列读到低水位以下后恢复。寄存器环由各通道共用，一个通道停下时整个实例都停止接收。
+ */
+static unsigned int rx_high_watermark = 512 << 10;
+module_param(rx_high_watermark, uint, 0644);
+MODULE_PARM_DESC(rx_high_watermark, "queued bytes on a channel at which the receive ring stops being drained, 0 to drop at rx_queue_max instead");
+
+unsigned int rx_low_watermark = 128 << 10;
+module_param(rx_low_watermark, uint, 0644);
+MODULE_PARM_DESC(rx_low_watermark, "queued bytes on every stalled channel below which draining resumes");
+
+unsigned int rx_ring_max_kb = 4096;
+module_param(rx_ring_max_kb, uint, 0444);
+MODULE_PARM_DESC(rx_ring_max_kb, "largest data area in KiB of a receive ring mapped into user space");
+
+static unsigned int rx_max_msg = 1 << 20;
+module_param(rx_max_msg, uint, 0644);
+MODULE_PARM_DESC(rx_max_msg, "largest message in bytes accepted for reassembly");
+
+/*
+ * 块模式：不小于block_threshold的消息按bank大小分片，每个分片整片写入，
+ * 对方读完后以该bank的应答位回应；较小的消息仍按环形FIFO流式发送。
+ * block_banks为1时是停等，每个分片单独写入并敲一次门铃；多个bank时任意两个bank都放得下，
+ * 发送方在对方读bank N的同时写bank N+1，放得下的bank一次写入、敲一次门铃。
+ */
+static unsigned int block_threshold = 512;
+module_param(block_threshold, uint, 0644);
+MODULE_PARM_DESC(block_threshold, "messages of at least this many bytes use block mode, 0 to always stream");
+
+static unsigned int block_banks = 2;
+module_param(block_banks, uint, 0644);
+MODULE_PARM_DESC(block_banks, "banks the ring is split into in block mode, 1 for stop-and-wait, at most 4");
+
+static bool block_adaptive;
+module_param(block_adaptive, bool, 0644);
+MODULE_PARM_DESC(block_adaptive, "pick the mode with the lower observed per-register latency for messages above block_threshold");
+
+/*
+ * 合并发送：不大于coalesce_bytes的消息先追加到通道的合并分片，不单独占寄存器、推进tail与敲门铃。
+ * 合并分片攒够coalesce_bytes字节或coalesce_msgs条消息、第一条消息等了coalesce_us，
+ * 或收到MAILBOX_IOC_FLUSH时交给发送队列。更大的消息发送前先发出合并中的消息，保证本通道的顺序。
+ */
+unsigned int coalesce_bytes;
+module_param(coalesce_bytes, uint, 0644);
+MODULE_PARM_DESC(coalesce_bytes, "pack messages up to this many bytes and flush once this many are packed, 0 to disable");
+
+unsigned int coalesce_msgs = 32;
+module_param(coalesce_msgs, uint, 0644);
+MODULE_PARM_DESC(coalesce_msgs, "flush packed messages once this many are pending");
+
+unsigned int coalesce_us = 50;
+module_param(coalesce_us, uint, 0644);
+MODULE_PARM_DESC(coalesce_us, "flush packed messages this many microseconds after the first one was queued");
+
+/*
+ * 描述符模式：实例有共享内存时，不小于desc_threshold且放得下一个缓冲区的消息拷进发送池，
+ * 寄存器环中只传一个描述符；没有空闲缓冲区时仍按寄存器发送。应用也可以mmap发送池直接填写。
+ */
+static unsigned int desc_threshold = 16384;
+module_param(desc_threshold, uint, 0644);
+MODULE_PARM_DESC(desc_threshold, "messages of at least this many bytes go through a shared-memory buffer when one is free, 0 to disable");
+
+/* 旁路：允许一个特权进程映射寄存器窗口、在用户态收发，驱动只转发中断，默认关闭 */
+bool bypass;
+module_param(bypass, bool, 0644);
+MODULE_PARM_DESC(bypass, "let a CAP_SYS_RAWIO process map the register window and run the ring protocol in user space");
+
+static inline void mailbox_hist_add(u64 *hist, u64 val)
+{
+    hist[min_t(int, val ? ilog2(val) + 1 : 0, MAILBOX_HIST_BUCKETS - 1)]++;
+}
+
+/* 接收区中是否还有未读出的寄存器 */
+static inline bool mailbox_rx_pending(struct mailbox_dev *md)
+{
+    return mailbox_ring_rx_tail(readq(md->ring.base + md->ring.peer_ir)) != (md->ir_shadow & MAILBOX_IR_HEAD_MASK);
+}
+
+/* 修改自己IR中的字段并写回 */
+static void mailbox_update_ir(struct mailbox_dev *md, uint64_t mask, uint64_t val)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&md->ir_lock, flags);
+    md->ir_shadow = (md->ir_shadow & ~mask) | val;
+    writeq(md->ir_shadow, md->ring.base + md->ring.own_ir);
+    spin_unlock_irqrestore(&md->ir_lock, flags);
+}
+
+/* 置对方CSR中的门铃位，保留对方的中断使能位 */
+static inline void mailbox_ring_doorbell(struct mailbox_dev *md, uint64_t bits)
+{
+    uint64_t mailbox_csr = mailbox_ring_kick(&md->ring, bits);
+    WRITE_ONCE(md->tx_peer_stopped, mailbox_csr == MAILBOX_CSR_STOPPED);
+    if (bits & ~(MAILBOX_CSR_HEAD_NOTIFY | MAILBOX_CSR_BANK_ACK_MASK))
+        md->stats.doorbells_tx++;
+    trace_mailbox_csr_doorbell(true, mailbox_csr);
+}
+
+/* 当前分片所属的通道，通道号超出范围时返回NULL，该分片被跳过 */
+static inline struct mailbox_chan *mailbox_rx_frag_chan(struct mailbox_dev *md)
+{
+    unsigned int c = MAILBOX_FRAG_CHAN(md->rx_frag_hdr);
+    return c < nr_channels ? &md->chans[c] : NULL;
+}
+
+/*
+ * 为通道上一条len字节的消息分配接收缓冲：接收环映射期间在环中预留记录，否则整条消息单独分配。
+ * 环放不下或接收队列中已有积压时消息先进接收队列，同时停止读接收区，对方随之在发送侧等待；
+ * 应用推进cons后在poll()中恢复，由接收线程把积压的消息按顺序搬进环
+ */
+struct mailbox_rx_msg *mailbox_rx_msg_alloc(struct mailbox_chan *ch, size_t len)
+{
+    struct mailbox_rx_msg *msg = NULL;
+
+    if (len > rx_max_msg)
+        return NULL;
+    if (atomic_read(&ch->rx_ring_maps))
+    {
+        msg = kmalloc(sizeof(*msg), GFP_KERNEL);
+        if (!msg)
+            return NULL;
+        // 环中的消息不能越过积压在接收队列中的消息
+        if (list_empty(&ch->rx_msgs) && mailbox_rx_ring_reserve(ch, len, &msg->ring_pos))
+        {
+            msg->in_ring = true;
+            msg->data = ch->rx_ring_data + (msg->ring_pos & (ch->rx_ring_size - 1)) + sizeof(u64);
+        }
+        else
+        {
+            kfree(msg);
+            msg = NULL;
+            if (!test_and_set_bit(ch->id, &ch->md->interrupt_halting))
+                ch->md->stats.rx_ring_full++;
+        }
+    }
+    if (!msg)
+    {
+        msg = kvmalloc(sizeof(*msg) + len, GFP_KERNEL);
+        if (!msg)
+            return NULL;
+        msg->in_ring = false;
+        msg->data = (u8 *)(msg + 1);
+    }
+    msg->len = len;
+    msg->filled = 0;
+    msg->next_frag = 0;
+    return msg;
+}
+
+/* 释放没有进入接收队列的消息，环中的记录提交为丢弃，应用跳过它 */
+static void mailbox_rx_msg_free(struct mailbox_chan *ch, struct mailbox_rx_msg *msg)
+{
+    if (!msg)
+        return;
+    if (msg->in_ring)
+    {
+        mailbox_rx_ring_commit(ch, msg, true);
+        kfree(msg);
+        return;
+    }
+    kvfree(msg);
+}
+
+/* 丢弃task上重组了一半的消息 */
+void mailbox_rx_drop_partial(struct mailbox_chan *ch, u8 task)
+{
+    if (!ch->rx_partial[task])
+        return;
+    mailbox_rx_msg_free(ch, ch->rx_partial[task]);
+    ch->rx_partial[task] = NULL;
+    ch->md->stats.rx_drops++;
+}
+
+/* 把一条完整的消息放入通道的接收队列，接收队列超出rx_queue_max时丢弃，返回放入的消息数 */
+int mailbox_rx_enqueue(struct mailbox_chan *ch, struct mailbox_rx_msg *msg)
+{
+    struct mailbox_dev *md = ch->md;
+
+    if (msg->in_ring)
+    {
+        // 环中的消息由应用直接读出，不计入接收队列
+        mailbox_rx_ring_commit(ch, msg, false);
+        kfree(msg);
+        __set_bit(ch->id, &md->rx_wake_chans);
+        md->stats.rx_msgs++;
+        return 1;
+    }
+    spin_lock(&ch->rx_msgs_lock);
+    if (ch->rx_queued_bytes + msg->len > rx_queue_max && !list_empty(&ch->rx_msgs))
+    {
+        spin_unlock(&ch->rx_msgs_lock);
+        kvfree(msg);
+        md->stats.rx_drops++;
+        if (atomic_read(&ch->rx_ring_maps))
+            ch->rx_ring->drops++;
+        return 0;
+    }
+    list_add_tail(&msg->node, &ch->rx_msgs);
+    ch->rx_queued_bytes += msg->len;
+    if (rx_high_watermark && ch->rx_queued_bytes > rx_high_watermark && !test_and_set_bit(ch->id, &md->interrupt_halting))
+        md->stats.rx_high_hits++;
+    spin_unlock(&ch->rx_msgs_lock);
+    __set_bit(ch->id, &md->rx_wake_chans);
+    md->stats.rx_msgs++;
+    return 1;
+}
+
+/* 分片的全部payload都已收到，最后一个分片完成时把消息移入所属通道的接收队列，返回完成的消息数 */
+static int mailbox_rx_frag_end(struct mailbox_dev *md)
+{
+    struct mailbox_chan *ch = mailbox_rx_frag_chan(md);
+    u8 task = MAILBOX_FRAG_TASK(md->rx_frag_hdr);
+    struct mailbox_rx_msg *msg;
+
+    // 块模式分片无论能否重组都要应答，否则发送方会一直等这个bank
+    if (md->rx_frag_hdr & MAILBOX_FRAG_BLOCK)
+        md->rx_bank_acks |= MAILBOX_CSR_BANK_ACK(MAILBOX_FRAG_BANK(md->rx_frag_hdr) % MAILBOX_MAX_BANKS);
+    // 通道号不对的描述符也要交还，否则对方的缓冲区会泄漏
+    if (md->rx_frag_hdr & MAILBOX_FRAG_DESC)
+        return mailbox_rx_desc(md, ch);
+    if (!ch)
+        return 0;
+    if (md->rx_frag_hdr & MAILBOX_FRAG_PACKED)
+        return mailbox_rx_unpack(ch);
+    if (!(msg = ch->rx_partial[task]))
+        return 0;
+    if (md->rx_frag_hdr & MAILBOX_FRAG_ABORT)
+    {
+        mailbox_rx_drop_partial(ch, task);
+        return 0;
+    }
+    if (!(md->rx_frag_hdr & MAILBOX_FRAG_LAST))
+        return 0;
+    if (msg->filled != msg->len)
+    {
+        mailbox_rx_drop_partial(ch, task); // 帧头中的长度与收到的数据不符
+        return 0;
+    }
+
+    ch->rx_partial[task] = NULL;
+    return mailbox_rx_enqueue(ch, msg);
+}
+
+/* 解析分片帧头，为FIRST分片分配消息，序号不连续时丢弃该task上的消息，返回完成的消息数 */
+static int mailbox_rx_frag_start(struct mailbox_dev *md, uint64_t hdr)
+{
+    struct mailbox_chan *ch;
+    u8 task = MAILBOX_FRAG_TASK(hdr);
+    struct mailbox_rx_msg *msg;
+    size_t len;
+
+    md->rx_frag_hdr = hdr;
+    md->rx_frag_left = MAILBOX_FRAG_WORDS(hdr);
+    ch = mailbox_rx_frag_chan(md);
+    if (hdr & MAILBOX_FRAG_DESC)
+    {
+        // 描述符分片不参与按task重组，读到描述符寄存器后在mailbox_rx_frag_end中处理
+        md->rx_desc = 0;
+    }
+    else if (!ch)
+    {
+        md->stats.rx_drops++;
+    }
+    else if (hdr & MAILBOX_FRAG_PACKED)
+    {
+        // 合并分片自成一体，不影响各task上重组中的消息
+        md->rx_packed_len = min_t(size_t, MAILBOX_FRAG_INFO(hdr), md->rx_frag_left * sizeof(uint64_t));
+        md->rx_packed_filled = 0;
+    }
+    else if (hdr & MAILBOX_FRAG_FIRST)
+    {
+        mailbox_rx_drop_partial(ch, task); // 上一条消息的后续分片丢失
+        len = MAILBOX_FRAG_INFO(hdr);
+        msg = mailbox_rx_msg_alloc(ch, len);
+        if (msg)
+        {
+            msg->next_frag = 1;
+            ch->rx_partial[task] = msg;
+        }
+        else
+        {
+            md->stats.rx_drops++; // 该消息的其余分片找不到rx_partial，随之被跳过
+        }
+    }
+    else if (ch->rx_partial[task])
+    {
+        if (MAILBOX_FRAG_INFO(hdr) == ch->rx_partial[task]->next_frag)
+            ch->rx_partial[task]->next_frag++;
+        else
+            mailbox_rx_drop_partial(ch, task);
+    }
+
+    if (md->rx_frag_left == 0)
+        return mailbox_rx_frag_end(md);
+    return 0;
+}
+
+/* 把一段寄存器交给分片重组，分片可以跨越多次读取，返回完成的消息数 */
+static int mailbox_rx_reassemble(struct mailbox_dev *md, const uint64_t *words, int count)
+{
+    struct mailbox_chan *ch;
+    struct mailbox_rx_msg *msg;
+    int i = 0, n, completed = 0;
+    size_t bytes;
+
+    while (i < count)
+    {
+        if (md->rx_frag_left == 0)
+        {
+            completed += mailbox_rx_frag_start(md, words[i++]);
+            continue;
+        }
+        n = min_t(int, md->rx_frag_left, count - i);
+        ch = mailbox_rx_frag_chan(md);
+        msg = ch && !(md->rx_frag_hdr & (MAILBOX_FRAG_PACKED | MAILBOX_FRAG_DESC)) ? ch->rx_partial[MAILBOX_FRAG_TASK(md->rx_frag_hdr)] : NULL;
+        if (md->rx_frag_hdr & MAILBOX_FRAG_DESC)
+        {
+            md->rx_desc = words[i + n - 1];
+        }
+        else if (ch && (md->rx_frag_hdr & MAILBOX_FRAG_PACKED))
+        {
+            memcpy((u8 *)md->rx_packed + md->rx_packed_filled, words + i, n * sizeof(uint64_t));
+            md->rx_packed_filled += n * sizeof(uint64_t);
+        }
+        else if (msg)
+        {
+            // 最后一个寄存器中的补0部分不拷贝
+            bytes = min_t(size_t, n * sizeof(uint64_t), msg->len - msg->filled);
+            memcpy(msg->data + msg->filled, words + i, bytes);
+            msg->filled += bytes;
+        }
+        i += n;
+        md->rx_frag_left -= n;
+        if (md->rx_frag_left == 0)
+            completed += mailbox_rx_frag_end(md);
+    }
+    return completed;
+}
+
+/* 读出接收区中head到tail之间的全部寄存器交给分片重组，返回读出的寄存器数 */
+static int mailbox_rx_drain(struct mailbox_dev *md)
+{
+    uint64_t receive_info_reg = readq(md->ring.base + md->ring.peer_ir);
+    int rx_tail_from_receiver = mailbox_ring_rx_tail(receive_info_reg);
+    int head = md->ir_shadow & MAILBOX_IR_HEAD_MASK;
+
+    uint64_t *msgs = md->rx_buf;
+    int msg_ptr;
+    int completed;
+
+    msg_ptr = mailbox_ring_read(&md->ring, head, rx_tail_from_receiver, msgs);
+    if (msg_ptr < 0)
+    {
+        printk_ratelimited(KERN_WARNING "sw_mailbox: %s: bad ring pointers head %d tail %d\n", md->name, head, rx_tail_from_receiver);
+        return 0;
+    }
+    if (msg_ptr == 0)
+        return 0;
+
+    // 先归还接收区再重组，重组中的内存分配不占用对方的发送时间
+    mailbox_update_ir(md, MAILBOX_IR_HEAD_MASK, rx_tail_from_receiver); // 将head设置为原来的tail,即读出了所有内容
+    if (receive_info_reg & MAILBOX_IR_TX_WAIT)
+        mailbox_ring_doorbell(md, MAILBOX_CSR_HEAD_NOTIFY); // 对方在等待空间
+
+    completed = mailbox_rx_reassemble(md, msgs, msg_ptr);
+    if (md->rx_bank_acks)
+    {
+        // head已经推进，发送方收到应答时能看到腾出的bank
+        mailbox_ring_doorbell(md, md->rx_bank_acks);
+        md->rx_bank_acks = 0;
+    }
+    md->stats.rx_regs += msg_ptr;
+    md->stats.rx_bytes += msg_ptr * sizeof(uint64_t);
+    mailbox_hist_add(md->stats.rx_chunk_hist, msg_ptr);
+    trace_mailbox_rx_drain(head, rx_tail_from_receiver, msg_ptr, completed);
+
+    return msg_ptr;
+}
+
+/* 对方接收区的空闲寄存器数，按缓存的head够写need个时不读寄存器，tail为自己维护的写入位置，调用者持有tx_lock */
+static int mailbox_tx_free_regs(struct mailbox_dev *md, int *tail, int need)
+{
+    return mailbox_ring_tx_free(&md->ring, md->ir_shadow, &md->tx_peer_head, tail, need, &md->stats.tx_head_reads);
+}
+
+/* 所有通道的发送队列中的寄存器总数 */
+unsigned int mailbox_tx_queued(struct mailbox_dev *md)
+{
+    unsigned int c, p, n = 0;
+
+    for (c = 0; c < nr_channels; ++c)
+        for (p = 0; p < MAILBOX_PRIO_NUM; ++p)
+            n += mailbox_txq_used(&md->chans[c].txq[p]);
+    return n;
+}
+
+/* 有积压时把与上一次写入的间隔折算到每个寄存器，计入本次写入所用模式的EWMA，blocks为其中的块模式分片数，调用者持有tx_lock */
+static void mailbox_tx_account(struct mailbox_dev *md, unsigned int n, unsigned int blocks)
+{
+    ktime_t now = ktime_get();
+    u64 *ewma = blocks ? &md->tx_block_ns_per_reg : &md->tx_fifo_ns_per_reg;
+    u64 sample;
+
+    md->stats.tx_blocks += blocks;
+    if (md->tx_backlogged)
+    {
+        sample = div_u64(ktime_to_ns(ktime_sub(now, md->tx_last_push_ts)), n);
+        *ewma = *ewma ? *ewma - (*ewma >> 3) + (sample >> 3) : sample;
+    }
+    md->tx_last_push_ts = now;
+    md->tx_backlogged = mailbox_tx_queued(md) != 0;
+}
+
+/* 从tail开始写入n个寄存器（n不超过空闲寄存器数，含blocks个块模式分片），更新tail并置bits中的门铃位，调用者持有tx_lock */
+static void mailbox_tx_push(struct mailbox_dev *md, int tail, const uint64_t *words, int n, uint64_t bits, unsigned int blocks)
+{
+    trace_mailbox_tx_chunk(tail, n, mailbox_tx_queued(md));
+    tail = mailbox_ring_write(&md->ring, tail, words, n);
+    md->stats.tx_regs += n;
+    md->stats.tx_bytes += n * sizeof(uint64_t);
+    mailbox_hist_add(md->stats.tx_chunk_hist, n);
+
+    mailbox_update_ir(md, MAILBOX_IR_TAIL_MASK, (uint64_t)tail << MAILBOX_IR_TAIL_SHIFT); // 将新tail更新到接收方InfoReg中
+    mailbox_ring_doorbell(md, bits);                                                       // 触发中断
+    mailbox_tx_account(md, n, blocks);
+}
+
+/* 条目提交时刻的戳，约以微秒计，只用于统计排队时间 */
+static inline u32 mailbox_tx_stamp(void)
+{
+    return (ktime_get_ns() >> 10) & MAILBOX_TXQ_STAMP_MASK;
+}
+
+/* 开始取一个新条目，按条目头中的戳统计它在该优先级队列中的排队时间，调用者持有tx_lock */
+static void mailbox_tx_entry_start(struct mailbox_dev *md, struct mailbox_txq *q, unsigned int prio)
+{
+    md->stats.tx_entries[prio]++;
+    if (q->entry_stamp)
+        mailbox_hist_add(md->stats.tx_queue_latency_hist[prio],
+                         (u64)((mailbox_tx_stamp() - q->entry_stamp) & MAILBOX_TXQ_STAMP_MASK) << 10);
+}
+
+/*
+ * 选出下一个分片：高优先级队列中有已提交的分片时总是先发它，大消息在分片之间被抢占；
+ * 同一优先级内从上一个通道之后轮转，每个通道每轮发一个分片以平分对方接收区，调用者持有tx_lock
+ */
+static bool mailbox_tx_next_frag(struct mailbox_dev *md)
+{
+    struct mailbox_txq *q;
+    unsigned int i, c, p;
+    bool fresh;
+    uint64_t hdr;
+
+    for (p = MAILBOX_PRIO_NUM; p-- > 0;)
+    {
+        for (i = 1; i <= nr_channels; ++i)
+        {
+            c = (md->tx_cur_chan + i) % nr_channels;
+            q = &md->chans[c].txq[p];
+            fresh = q->entry_left == 0;
+            if (mailbox_txq_peek(q, &hdr))
+            {
+                if (fresh)
+                    mailbox_tx_entry_start(md, q, p);
+                md->tx_cur_chan = c;
+                md->tx_cur_prio = p;
+                md->tx_frag_left = 1 + MAILBOX_FRAG_WORDS(hdr);
+                md->tx_block_pending = hdr & MAILBOX_FRAG_BLOCK;
+                md->tx_block_kick = md->tx_block_pending && mailbox_block_doorbell(&md->ring, hdr);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * 按分片从各通道的发送队列取出至多room个寄存器，分片可以跨越两次写入但不会与其它分片交错，调用者持有tx_lock。
+ * 块模式分片只在剩余空间放得下整个分片时取出，*blocks累计取出的块模式分片数。流水线中前一个bank未应答时
+ * 接着取后面放得下的bank，一次写入；发送方要等对方读完的分片（mailbox_block_doorbell）在bits中置MAILBOX_CSR_BLOCK并结束本次取出。
+ * *chans中置取出了分片的通道，门铃本身不区分通道。
+ */
+static unsigned int mailbox_tx_gather(struct mailbox_dev *md, uint64_t *chunk, unsigned int room, uint64_t *bits, unsigned int *blocks,
+                                      unsigned long *chans)
+{
+    unsigned int n = 0, k;
+
+    while (n < room)
+    {
+        if (md->tx_frag_left == 0 && !mailbox_tx_next_frag(md))
+            break;
+        if (md->tx_block_pending)
+        {
+            if (room - n < md->tx_frag_left)
+                break;
+            md->tx_block_pending = false;
+            (*blocks)++;
+            if (md->tx_block_kick)
+                *bits |= MAILBOX_CSR_BLOCK;
+        }
+        k = mailbox_txq_out(&md->chans[md->tx_cur_chan].txq[md->tx_cur_prio], chunk + n, min(room - n, md->tx_frag_left));
+        if (k == 0)
+            break;
+        n += k;
+        md->tx_frag_left -= k;
+        *bits |= MAILBOX_CSR_DOORBELL;
+        __set_bit(md->tx_cur_chan, chans);
+        if (*bits & MAILBOX_CSR_BLOCK)
+            break;
+    }
+    return n;
+}
+
+/* 把各通道已提交的分片搬进对方接收区，遇到还未提交的条目即停，调用者持有tx_lock */
+static void mailbox_tx_drain(struct mailbox_dev *md)
+{
+    uint64_t *chunk = md->tx_chunk;
+    unsigned long woken = 0;
+    int tail, free_regs, n;
+    uint64_t bits;
+    unsigned int c, blocks;
+    u64 spins = 0;
+    ktime_t spin_start = 0;
+
+    while (mailbox_tx_queued(md))
+    {
+        // 流式分片可以跨越两次写入，缓存的head显示已满时才重读；等待中的块模式分片要整片放得下
+        free_regs = mailbox_tx_free_regs(md, &tail, md->tx_block_pending ? md->tx_frag_left : 1);
+        bits = 0;
+        blocks = 0;
+        n = free_regs ? mailbox_tx_gather(md, chunk, free_regs, &bits, &blocks, &woken) : 0;
+        if (n)
+        {
+            if (md->tx_waiting)
+            {
+                mailbox_update_ir(md, MAILBOX_IR_TX_WAIT, 0);
+                md->tx_waiting = false;
+            }
+            mailbox_tx_push(md, tail, chunk, n, bits, blocks);
+            spins = 0;
+            continue;
+        }
+        if (free_regs && !md->tx_block_pending)
+            break;
+
+        // 对方接收区满，或块模式分片在等待对方读完一个bank
+        if (spins == 0)
+            spin_start = ktime_get();
+        if (spins++ < tx_spin_loops)
+        {
+            cpu_relax();
+            continue;
+        }
+        if (!md->tx_waiting)
+        {
+            // 先挂起等待标志再检查一次head，防止对方在两者之间推进head而漏掉通知
+            mailbox_update_ir(md, MAILBOX_IR_TX_WAIT, MAILBOX_IR_TX_WAIT);
+            md->tx_waiting = true;
+            continue;
+        }
+        // 对方不支持head通知时由hrtimer兜底，间隔指数退避
+        if (md->tx_poll_us == 0)
+            md->tx_poll_us = tx_poll_min_us;
+        hrtimer_start(&md->tx_timer, us_to_ktime(md->tx_poll_us), HRTIMER_MODE_REL);
+        md->tx_poll_us = min(md->tx_poll_us * 2, tx_poll_max_us);
+        break;
+    }
+    if (spins)
+    {
+        md->stats.tx_full_spins += spins;
+        trace_mailbox_ring_full_spin(spins, ktime_to_ns(ktime_sub(ktime_get(), spin_start)));
+    }
+    if (woken)
+    {
+        md->tx_poll_us = 0;
+        // 只唤醒发送队列腾出了空间的通道
+        for_each_set_bit(c, &woken, nr_channels)
+            wake_up_interruptible(&md->chans[c].tx_waitq);
+    }
+}
+
+/*
+ * 搬运发送队列，可在进程、中断与hrtimer上下文中调用。同一时刻只有一个搬运者：
+ * 抢不到tx_lock时留下请求后立即返回，持有者释放锁后看到请求会再搬运一轮，提交者不会在锁上排队。
+ */
+void mailbox_tx_pump(struct mailbox_dev *md)
+{
+    unsigned long flags;
+
+    if (mailbox_bypassed(md))
+        return; // 提交环中的条目留到旁路结束
+    atomic_set(&md->tx_pump_req, 1);
+    smp_mb(); // 先留下请求再抢锁，与持有者释放锁后的检查配对
+    while (spin_trylock_irqsave(&md->tx_lock, flags))
+    {
+        atomic_set(&md->tx_pump_req, 0);
+        smp_mb__after_atomic();
+        if (!mailbox_bypassed(md)) // 旁路在tx_lock下开始，锁外的检查之后可能已经开始
+            mailbox_tx_drain(md);
+        spin_unlock_irqrestore(&md->tx_lock, flags);
+        smp_mb();
+        if (!atomic_read(&md->tx_pump_req))
+            break;
+    }
+}
+
+/*
+ * 把通道ch的若干完整分片作为一个条目提交到prio优先级的队列，全部接受时返回count，提交环放不下时返回0。
+ * 不加锁，可在任何上下文中调用；提交后顺带搬运，同一队列的顺序即预留的顺序。
+ */
+unsigned int mailbox_tx_submit(struct mailbox_chan *ch, unsigned int prio, const uint64_t *words, unsigned int count)
+{
+    struct mailbox_txq *q = &ch->txq[prio];
+    unsigned long pos;
+
+    if (!mailbox_txq_reserve(q, count, &pos))
+        return 0;
+    mailbox_txq_put(q, pos + 1, words, count);
+    mailbox_txq_commit_stamp(q, pos, count, false, mailbox_tx_stamp());
+    mailbox_tx_pump(ch->md);
+    return count;
+}
+
+static enum hrtimer_restart mailbox_tx_timer_fn(struct hrtimer *timer)
+{
+    struct mailbox_dev *md = container_of(timer, struct mailbox_dev, tx_timer);
+
+    md->stats.tx_timer_polls++;
+    mailbox_tx_pump(md);
+    return HRTIMER_NORESTART;
+}
+
+/* 发送一侧的门铃：对方推进了head或应答了bank */
+#define MAILBOX_CSR_TX_BITS (MAILBOX_CSR_HEAD_NOTIFY | MAILBOX_CSR_BANK_ACK_MASK)
+
+/* 对方推进了head或应答了bank，统计后继续搬运发送队列 */
+static void mailbox_tx_wake(struct mailbox_dev *md, uint64_t pending)
+{
+    if (pending & MAILBOX_CSR_HEAD_NOTIFY)
+        md->stats.tx_head_notifies++;
+    md->stats.tx_bank_acks += hweight64(pending & MAILBOX_CSR_BANK_ACK_MASK);
+    mailbox_tx_pump(md);
+    if (!kfifo_is_empty(&md->desc_done))
+        mailbox_desc_done_flush(md);
+}
+
+/* 硬中断：确认门铃并屏蔽中断，把门铃位记下后交给轮询线程，读取与发送队列的搬运都不在这里做 */
+static irqreturn_t mailbox_interrupt(int irq, void *dev_id)
+{
+    struct mailbox_dev *md = dev_id;
+    uint64_t receiver_mailbox_csr = readq(md->ring.base + md->ring.own_csr);
+    uint64_t pending = receiver_mailbox_csr & MAILBOX_CSR_VALID_MASK;
+
+    if (!pending)
+        return IRQ_NONE;
+
+    if (mailbox_bypassed(md))
+    {
+        // 收发都在用户态：清门铃、保持中断使能，把中断转给应用
+        mailbox_write_csr(md, (receiver_mailbox_csr & A2CMAILBOX_INT_ENA) | pending);
+        if (md->bypass_efd)
+            eventfd_signal(md->bypass_efd, 1);
+        md->stats.bypass_irqs++;
+        return IRQ_HANDLED;
+    }
+
+    mailbox_write_csr(md, pending); // 清门铃，关中断
+    if (pending & ~MAILBOX_CSR_TX_BITS)
+        md->rx_doorbell_ts = ktime_get();
+    atomic64_or(pending, &md->irq_pending);
+    trace_mailbox_csr_doorbell(false, receiver_mailbox_csr);
+    return IRQ_WAKE_THREAD;
+}
+
+/*
+ * 轮询线程：先处理硬中断记下的门铃，head通知与bank应答在这里继续搬运发送队列，只有这两种门铃且接收区为空时搬完立即开中断。
+ * 之后只要对方还在推进tail就一直读，空闲超过rx_idle_us后再开中断。
+ * 门铃带MAILBOX_CSR_BLOCK时发送方要等应答才写下一个分片，读空后立即开中断，不再空转等待；
+ * 流水线中间的bank不带该位，按流式接着轮询下一个bank。轮询期间到达的门铃留在CSR中，空闲时读CSR检查该位。
+ * 有通道越过高水位或映射的接收环已满时不再读接收区，开中断后退出，由读者在低水位时、或应用推进cons后在poll()中重新唤醒。
+ */
+static irqreturn_t mailbox_rx_thread(int irq, void *dev_id)
+{
+    struct mailbox_dev *md = dev_id;
+    uint64_t pending = atomic64_xchg(&md->irq_pending, 0);
+    ktime_t idle_since = ktime_get();
+    bool block = pending & MAILBOX_CSR_BLOCK;
+    unsigned int drained, c;
+    bool first = true;
+    int n;
+
+    if (pending & MAILBOX_CSR_TX_BITS)
+        mailbox_tx_wake(md, pending);
+    if (pending & ~MAILBOX_CSR_TX_BITS)
+    {
+        md->stats.doorbells_rx++;
+        if (block)
+            md->stats.rx_blocks++;
+        // 停止期间的数据留在接收区中，恢复时再读出
+        if (READ_ONCE(md->interrupt_halting))
+            md->stats.rx_halted_doorbells++;
+    }
+    else if (pending && !READ_ONCE(md->interrupt_halting) && !mailbox_rx_pending(md))
+    {
+        // 开中断会清掉期间到达的head通知，之后再搬一次发送队列，接收区仍为空时不进入轮询
+        mailbox_write_csr(md, A2CMAILBOX_INT_ENA | MAILBOX_CSR_VALID_MASK);
+        if (mailbox_tx_queued(md))
+            mailbox_tx_pump(md);
+        if (!mailbox_rx_pending(md))
+            return IRQ_HANDLED;
+        mailbox_write_csr(md, MAILBOX_CSR_VALID_MASK);
+    }
+
+    md->stats.rx_polls++;
+    // 先把接收环映射期间积压的消息搬进环，环仍放不下时通道保持停止
+    for (c = 0; c < nr_channels; ++c)
+        if (atomic_read(&md->chans[c].rx_ring_maps) && !list_empty(&md->chans[c].rx_msgs))
+            mailbox_rx_ring_flush(&md->chans[c]);
+    for (;;)
+    {
+        drained = 0;
+        while (drained < rx_poll_budget && !READ_ONCE(md->interrupt_halting) && !mailbox_bypassed(md))
+        {
+            n = mailbox_rx_drain(md);
+            if (n == 0)
+                break;
+            drained += n;
+        }
+        md->stats.rx_poll_passes++;
+        if (!kfifo_is_empty(&md->desc_done))
+            mailbox_desc_done_flush(md);
+        if (mailbox_tx_queued(md))
+            mailbox_tx_pump(md); // 轮询期间head通知被屏蔽，顺带搬运发送队列
+        // 每批只唤醒完成了消息的通道，其余通道的读者不会被打扰
+        for_each_set_bit(c, &md->rx_wake_chans, nr_channels)
+            wake_up_interruptible(&md->chans[c].rx_waitq);
+        md->rx_wake_chans = 0;
+
+        if (READ_ONCE(md->interrupt_halting) || mailbox_bypassed(md))
+        {
+            mailbox_write_csr(md, A2CMAILBOX_INT_ENA | MAILBOX_CSR_VALID_MASK);
+            break;
+        }
+        if (drained)
+        {
+            if (first)
+            {
+                mailbox_hist_add(md->stats.rx_doorbell_latency_hist, ktime_to_ns(ktime_sub(ktime_get(), md->rx_doorbell_ts)));
+                first = false;
+            }
+            idle_since = ktime_get();
+        }
+        else if (block || (readq(md->ring.base + md->ring.own_csr) & MAILBOX_CSR_BLOCK) ||
+                 ktime_us_delta(ktime_get(), idle_since) >= rx_idle_us)
+        {
+            block = false;
+            // 开中断并顺带清掉轮询期间积累的门铃，之后必须再检查一次，防止错过开中断前到达的数据
+            mailbox_write_csr(md, A2CMAILBOX_INT_ENA | MAILBOX_CSR_VALID_MASK);
+            if (mailbox_tx_queued(md))
+                mailbox_tx_pump(md);
+            if (!mailbox_rx_pending(md))
+                break;
+            mailbox_write_csr(md, MAILBOX_CSR_VALID_MASK);
+            idle_since = ktime_get();
+        }
+        else
+        {
+            cpu_relax();
+        }
+        cond_resched();
+    }
+    md->stats.rx_rearms++;
+
+    return IRQ_HANDLED;
+}
+
+static ssize_t rx_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mailbox_dev *md = dev_get_drvdata(dev);
+
+    return sprintf(buf, "irqs %llu polls %llu passes %llu rearms %llu drops %llu high_hits %llu resumes %llu\n",
+                   md->stats.doorbells_rx, md->stats.rx_polls, md->stats.rx_poll_passes, md->stats.rx_rearms,
+                   md->stats.rx_drops, md->stats.rx_high_hits, md->stats.rx_resumes);
+}
+static DEVICE_ATTR_RO(rx_stats);
+
+/* 把中断连同接收线程固定到cpu上，cpu为-1时撤销，已生效的亲和性保持到被改动为止 */
+static int mailbox_set_irq_cpu(struct mailbox_dev *md, int cpu)
+{
+    int ret;
+
+    if (cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+        return -EINVAL;
+    ret = irq_set_affinity_hint(md->irq, cpu >= 0 ? cpumask_of(cpu) : NULL);
+    if (ret == 0)
+        md->irq_cpu = cpu < 0 ? -1 : cpu;
+    return ret;
+}
+
+static ssize_t irq_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mailbox_dev *md = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", md->irq_cpu);
+}
+
+static ssize_t irq_cpu_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct mailbox_dev *md = dev_get_drvdata(dev);
+    int cpu, ret;
+
+    ret = kstrtoint(buf, 0, &cpu);
+    if (ret == 0)
+        ret = mailbox_set_irq_cpu(md, cpu);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(irq_cpu);
+
+static int mailbox_open(struct inode *inode, struct file *file)
+{
+    struct mailbox_dev *md;
+    struct mailbox_file *mf;
+    unsigned int p;
+    int task;
+
+    if (inode == NULL || file == NULL)
+        return -1;
+    md = mailbox_inode_dev(inode);
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if (!mf)
+        return -ENOMEM;
+    // 每个打开的文件每个优先级用独立的task id发送，不同进程、不同优先级的消息分片可以交错；
+    // 两个仍在发送的文件共用一个task id会让接收方把它们的分片拼进同一条消息，task id用完时拒绝打开
+    for (p = 0; p < MAILBOX_PRIO_NUM; ++p)
+    {
+        task = ida_alloc_range(&md->task_ida, 1, MAILBOX_TASK_NUM - 1, GFP_KERNEL);
+        if (task < 0)
+        {
+            while (p--)
+                ida_free(&md->task_ida, mf->task[p]);
+            kfree(mf);
+            return task == -ENOSPC ? -EBUSY : task;
+        }
+        mf->task[p] = task;
+        init_rwsem(&mf->msg_sem[p]);
+    }
+    printk("sw_mailbox: %s opened!\n", md->name);
+    // writeq(0x7fffffffffffffff, membase + A2CMAILBOX_CSR);
+    // kfifo_reset(&mailbox_fifo);
+    // 接收中断在probe中已经打开；这里写CSR会在轮询或旁路期间重新打开中断，并把挂起的门铃与应答位写1清掉
+    file->private_data = mf;
+    return nonseekable_open(inode, file);
+}
+
+static int mailbox_close(struct inode *inode, struct file *file)
+{
+    struct mailbox_dev *md = mailbox_inode_dev(inode);
+    struct mailbox_file *mf = file->private_data;
+    unsigned int p;
+
+    printk("sw_mailbox: mailbox closed!\n");
+    // 文件的最后一个引用，寄存器窗口的映射已经解除
+    if (READ_ONCE(md->bypass_file) == file)
+        mailbox_bypass_exit(md);
+    if (md->desc_slots)
+        mailbox_desc_release(md, file, -1);
+    for (p = 0; p < MAILBOX_PRIO_NUM; ++p)
+        ida_free(&md->task_ida, mf->task[p]);
+    kfree(mf);
+    // writeq(0x7fffffffffffffff, membase + A2CMAILBOX_CSR);
+    return 0;
+}
+
+/* 把count个寄存器的完整分片作为一个条目提交，提交环满时等待，只有致命信号能打断一条已开始发送的消息 */
+int mailbox_tx_submit_all(struct mailbox_chan *ch, unsigned int prio, const uint64_t *words, unsigned int count)
+{
+    int ret;
+
+    while (mailbox_tx_submit(ch, prio, words, count) == 0)
+    {
+        ret = wait_event_killable(ch->tx_waitq, mailbox_txq_avail(&ch->txq[prio]) > count);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * 按消息大小选择块模式。自适应时比较两种模式观测到的每寄存器耗时，还没有观测值的模式优先，
+ * 每32条消息试探一次另一种模式，使两边的观测值都跟得上对方负载的变化。
+ */
+static bool mailbox_tx_use_block(struct mailbox_dev *md, size_t size)
+{
+    bool block;
+
+    if (!block_threshold || size < block_threshold)
+        return false;
+    if (!block_adaptive)
+        return true;
+    block = READ_ONCE(md->tx_block_ns_per_reg) <= READ_ONCE(md->tx_fifo_ns_per_reg);
+    if (atomic_inc_return(&md->tx_block_probe) % 32 == 0)
+        block = !block;
+    return block;
+}
+
+/* 组帧状态，一条消息可以跨越多个提交环条目 */
+struct mailbox_framer
+{
+    size_t size;       /* 消息字节数 */
+    size_t staged;     /* 已组帧的字节数 */
+    unsigned int frag; /* 下一个分片的序号 */
+    unsigned int frag_words;
+    unsigned int banks;
+    uint64_t mode;
+    u8 task;
+    unsigned int prio; /* 提交到的队列 */
+};
+
+/* 从from拷入n字节到提交环中pos开始的寄存器，未提交的位置总是0，不满8字节的末尾自然补0 */
+static int mailbox_txq_copy_from_iter(struct mailbox_txq *q, unsigned long pos, size_t n, struct iov_iter *from)
+{
+    unsigned long off = pos & (q->size - 1);
+    size_t first = min_t(size_t, n, (q->size - off) * sizeof(uint64_t));
+
+    if (copy_from_iter(&q->words[off], first, from) != first)
+        return -EFAULT;
+    if (copy_from_iter(q->words, n - first, from) != n - first)
+        return -EFAULT;
+    return 0;
+}
+
+/* 在提交环中pos开始的words个寄存器里为消息接下来的字节组帧，words由mailbox_frame_words算出，正好容纳整数个分片 */
+static int mailbox_txq_frame(struct mailbox_chan *ch, struct mailbox_framer *fr, unsigned long pos, unsigned long words,
+                             struct iov_iter *from)
+{
+    unsigned long end = pos + words;
+    unsigned int w;
+    uint64_t flags;
+    size_t n;
+
+    while (pos < end)
+    {
+        n = min_t(size_t, fr->size - fr->staged, fr->frag_words * sizeof(uint64_t));
+        w = DIV_ROUND_UP(n, sizeof(uint64_t));
+        flags = fr->mode | (fr->frag == 0 ? MAILBOX_FRAG_FIRST : 0) | (fr->staged + n == fr->size ? MAILBOX_FRAG_LAST : 0);
+        if (fr->mode)
+            flags |= MAILBOX_FRAG_SET_BANK(fr->frag % fr->banks);
+        *mailbox_txq_word(&ch->txq[fr->prio], pos) = MAILBOX_FRAG_HEADER(ch->id, fr->task, w, flags, fr->frag == 0 ? fr->size : fr->frag);
+        if (mailbox_txq_copy_from_iter(&ch->txq[fr->prio], pos + 1, n, from))
+            return -EFAULT;
+        pos += 1 + w;
+        fr->staged += n;
+        fr->frag++;
+    }
+    return 0;
+}
+
+/* 在prio优先级的提交环中预留words个寄存器的条目，提交环满时等待，非阻塞时返回-EAGAIN */
+static int mailbox_txq_reserve_wait(struct mailbox_chan *ch, unsigned int prio, unsigned long words, bool nonblock,
+                                    unsigned long *pos)
+{
+    int ret;
+
+    while (!mailbox_txq_reserve(&ch->txq[prio], words, pos))
+    {
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_killable(ch->tx_waitq, mailbox_txq_avail(&ch->txq[prio]) > words);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* 为消息接下来的bytes字节预留一个条目、组帧并提交，组帧失败时提交为丢弃的条目 */
+static int mailbox_txq_send_entry(struct mailbox_chan *ch, struct mailbox_framer *fr, size_t bytes, bool nonblock,
+                                  struct iov_iter *from)
+{
+    unsigned long words = mailbox_frame_words(bytes, fr->frag_words);
+    unsigned long pos;
+    int ret;
+
+    ret = mailbox_txq_reserve_wait(ch, fr->prio, words, nonblock, &pos);
+    if (ret)
+        return ret;
+    ret = mailbox_txq_frame(ch, fr, pos + 1, words, from);
+    mailbox_txq_commit_stamp(&ch->txq[fr->prio], pos, words, ret != 0, mailbox_tx_stamp());
+    mailbox_tx_pump(ch->md);
+    return ret;
+}
+
+/*
+ * 把from中的全部字节作为一条消息发送，返回消息字节数。
+ * 消息被切成若干分片，每个分片以帧头开始，只有整条消息的最后一个寄存器补0。
+ * 分片直接组帧到本通道提交环中预留的条目里，多个写者之间不加锁，一个条目中的分片在对方接收区中连续出现。
+ * 放得进一个条目的消息整体预留，非阻塞时提交环放不下返回-EAGAIN；
+ * 更大的消息拆成多个条目，期间独占本文件在该优先级的task，内存占用与消息长度无关，
+ * 非阻塞时task被占用或中途提交环放不下返回-EAGAIN，已发出的分片由ABORT作废。
+ * 高优先级的消息不合并，也不等本通道合并中的消息先发出。
+ */
+static ssize_t mailbox_send_iter(struct mailbox_chan *ch, struct iov_iter *from, bool nonblock, struct mailbox_file *mf,
+                                 unsigned int prio)
+{
+    struct mailbox_dev *md = ch->md;
+    size_t size = iov_iter_count(from);
+    struct mailbox_framer fr = {.size = size, .task = mf->task[prio], .prio = prio};
+    unsigned int banks = clamp_t(unsigned int, block_banks, 1, MAILBOX_MAX_BANKS);
+    bool submitted = false;
+    size_t per_entry;
+    uint64_t abort_hdr;
+    ssize_t ret;
+
+    if (READ_ONCE(md->tx_peer_stopped)) // 如果接收方停止了接收，则不发送
+        return 0;
+    if (size > U32_MAX)
+        return -EMSGSIZE;
+    if (prio == MAILBOX_PRIO_NORMAL && size <= min(coalesce_bytes, mailbox_pack_capacity(&md->ring) - 2))
+    {
+        // 合并发送经过通道共享的中转页与合并分片，写者之间仍然互斥
+        if (mutex_lock_interruptible(&ch->write_lock))
+            return -ERESTARTSYS;
+        ret = mailbox_co_send(ch, from, size, nonblock);
+        mutex_unlock(&ch->write_lock);
+        return ret;
+    }
+    // 本线程之前合并的消息先于本条消息发出
+    if (prio == MAILBOX_PRIO_NORMAL && READ_ONCE(ch->co_msgs) && (ret = mailbox_co_flush(ch, nonblock)))
+        return ret;
+    if (md->desc_slots && desc_threshold && size >= desc_threshold && size <= md->desc_slot_size)
+    {
+        ret = mailbox_desc_send_iter(ch, from, size, fr.task, prio);
+        if (ret != -ENOBUFS)
+            return ret;
+    }
+    fr.mode = mailbox_tx_use_block(md, size) ? MAILBOX_FRAG_BLOCK : 0;
+    fr.banks = banks;
+    // 块模式的分片正好占一个bank
+    fr.frag_words = fr.mode ? mailbox_block_frag_words(&md->ring, banks) : mailbox_frag_max_words(&md->ring);
+
+    if (mailbox_frame_words(size, fr.frag_words) <= TX_ENTRY_MAX_WORDS)
+    {
+        // 同一文件的多个写者共享msg_sem，只与拆成多个条目的消息互斥
+        down_read(&mf->msg_sem[prio]);
+        ret = mailbox_txq_send_entry(ch, &fr, size, nonblock, from);
+        up_read(&mf->msg_sem[prio]);
+        return ret ? ret : size;
+    }
+
+    per_entry = TX_ENTRY_MAX_WORDS / (1 + fr.frag_words) * fr.frag_words * sizeof(uint64_t);
+    if (nonblock)
+    {
+        if (!down_write_trylock(&mf->msg_sem[prio]))
+            return -EAGAIN;
+    }
+    else if (down_write_killable(&mf->msg_sem[prio]))
+        return -EINTR;
+    do
+    {
+        ret = mailbox_txq_send_entry(ch, &fr, min(size - fr.staged, per_entry), nonblock, from);
+        if (ret)
+            break;
+        submitted = true;
+    } while (fr.staged < size);
+    // 已发出一部分分片时通知接收方丢弃，对方一直不腾出空间（非阻塞时为当前没有空间）时放弃，
+    // 下一条消息的FIRST分片同样会让接收方丢弃
+    if (ret && submitted)
+    {
+        abort_hdr = MAILBOX_FRAG_HEADER(ch->id, fr.task, 0, MAILBOX_FRAG_LAST | MAILBOX_FRAG_ABORT, fr.frag);
+        if (nonblock ? mailbox_txq_avail(&ch->txq[prio]) > 1
+                     : wait_event_timeout(ch->tx_waitq, mailbox_txq_avail(&ch->txq[prio]) > 1, HZ))
+            mailbox_tx_submit(ch, prio, &abort_hdr, 1);
+    }
+    up_write(&mf->msg_sem[prio]);
+    return ret ? ret : size;
+}
+
+/* 通道的接收队列已低于低水位，所有停下的通道都恢复后唤醒接收线程读出积压在接收区中的数据 */
+void mailbox_rx_resume(struct mailbox_chan *ch)
+{
+    struct mailbox_dev *md = ch->md;
+
+    if (!test_and_clear_bit(ch->id, &md->interrupt_halting) || READ_ONCE(md->interrupt_halting))
+        return;
+    md->stats.rx_resumes++;
+    irq_wake_thread(md->irq, md);
+}
+
+/* 从通道的接收队列取出一条完整的消息到to，返回消息字节数，to放不下时不取出并返回-EMSGSIZE，调用者持有ch->read_lock */
+static ssize_t mailbox_recv_iter(struct mailbox_chan *ch, struct iov_iter *to)
+{
+    struct mailbox_rx_msg *msg;
+    ssize_t ret;
+
+    // 只有持有read_lock的读者会取出消息，解锁后队首的消息不会被释放
+    spin_lock(&ch->rx_msgs_lock);
+    msg = list_first_entry_or_null(&ch->rx_msgs, struct mailbox_rx_msg, node);
+    if (msg && msg->len <= iov_iter_count(to))
+    {
+        list_del(&msg->node);
+        ch->rx_queued_bytes -= msg->len;
+    }
+    spin_unlock(&ch->rx_msgs_lock);
+
+    if (!msg)
+        return 0;
+    if (msg->len > iov_iter_count(to))
+        return -EMSGSIZE;
+
+    ret = copy_to_iter(msg->data, msg->len, to) == msg->len ? msg->len : -EFAULT;
+    kvfree(msg);
+
+    if (test_bit(ch->id, &ch->md->interrupt_halting) && READ_ONCE(ch->rx_queued_bytes) <= rx_low_watermark)
+        mailbox_rx_resume(ch);
+    return ret;
+}
+
+/* 通道接收队列中下一条消息的字节数 */
+size_t mailbox_rx_next_len(struct mailbox_chan *ch)
+{
+    struct mailbox_rx_msg *msg;
+    size_t len;
+
+    spin_lock(&ch->rx_msgs_lock);
+    msg = list_first_entry_or_null(&ch->rx_msgs, struct mailbox_rx_msg, node);
+    len = msg ? msg->len : 0;
+    spin_unlock(&ch->rx_msgs_lock);
+    return len;
+}
+
+/* 清空通道的接收队列与重组状态，只在接收线程不会运行时清理重组状态 */
+static void mailbox_rx_purge(struct mailbox_chan *ch, bool partial)
+{
+    struct mailbox_rx_msg *msg, *tmp;
+    LIST_HEAD(purge);
+    int i;
+
+    spin_lock(&ch->rx_msgs_lock);
+    list_splice_init(&ch->rx_msgs, &purge);
+    ch->rx_queued_bytes = 0;
+    spin_unlock(&ch->rx_msgs_lock);
+    list_for_each_entry_safe(msg, tmp, &purge, node)
+        kvfree(msg);
+    // 卸载时中断已经释放，不再唤醒接收线程
+    if (!partial && test_bit(ch->id, &ch->md->interrupt_halting))
+        mailbox_rx_resume(ch);
+
+    if (!partial)
+        return;
+    for (i = 0; i < MAILBOX_TASK_NUM; ++i)
+    {
+        mailbox_rx_msg_free(ch, ch->rx_partial[i]);
+        ch->rx_partial[i] = NULL;
+    }
+    ch->md->rx_frag_left = 0;
+}
+
+static inline bool mailbox_nonblock(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static ssize_t mailbox_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(iocb->ki_filp);
+
+    if (mailbox_bypassed(ch->md))
+        return -EBUSY;
+    return mailbox_send_iter(ch, from, mailbox_nonblock(iocb), mailbox_file(iocb->ki_filp), READ_ONCE(mailbox_file(iocb->ki_filp)->prio));
+}
+
+/* 接收环映射期间消息只进环，接收队列中的是等着搬进环的积压，read()与RECVV不能取走 */
+static inline bool mailbox_rx_mapped(struct mailbox_chan *ch)
+{
+    return atomic_read(&ch->rx_ring_maps) != 0;
+}
+
+static ssize_t mailbox_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(iocb->ki_filp);
+    ssize_t ret;
+
+    if (mailbox_rx_mapped(ch))
+        return -EBUSY;
+    if (list_empty(&ch->rx_msgs))
+    {
+        if (mailbox_nonblock(iocb))
+            return -EAGAIN;
+        if (wait_event_interruptible(ch->rx_waitq, !list_empty(&ch->rx_msgs) || mailbox_rx_mapped(ch)))
+            return -ERESTARTSYS;
+    }
+
+    // 每次read返回一条完整的消息，多个读进程之间需要互斥；接收环的映射也在read_lock下建立
+    if (mutex_lock_interruptible(&ch->read_lock))
+        return -ERESTARTSYS;
+    ret = mailbox_rx_mapped(ch) ? -EBUSY : mailbox_recv_iter(ch, to);
+    mutex_unlock(&ch->read_lock);
+    return ret;
+}
+
+/* 一次系统调用发送多条消息，返回完整发出的消息数，带MAILBOX_MSG_HIGH的消息走高优先级 */
+static long mailbox_ioctl_sendv(struct file *file, struct mailbox_msgv __user *argp)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    struct mailbox_msg __user *umsgs;
+    struct mailbox_msgv msgv;
+    struct mailbox_msg msg;
+    struct iov_iter iter;
+    struct iovec iov;
+    unsigned int prio;
+    ssize_t ret = 0;
+
+    if (copy_from_user(&msgv, argp, sizeof(msgv)))
+        return -EFAULT;
+    umsgs = u64_to_user_ptr(msgv.msgs);
+
+    for (msgv.done = 0; msgv.done < msgv.count; ++msgv.done)
+    {
+        if (copy_from_user(&msg, &umsgs[msgv.done], sizeof(msg)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        iov.iov_base = u64_to_user_ptr(msg.buf);
+        iov.iov_len = msg.len;
+        iov_iter_init(&iter, WRITE, &iov, 1, msg.len);
+        prio = (msg.flags & MAILBOX_MSG_HIGH) ? MAILBOX_PRIO_HIGH : READ_ONCE(mailbox_file(file)->prio);
+        ret = mailbox_send_iter(ch, &iter, file->f_flags & O_NONBLOCK, mailbox_file(file), prio);
+        if (ret < (ssize_t)msg.len)
+            break;
+    }
+
+    if (msgv.done == 0 && msgv.count != 0)
+        return ret < 0 ? ret : -EAGAIN;
+    if (put_user(msgv.done, &argp->done))
+        return -EFAULT;
+    return msgv.done;
+}
+
+/* 一次系统调用把接收队列中的消息依次填入多个缓冲区，每个缓冲区一条消息，返回填充的缓冲区数 */
+static long mailbox_ioctl_recvv(struct file *file, struct mailbox_msgv __user *argp)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    struct mailbox_msg __user *umsgs;
+    struct mailbox_msgv msgv;
+    struct mailbox_msg msg;
+    struct iov_iter iter;
+    struct iovec iov;
+    ssize_t ret = 0;
+
+    if (copy_from_user(&msgv, argp, sizeof(msgv)))
+        return -EFAULT;
+    umsgs = u64_to_user_ptr(msgv.msgs);
+
+    if (mailbox_rx_mapped(ch))
+        return -EBUSY;
+    if (msgv.count && list_empty(&ch->rx_msgs))
+    {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(ch->rx_waitq, !list_empty(&ch->rx_msgs) || mailbox_rx_mapped(ch)))
+            return -ERESTARTSYS;
+    }
+
+    if (mutex_lock_interruptible(&ch->read_lock))
+        return -ERESTARTSYS;
+    if (mailbox_rx_mapped(ch))
+    {
+        mutex_unlock(&ch->read_lock);
+        return -EBUSY;
+    }
+    for (msgv.done = 0; msgv.done < msgv.count; ++msgv.done)
+    {
+        if (copy_from_user(&msg, &umsgs[msgv.done], sizeof(msg)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        iov.iov_base = u64_to_user_ptr(msg.buf);
+        iov.iov_len = msg.len;
+        iov_iter_init(&iter, READ, &iov, 1, msg.len);
+        ret = mailbox_recv_iter(ch, &iter);
+        if (ret < 0 || (ret == 0 && list_empty(&ch->rx_msgs)))
+            break;
+        if (put_user((__u32)ret, &umsgs[msgv.done].len))
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&ch->read_lock);
+
+    if (msgv.done == 0 && ret < 0)
+        return ret;
+    if (put_user(msgv.done, &argp->done))
+        return -EFAULT;
+    return msgv.done;
+}
+
+static long mailbox_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    struct mailbox_dev *md = ch->md;
+    void __user *argp = (void __user *)arg;
+    struct mailbox_status status;
+    unsigned int c;
+    u32 prio;
+
+    if (mailbox_bypassed(md) && (cmd == MAILBOX_IOC_SENDV || cmd == MAILBOX_IOC_FLUSH || cmd == MAILBOX_IOC_DESC_SEND))
+        return -EBUSY;
+    switch (cmd)
+    {
+    case MAILBOX_IOC_START:
+        writeq(0xffffffffffffffff, md->ring.base + md->ring.peer_csr);
+        WRITE_ONCE(md->tx_peer_stopped, false);
+        return 0;
+    case MAILBOX_IOC_STOP:
+        // 停止作用于整个寄存器环，清空所有通道的接收队列
+        writeq(MAILBOX_CSR_STOPPED, md->ring.base + md->ring.peer_csr);
+        WRITE_ONCE(md->tx_peer_stopped, true);
+        for (c = 0; c < nr_channels; ++c)
+        {
+            mutex_lock(&md->chans[c].read_lock);
+            mailbox_rx_purge(&md->chans[c], false);
+            mutex_unlock(&md->chans[c].read_lock);
+        }
+        return 0;
+    case MAILBOX_IOC_STATUS:
+        memset(&status, 0, sizeof(status));
+        status.own_csr = readq(md->ring.base + md->ring.own_csr);
+        status.peer_csr = readq(md->ring.base + md->ring.peer_csr);
+        status.rx_queued = READ_ONCE(ch->rx_queued_bytes);
+        status.next_msg_len = mailbox_rx_next_len(ch);
+        status.tx_queued = mailbox_txq_used(&ch->txq[mailbox_file(file)->prio]) * sizeof(uint64_t);
+        status.tx_free = mailbox_txq_avail(&ch->txq[mailbox_file(file)->prio]) * sizeof(uint64_t);
+        return copy_to_user(argp, &status, sizeof(status)) ? -EFAULT : 0;
+    case MAILBOX_IOC_SENDV:
+        return mailbox_ioctl_sendv(file, argp);
+    case MAILBOX_IOC_RECVV:
+        return mailbox_ioctl_recvv(file, argp);
+    case MAILBOX_IOC_FLUSH:
+        return mailbox_co_flush(ch, file->f_flags & O_NONBLOCK);
+    case MAILBOX_IOC_DESC_INFO:
+    case MAILBOX_IOC_DESC_ALLOC:
+    case MAILBOX_IOC_DESC_SEND:
+    case MAILBOX_IOC_DESC_FREE:
+        return mailbox_ioctl_desc(file, cmd, argp);
+    case MAILBOX_IOC_BYPASS:
+        return mailbox_ioctl_bypass(file, argp);
+    case MAILBOX_IOC_SET_PRIO:
+        if (get_user(prio, (__u32 __user *)argp))
+            return -EFAULT;
+        if (prio >= MAILBOX_PRIO_NUM)
+            return -EINVAL;
+        WRITE_ONCE(mailbox_file(file)->prio, prio);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static unsigned int mailbox_poll(struct file *file, struct poll_table_struct *wait)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    unsigned int mask = 0;
+    bool readable;
+    poll_wait(file, &ch->rx_waitq, wait);
+    poll_wait(file, &ch->tx_waitq, wait);
+
+    if (mailbox_rx_mapped(ch))
+    {
+        readable = mailbox_rx_ring_ready(ch);
+        // 环满停止读接收区后，应用推进cons、再次poll时恢复
+        if (test_bit(ch->id, &ch->md->interrupt_halting) && mailbox_rx_ring_room(ch))
+            mailbox_rx_resume(ch);
+    }
+    else
+    {
+        readable = !list_empty(&ch->rx_msgs);
+    }
+    if (readable)
+    {
+        mask = POLLIN | POLLRDNORM;
+    }
+    if (mailbox_tx_frag_room(ch, READ_ONCE(mailbox_file(file)->prio)))
+    {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+
+    // sbi_printf("poll waked\n");
+
+    return mask;
+}
+
+/*
+ * 偏移0为本实例的发送缓冲池，缓冲区buf位于映射的buf * slot_size处；
+ * 偏移MAILBOX_MMAP_RX_RING为本通道的接收环，MAILBOX_MMAP_REGS为旁路的寄存器窗口
+ */
+static int mailbox_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct mailbox_dev *md = mailbox_file_chan(file)->md;
+
+    if (vma->vm_pgoff == MAILBOX_MMAP_RX_RING >> PAGE_SHIFT)
+        return mailbox_rx_ring_mmap(mailbox_file_chan(file), vma);
+    if (vma->vm_pgoff == MAILBOX_MMAP_REGS >> PAGE_SHIFT)
+        return mailbox_bypass_mmap(file, md, vma);
+    return mailbox_desc_mmap(md, vma);
+}
+
+static const struct file_operations mailbox_fops = {
+    .owner = THIS_MODULE,
+    .open = mailbox_open,
+    .read_iter = mailbox_read_iter,
+    .write_iter = mailbox_write_iter,
+    .unlocked_ioctl = mailbox_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = mailbox_poll,
+    .mmap = mailbox_mmap,
+    .release = mailbox_close,
+    .llseek = no_llseek};
+
+static int mailbox_setup_cdev(struct cdev *cdev, dev_t devno)
+{
+    int ret = 0;
+
+    cdev_init(cdev, &mailbox_fops);
+    cdev->owner = THIS_MODULE;
+    ret = cdev_add(cdev, devno, nr_channels);
+
+    return ret;
+}
+
+/* 释放各通道的队列与中转页，必须在中断释放之后调用 */
+static void mailbox_chans_free(struct mailbox_dev *md)
+{
+    unsigned int c, p;
+
+    for (c = 0; c < nr_channels; ++c)
+    {
+        mailbox_rx_purge(&md->chans[c], true);
+        vfree(md->chans[c].rx_ring);
+        for (p = 0; p < MAILBOX_PRIO_NUM; ++p)
+            kfree(md->chans[c].txq[p].words);
+        free_page((unsigned long)md->chans[c].tx_bounce);
+        kfree(md->chans[c].co_frag);
+    }
+    kfree(md->chans);
+    md->chans = NULL;
+}
+
+/* 分配各通道的队列与中转页，必须在probe注册中断之前完成，否则中断处理函数会访问未分配的队列 */
+static int mailbox_chans_alloc(struct mailbox_dev *md)
+{
+    struct mailbox_chan *ch;
+    unsigned int c, p;
+
+    md->chans = kcalloc(nr_channels, sizeof(*md->chans), GFP_KERNEL);
+    if (!md->chans)
+        return -ENOMEM;
+    for (c = 0; c < nr_channels; ++c)
+    {
+        ch = &md->chans[c];
+        ch->md = md;
+        ch->id = c;
+        INIT_LIST_HEAD(&ch->rx_msgs);
+        spin_lock_init(&ch->rx_msgs_lock);
+        init_waitqueue_head(&ch->rx_waitq);
+        mutex_init(&ch->read_lock);
+        init_waitqueue_head(&ch->tx_waitq);
+        mutex_init(&ch->write_lock);
+        spin_lock_init(&ch->co_lock);
+        hrtimer_init(&ch->co_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        ch->co_timer.function = mailbox_co_timer_fn;
+        ch->co_frag = kmalloc_array(1 + mailbox_frag_max_words(&md->ring), sizeof(uint64_t), GFP_KERNEL);
+        ch->tx_bounce = (uint64_t *)__get_free_page(GFP_KERNEL);
+        // 提交环中未提交的位置必须为0
+        for (p = 0; p < MAILBOX_PRIO_NUM; ++p)
+        {
+            ch->txq[p].words = kcalloc(TX_FIFO_SIZE, sizeof(uint64_t), GFP_KERNEL);
+            ch->txq[p].size = TX_FIFO_SIZE;
+        }
+        if (!ch->co_frag || !ch->tx_bounce || !ch->txq[MAILBOX_PRIO_NORMAL].words || !ch->txq[MAILBOX_PRIO_HIGH].words)
+        {
+            printk(KERN_ERR "sw_mailbox: %s: error allocating channel %u\n", md->name, c);
+            mailbox_chans_free(md); // kcalloc清零过，未分配的提交环、合并分片与中转页可以安全释放
+            return -ENOMEM;
+        }
+    }
+    printk("sw_mailbox: %s: %u channels, TX buffer size %d per channel and priority\n", md->name, nr_channels, TX_FIFO_SIZE);
+    return 0;
+}
+
+/*
+ * 从设备树读取寄存器布局，没有给出的属性取现有硬件的值：
+ *   asp,reg-num     每个接收区的消息寄存器数，默认62
+ *   asp,c2a-offset  Linux发往ASP的接收区在窗口中的字节偏移，默认0
+ *   asp,a2c-offset  ASP发往Linux的接收区的字节偏移，默认紧接在C2A接收区的IR与CSR之后
+ *   asp,direction   "c2a"（默认）时本端向C2A接收区发送，"a2c"时两个接收区的角色互换
+ *   asp,irq-cpu     中断与接收线程所在的CPU
+ * 模拟的对端没有设备树节点，由platform_data给出寄存器数，两个接收区按默认方式排列。
+ */
+static int mailbox_parse_layout(struct mailbox_dev *md, resource_size_t size)
+{
+    struct device_node *np = md->pdev->dev.of_node;
+    u32 reg_num = C2AMAILBOX_REG_NUM, c2a, a2c, cpu, area;
+    const char *dir = "c2a";
+
+    if (md->pdata && md->pdata->reg_num)
+        reg_num = md->pdata->reg_num;
+    of_property_read_u32(np, "asp,reg-num", &reg_num);
+    // 块模式下每个bank至少要放得下帧头与一个payload寄存器
+    if (reg_num < 2 * MAILBOX_MAX_BANKS + 1 || reg_num > MAILBOX_MAX_REG_NUM)
+    {
+        printk(KERN_ERR "sw_mailbox: %s: asp,reg-num %u out of range\n", md->name, reg_num);
+        return -EINVAL;
+    }
+    area = mailbox_ring_area_size(reg_num);
+    c2a = C2AMAILBOX_BASE;
+    a2c = c2a + area;
+    of_property_read_u32(np, "asp,c2a-offset", &c2a);
+    of_property_read_u32(np, "asp,a2c-offset", &a2c);
+    of_property_read_string(np, "asp,direction", &dir);
+    md->irq_cpu = -1;
+    if (!of_property_read_u32(np, "asp,irq-cpu", &cpu))
+        md->irq_cpu = cpu;
+    if (md->id < MAILBOX_MAX_DEVICES && irq_cpus[md->id] >= 0)
+        md->irq_cpu = irq_cpus[md->id];
+
+    if ((c2a | a2c) % sizeof(uint64_t) || c2a + area > size || a2c + area > size || (c2a < a2c + area && a2c < c2a + area))
+    {
+        printk(KERN_ERR "sw_mailbox: %s: areas at %#x and %#x do not fit a %#llx window\n",
+               md->name, c2a, a2c, (unsigned long long)size);
+        return -EINVAL;
+    }
+    if (strcmp(dir, "c2a") == 0)
+        mailbox_ring_setup(&md->ring, md->ring.base, c2a, reg_num, a2c, reg_num);
+    else if (strcmp(dir, "a2c") == 0)
+        mailbox_ring_setup(&md->ring, md->ring.base, a2c, reg_num, c2a, reg_num);
+    else
+        return -EINVAL;
+    md->tx_a2c = strcmp(dir, "a2c") == 0;
+    printk("sw_mailbox: %s: %u registers per area, tx at %#x, rx at %#x\n", md->name, reg_num, md->ring.tx_base, md->ring.rx_base);
+    return 0;
+}
+
+/* 实例号优先取设备树中的mailbox别名，设备节点与debugfs目录的名字由它决定 */
+static int mailbox_alloc_id(struct platform_device *pdev)
+{
+    int id = pdev->dev.of_node ? of_alias_get_id(pdev->dev.of_node, "mailbox") : -ENODEV;
+
+    if (id >= 0 && id < MAILBOX_MAX_DEVICES)
+        return ida_alloc_range(&mailbox_ida, id, id, GFP_KERNEL);
+    return ida_alloc_max(&mailbox_ida, MAILBOX_MAX_DEVICES - 1, GFP_KERNEL);
+}
+
+static void mailbox_destroy_devices(struct mailbox_dev *md, unsigned int n)
+{
+    if (n)
+    {
+        device_remove_file(md->chans[0].device, &dev_attr_irq_cpu);
+        device_remove_file(md->chans[0].device, &dev_attr_rx_stats);
+    }
+    while (n--)
+        device_destroy(mailbox_class, md->devno + n);
+}
+
+/* 每个通道一个节点：实例0为/dev/sw_mailbox/chN，其余实例为/dev/sw_mailboxI/chN */
+static int mailbox_create_devices(struct mailbox_dev *md)
+{
+    struct device *dev;
+    unsigned int c;
+
+    for (c = 0; c < nr_channels; ++c)
+    {
+        dev = device_create(mailbox_class, &md->pdev->dev, md->devno + c, md, "%s!ch%u", md->name, c);
+        if (IS_ERR(dev))
+        {
+            printk(KERN_WARNING "sw_mailbox: mailbox device create failed, error code %ld \n", PTR_ERR(dev));
+            while (c--)
+                device_destroy(mailbox_class, md->devno + c);
+            return PTR_ERR(dev);
+        }
+        md->chans[c].device = dev;
+    }
+    if (device_create_file(md->chans[0].device, &dev_attr_rx_stats))
+        printk(KERN_WARNING "sw_mailbox: rx_stats attribute create failed\n");
+    if (device_create_file(md->chans[0].device, &dev_attr_irq_cpu))
+        printk(KERN_WARNING "sw_mailbox: irq_cpu attribute create failed\n");
+    printk("sw_mailbox: succeed to create /dev/%s/ch0..%u \n", md->name, nr_channels - 1);
+    return 0;
+}
+
+/* probe platform driver：每个mailbox实例一次，所有状态都在这里分配 */
+static int mailbox_probe(struct platform_device *pdev)
+{
+    struct mailbox_dev *md;
+    struct resource *res;
+    resource_size_t size;
+    int ret;
+
+    printk("sw_mailbox: mailbox probe\n");
+    md = kzalloc(sizeof(*md), GFP_KERNEL);
+    if (!md)
+        return -ENOMEM;
+    ret = mailbox_alloc_id(pdev);
+    if (ret < 0)
+        goto id_fail;
+    md->id = ret;
+    if (md->id)
+        snprintf(md->name, sizeof(md->name), DEVICE_NAME "%u", md->id);
+    else
+        strscpy(md->name, DEVICE_NAME, sizeof(md->name));
+    md->pdev = pdev;
+    md->devno = MKDEV(mailbox_major, md->id * MAILBOX_MAX_CHANNELS);
+    spin_lock_init(&md->ir_lock);
+    spin_lock_init(&md->tx_lock);
+    spin_lock_init(&md->desc_lock);
+    init_waitqueue_head(&md->desc_waitq);
+    ida_init(&md->task_ida);
+    atomic_set(&md->tx_block_probe, 0);
+
+    // 先映射寄存器并初始化发送状态，中断处理函数一注册就可能被调用
+    md->pdata = dev_get_platdata(&pdev->dev);
+    if (md->pdata && md->pdata->regs)
+    {
+        md->ring.base = md->pdata->regs;
+        size = 2 * mailbox_ring_area_size(md->pdata->reg_num ? md->pdata->reg_num : C2AMAILBOX_REG_NUM);
+        printk("sw_mailbox: %s: using emulated register window at %p\n", md->name, md->ring.base);
+    }
+    else
+    {
+        res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+        if (!res)
+        {
+            ret = -ENODEV;
+            goto map_fail;
+        }
+        size = resource_size(res);
+        md->regs_phys = res->start;
+        md->regs_size = size;
+        printk("sw_mailbox: %s: mailbox start: %#llx, size: %#llx", md->name, (unsigned long long)res->start, (unsigned long long)size);
+        md->ring.base = ioremap(res->start, size);
+        if (!md->ring.base)
+        {
+            ret = -ENOMEM;
+            goto map_fail;
+        }
+    }
+    ret = mailbox_parse_layout(md, size);
+    if (ret)
+        goto layout_fail;
+    md->ir_shadow = readq(md->ring.base + md->ring.own_ir) & ~MAILBOX_IR_TX_WAIT;
+    md->tx_peer_head = mailbox_ring_tx_head_init(&md->ring, md->ir_shadow);
+    md->tx_peer_stopped = readq(md->ring.base + md->ring.peer_csr) == MAILBOX_CSR_STOPPED;
+    hrtimer_init(&md->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    md->tx_timer.function = mailbox_tx_timer_fn;
+    ret = mailbox_desc_init(md);
+    if (ret)
+        goto layout_fail;
+
+    ret = mailbox_chans_alloc(md);
+    if (ret)
+        goto chans_fail;
+
+    /* Obtain interrupt ID from DTS, or from the IRQ resource of the emulated device */
+    md->irq = platform_get_irq(pdev, 0);
+    ret = md->irq < 0 ? md->irq : request_threaded_irq(md->irq, mailbox_interrupt, mailbox_rx_thread, IRQF_TRIGGER_FALLING, md->name, md);
+    if (ret != 0)
+    {
+        printk("sw_mailbox: %s: register interrupt failed", md->name);
+        ret = -EBUSY;
+        goto irq_fail;
+    }
+    if (md->irq_cpu >= 0 && mailbox_set_irq_cpu(md, md->irq_cpu))
+    {
+        printk(KERN_WARNING "sw_mailbox: %s: cannot move irq %d to cpu %d\n", md->name, md->irq, md->irq_cpu);
+        md->irq_cpu = -1;
+    }
+    printk("sw_mailbox: %s: open and register interrupt", md->name);
+
+    // setup cdev
+    ret = mailbox_setup_cdev(&md->cdev, md->devno);
+    if (ret)
+    {
+        printk("sw_mailbox: mailbox setup cdev failed, ret = %d\n", ret);
+        goto cdev_fail;
+    }
+    ret = mailbox_create_devices(md);
+    if (ret)
+        goto device_fail;
+    mailbox_debugfs_init(md);
+    platform_set_drvdata(pdev, md);
+
+    // 中断注册之后再使能linux接受区的中断，模块与模拟对端的加载顺序因此无关
+    mailbox_write_csr(md, 0xffffffffffffffff);
+    return 0;
+
+device_fail:
+    cdev_del(&md->cdev);
+cdev_fail:
+    irq_set_affinity_hint(md->irq, NULL);
+    free_irq(md->irq, md);
+irq_fail:
+    mailbox_chans_free(md);
+chans_fail:
+    mailbox_desc_exit(md);
+layout_fail:
+    /* Unmap Iomem，模拟的寄存器窗口由提供者释放 */
+    if (!md->pdata || !md->pdata->regs)
+        iounmap(md->ring.base);
+map_fail:
+    ida_destroy(&md->task_ida);
+    ida_free(&mailbox_ida, md->id);
+id_fail:
+    kfree(md);
+    return ret;
+}
+
+// /* remove platform driver */
+static int mailbox_remove(struct platform_device *pdev)
+{
+    struct mailbox_dev *md = platform_get_drvdata(pdev);
+    unsigned int c;
+
+    debugfs_remove_recursive(md->debugfs);
+    mailbox_destroy_devices(md, nr_channels);
+    cdev_del(&md->cdev);
+    /* Release Interrupt */
+    irq_set_affinity_hint(md->irq, NULL);
+    free_irq(md->irq, md);
+    if (md->bypass_efd)
+        eventfd_ctx_put(md->bypass_efd); // 旁路的文件还开着时设备被移除
+    for (c = 0; c < nr_channels; ++c)
+        hrtimer_cancel(&md->chans[c].co_timer);
+    hrtimer_cancel(&md->tx_timer);
+    mailbox_chans_free(md); // 中断释放之后才能释放各通道的队列
+    mailbox_desc_exit(md);
+    /* Unmap Iomem，模拟的寄存器窗口由提供者释放 */
+    if (!md->pdata || !md->pdata->regs)
+        iounmap(md->ring.base);
+    ida_free(&mailbox_ida, md->id);
+    ida_destroy(&md->task_ida);
+    kfree(md);
+    return 0;
+}
+
+static const struct of_device_id mailbox_of_match[] = {
+    {
+        .compatible = "asp,asp_mailbox",
+    },
+    {},
+};
+MODULE_DEVICE_TABLE(of, mailbox_of_match);
+
+/* platform driver information */
+static struct platform_driver mailbox_driver = {
+    .probe = mailbox_probe,
+    .remove = mailbox_remove,
+    .driver = {
+        .name = DEVICE_NAME,
+        .of_match_table = mailbox_of_match,
+    },
+};
+
+static int __init mailbox_init(void)
+{
+    int ret;
+    dev_t devno;
+
+    printk("sw_mailbox: mailbox 20230712 driver init...\n");
+
+    nr_channels = clamp_t(unsigned int, nr_channels, 1, MAILBOX_MAX_CHANNELS);
+
+    // get devno，每个实例占用MAILBOX_MAX_CHANNELS个次设备号
+    if (mailbox_major)
+    {
+        devno = MKDEV(mailbox_major, 0);
+        ret = register_chrdev_region(devno, MAILBOX_MAX_DEVICES * MAILBOX_MAX_CHANNELS, DEVICE_NAME);
+    }
+    else
+    {
+        ret = alloc_chrdev_region(&devno, 0, MAILBOX_MAX_DEVICES * MAILBOX_MAX_CHANNELS, DEVICE_NAME);
+        mailbox_major = MAJOR(devno);
+    }
+    printk("sw_mailbox: mailbox - major: %d\n", mailbox_major);
+
+    if (ret < 0)
+    {
+        printk("sw_mailbox: get mailbox major failed\n");
+        return ret;
+    }
+
+    // create class
+    mailbox_class = class_create(THIS_MODULE, DEVICE_NAME);
+    ret = IS_ERR(mailbox_class);
+    if (ret)
+    {
+        printk(KERN_WARNING "sw_mailbox: class create failed\n");
+        ret = PTR_ERR(mailbox_class);
+        goto class_create_fail;
+    }
+
+    // 在 platform_driver_register(&mailbox_driver); 这个函数中会对每个mailbox实例调用mailbox_probe函数，
+    // 映射寄存器、创建设备节点并使能linux接受区的中断
+    ret = platform_driver_register(&mailbox_driver);
+    if (ret)
+        goto driver_register_fail;
+
+    return 0;
+driver_register_fail:
+    class_destroy(mailbox_class);
+class_create_fail:
+    unregister_chrdev_region(devno, MAILBOX_MAX_DEVICES * MAILBOX_MAX_CHANNELS);
+    return ret;
+}
+
+static void __exit mailbox_exit(void)
+{
+    printk("sw_mailbox: mailbox driver exit...\n");
+
+    platform_driver_unregister(&mailbox_driver);
+    class_destroy(mailbox_class);
+    unregister_chrdev_region(MKDEV(mailbox_major, 0), MAILBOX_MAX_DEVICES * MAILBOX_MAX_CHANNELS);
+    ida_destroy(&mailbox_ida);
+}
+
+// module_platform_driver(mailbox_driver);
+module_init(mailbox_init);
+module_exit(mailbox_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("LPN BYK YCC XZY");
+MODULE_DESCRIPTION("ASP mailbox");
@@ -0,0 +1,69 @@
+/* /sys/kernel/debug/<实例名>/下的数据通路统计 */
+#include "sw_mailbox_priv.h"
+
+static int mailbox_hist_show(struct seq_file *m, void *v)
+{
+    u64 *hist = m->private;
+    int i;
+
+    for (i = 0; i < MAILBOX_HIST_BUCKETS; ++i)
+    {
+        if (hist[i] == 0)
+            continue;
+        if (i == 0)
+            seq_printf(m, "%20u %llu\n", 0, hist[i]);
+        else
+            seq_printf(m, "%20llu %llu\n", 1ull << (i - 1), hist[i]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mailbox_hist);
+
+/* /sys/kernel/debug/<实例名>/下的计数器与直方图，直方图每行为桶下界与计数 */
+void mailbox_debugfs_init(struct mailbox_dev *md)
+{
+    md->debugfs = debugfs_create_dir(md->name, NULL);
+    debugfs_create_u64("tx_bytes", 0444, md->debugfs, &md->stats.tx_bytes);
+    debugfs_create_u64("tx_regs", 0444, md->debugfs, &md->stats.tx_regs);
+    debugfs_create_u64("rx_bytes", 0444, md->debugfs, &md->stats.rx_bytes);
+    debugfs_create_u64("rx_regs", 0444, md->debugfs, &md->stats.rx_regs);
+    debugfs_create_u64("doorbells_tx", 0444, md->debugfs, &md->stats.doorbells_tx);
+    debugfs_create_u64("doorbells_rx", 0444, md->debugfs, &md->stats.doorbells_rx);
+    debugfs_create_u64("tx_full_spins", 0444, md->debugfs, &md->stats.tx_full_spins);
+    debugfs_create_u64("tx_head_reads", 0444, md->debugfs, &md->stats.tx_head_reads);
+    debugfs_create_u64("tx_packed_msgs", 0444, md->debugfs, &md->stats.tx_packed_msgs);
+    debugfs_create_u64("tx_packed_frags", 0444, md->debugfs, &md->stats.tx_packed_frags);
+    debugfs_create_u64("rx_packed_frags", 0444, md->debugfs, &md->stats.rx_packed_frags);
+    debugfs_create_u64("rx_msgs", 0444, md->debugfs, &md->stats.rx_msgs);
+    debugfs_create_u64("rx_drops", 0444, md->debugfs, &md->stats.rx_drops);
+    debugfs_create_u64("rx_high_hits", 0444, md->debugfs, &md->stats.rx_high_hits);
+    debugfs_create_u64("rx_ring_full", 0444, md->debugfs, &md->stats.rx_ring_full);
+    debugfs_create_u64("rx_resumes", 0444, md->debugfs, &md->stats.rx_resumes);
+    debugfs_create_u64("rx_halted_doorbells", 0444, md->debugfs, &md->stats.rx_halted_doorbells);
+    debugfs_create_u64("rx_polls", 0444, md->debugfs, &md->stats.rx_polls);
+    debugfs_create_u64("rx_poll_passes", 0444, md->debugfs, &md->stats.rx_poll_passes);
+    debugfs_create_u64("rx_rearms", 0444, md->debugfs, &md->stats.rx_rearms);
+    debugfs_create_u64("tx_head_notifies", 0444, md->debugfs, &md->stats.tx_head_notifies);
+    debugfs_create_u64("tx_timer_polls", 0444, md->debugfs, &md->stats.tx_timer_polls);
+    debugfs_create_u64("tx_blocks", 0444, md->debugfs, &md->stats.tx_blocks);
+    debugfs_create_u64("tx_bank_acks", 0444, md->debugfs, &md->stats.tx_bank_acks);
+    debugfs_create_u64("rx_blocks", 0444, md->debugfs, &md->stats.rx_blocks);
+    debugfs_create_u64("tx_descs", 0444, md->debugfs, &md->stats.tx_descs);
+    debugfs_create_u64("tx_desc_done", 0444, md->debugfs, &md->stats.tx_desc_done);
+    debugfs_create_u64("rx_descs", 0444, md->debugfs, &md->stats.rx_descs);
+    debugfs_create_u64("rx_desc_bad", 0444, md->debugfs, &md->stats.rx_desc_bad);
+    debugfs_create_u64("bypass_entries", 0444, md->debugfs, &md->stats.bypass_entries);
+    debugfs_create_u64("bypass_irqs", 0444, md->debugfs, &md->stats.bypass_irqs);
+    debugfs_create_u32("desc_free", 0444, md->debugfs, &md->desc_free);
+    debugfs_create_u64("tx_block_ns_per_reg", 0444, md->debugfs, &md->tx_block_ns_per_reg);
+    debugfs_create_u64("tx_fifo_ns_per_reg", 0444, md->debugfs, &md->tx_fifo_ns_per_reg);
+    debugfs_create_file("tx_chunk_hist", 0444, md->debugfs, md->stats.tx_chunk_hist, &mailbox_hist_fops);
+    debugfs_create_file("rx_chunk_hist", 0444, md->debugfs, md->stats.rx_chunk_hist, &mailbox_hist_fops);
+    debugfs_create_file("rx_doorbell_latency_hist", 0444, md->debugfs, md->stats.rx_doorbell_latency_hist, &mailbox_hist_fops);
+    debugfs_create_u64("tx_entries_normal", 0444, md->debugfs, &md->stats.tx_entries[MAILBOX_PRIO_NORMAL]);
+    debugfs_create_u64("tx_entries_high", 0444, md->debugfs, &md->stats.tx_entries[MAILBOX_PRIO_HIGH]);
+    debugfs_create_file("tx_queue_latency_hist_normal", 0444, md->debugfs, md->stats.tx_queue_latency_hist[MAILBOX_PRIO_NORMAL],
+                        &mailbox_hist_fops);
+    debugfs_create_file("tx_queue_latency_hist_high", 0444, md->debugfs, md->stats.tx_queue_latency_hist[MAILBOX_PRIO_HIGH],
+                        &mailbox_hist_fops);
+}
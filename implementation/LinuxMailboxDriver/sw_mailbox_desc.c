@@ -0,0 +1,362 @@
+/* 描述符模式：共享内存中的C2A与A2C缓冲池，寄存器环中只传描述符，缓冲区由交还分片归还 */
+#include "sw_mailbox_priv.h"
+
+/* 发送池中缓冲区buf的地址 */
+static inline void *mailbox_desc_tx_buf(struct mailbox_dev *md, unsigned int buf)
+{
+    return md->desc_shm + md->desc_tx_off + (size_t)buf * md->desc_slot_size;
+}
+
+/* 从发送池分配一个缓冲区，没有空闲时返回-ENOBUFS；owner为分配它的文件，驱动自己使用时为NULL */
+static int mailbox_desc_alloc(struct mailbox_dev *md, struct file *owner)
+{
+    unsigned long flags;
+    unsigned int buf;
+
+    spin_lock_irqsave(&md->desc_lock, flags);
+    buf = find_first_zero_bit(md->desc_busy, md->desc_slots);
+    if (buf < md->desc_slots)
+    {
+        __set_bit(buf, md->desc_busy);
+        md->desc_owner[buf] = owner;
+        md->desc_free--;
+    }
+    spin_unlock_irqrestore(&md->desc_lock, flags);
+    return buf < md->desc_slots ? buf : -ENOBUFS;
+}
+
+/* 缓冲区回到空闲状态，调用者持有desc_lock，解锁后唤醒等待分配的进程 */
+static void mailbox_desc_put(struct mailbox_dev *md, unsigned int buf)
+{
+    __clear_bit(buf, md->desc_busy);
+    md->desc_owner[buf] = NULL;
+    md->desc_free++;
+}
+
+/* 释放owner分配的缓冲区buf，buf为-1时释放owner分配而未发出的全部缓冲区，返回释放的个数 */
+int mailbox_desc_release(struct mailbox_dev *md, struct file *owner, int buf)
+{
+    unsigned long flags;
+    unsigned int b;
+    int n = 0;
+
+    spin_lock_irqsave(&md->desc_lock, flags);
+    for_each_set_bit(b, md->desc_busy, md->desc_slots)
+    {
+        if ((buf < 0 || b == buf) && md->desc_owner[b] == owner)
+        {
+            mailbox_desc_put(md, b);
+            n++;
+        }
+    }
+    spin_unlock_irqrestore(&md->desc_lock, flags);
+    if (n)
+        wake_up_interruptible(&md->desc_waitq);
+    return n;
+}
+
+/* 对方交还了发送池中的缓冲区，序号不符的是过期或伪造的交还 */
+static void mailbox_desc_complete(struct mailbox_dev *md, uint64_t desc)
+{
+    unsigned int buf = MAILBOX_DESC_BUF(desc);
+    unsigned long flags;
+    bool ok;
+
+    spin_lock_irqsave(&md->desc_lock, flags);
+    ok = buf < md->desc_slots && test_bit(buf, md->desc_busy) && !md->desc_owner[buf] &&
+         md->desc_seq[buf] == MAILBOX_DESC_SEQ(desc);
+    if (ok)
+        mailbox_desc_put(md, buf);
+    spin_unlock_irqrestore(&md->desc_lock, flags);
+    if (ok)
+    {
+        md->stats.tx_desc_done++;
+        wake_up_interruptible(&md->desc_waitq);
+    }
+    else
+    {
+        md->stats.rx_desc_bad++;
+    }
+}
+
+/*
+ * 描述符分片：把接收池中的消息拷进通道的接收队列，之后立即交还缓冲区，交还分片由接收线程在本轮读取后统一提交。
+ * 交还分片释放发送池中的缓冲区。返回完成的消息数。
+ */
+int mailbox_rx_desc(struct mailbox_dev *md, struct mailbox_chan *ch)
+{
+    uint64_t desc = md->rx_desc;
+    size_t len = MAILBOX_FRAG_INFO(md->rx_frag_hdr);
+    unsigned int buf = MAILBOX_DESC_BUF(desc), off = MAILBOX_DESC_OFF(desc);
+    struct mailbox_rx_msg *msg;
+    int completed = 0;
+
+    if (MAILBOX_FRAG_WORDS(md->rx_frag_hdr) != 1)
+    {
+        md->stats.rx_desc_bad++;
+        return 0;
+    }
+    if (md->rx_frag_hdr & MAILBOX_FRAG_DONE)
+    {
+        mailbox_desc_complete(md, desc);
+        return 0;
+    }
+    // 越界的描述符无法交还，对方的缓冲区随之泄漏
+    if (buf >= md->desc_slots || off > md->desc_slot_size || len > md->desc_slot_size - off)
+    {
+        md->stats.rx_desc_bad++;
+        return 0;
+    }
+    md->stats.rx_descs++;
+    msg = ch ? mailbox_rx_msg_alloc(ch, len) : NULL;
+    if (msg)
+    {
+        rmb(); // 先看到描述符，再读缓冲区
+        memcpy(msg->data, md->desc_shm + md->desc_rx_off + (size_t)buf * md->desc_slot_size + off, len);
+        msg->filled = len;
+        completed = mailbox_rx_enqueue(ch, msg);
+    }
+    else
+    {
+        md->stats.rx_drops++;
+    }
+    // 对方在途的描述符不超过它的缓冲区数，desc_done按缓冲区数分配，不会放不下
+    if (!kfifo_put(&md->desc_done, desc))
+        md->stats.rx_desc_bad++;
+    return completed;
+}
+
+/* 把待交还的描述符提交到通道0的高优先级队列，不排在大消息后面，发送队列满时留到下一轮，可在中断上下文中调用 */
+void mailbox_desc_done_flush(struct mailbox_dev *md)
+{
+    uint64_t frame[2], desc;
+    unsigned long flags;
+
+    spin_lock_irqsave(&md->desc_lock, flags);
+    while (kfifo_peek(&md->desc_done, &desc))
+    {
+        mailbox_desc_frame(frame, 0, 0, MAILBOX_FRAG_DONE, 0, desc);
+        if (mailbox_tx_submit(&md->chans[0], MAILBOX_PRIO_HIGH, frame, 2) == 0)
+            break;
+        kfifo_skip(&md->desc_done);
+    }
+    spin_unlock_irqrestore(&md->desc_lock, flags);
+}
+
+/*
+ * 以task与prio优先级发出发送池中缓冲区buf里[off, off + len)的消息，之后缓冲区归对方所有，直到对方交还。
+ * owner为分配缓冲区的文件（驱动自己分配时为NULL），缓冲区不属于owner时返回-EINVAL。
+ */
+static int mailbox_desc_submit(struct mailbox_chan *ch, struct file *owner, unsigned int buf, u32 off, u32 len, u8 task,
+                               unsigned int prio)
+{
+    struct mailbox_dev *md = ch->md;
+    uint64_t frame[2];
+    unsigned long flags;
+    bool owned;
+    u16 seq;
+    int ret;
+
+    if (buf >= md->desc_slots || off > md->desc_slot_size || len > md->desc_slot_size - off)
+        return -EINVAL;
+    spin_lock_irqsave(&md->desc_lock, flags);
+    owned = test_bit(buf, md->desc_busy) && md->desc_owner[buf] == owner;
+    if (owned)
+    {
+        md->desc_owner[buf] = NULL; // 在途的缓冲区不再属于任何文件，关闭文件时不会被释放
+        seq = ++md->desc_seq[buf];
+    }
+    spin_unlock_irqrestore(&md->desc_lock, flags);
+    if (!owned)
+        return -EINVAL;
+
+    wmb(); // 缓冲区的内容先于描述符可见
+    mailbox_desc_frame(frame, ch->id, task, 0, len, MAILBOX_DESC(buf, seq, off));
+    ret = mailbox_tx_submit_all(ch, prio, frame, 2);
+    if (ret)
+    {
+        // 分片是整体提交的，没有提交时缓冲区还在本端
+        spin_lock_irqsave(&md->desc_lock, flags);
+        mailbox_desc_put(md, buf);
+        spin_unlock_irqrestore(&md->desc_lock, flags);
+        wake_up_interruptible(&md->desc_waitq);
+        return ret;
+    }
+    md->stats.tx_descs++;
+    return 0;
+}
+
+/* 把size字节的消息拷进发送池的一个缓冲区并只发出描述符，没有空闲缓冲区时返回-ENOBUFS，由调用者改走寄存器 */
+ssize_t mailbox_desc_send_iter(struct mailbox_chan *ch, struct iov_iter *from, size_t size, u8 task,
+                               unsigned int prio)
+{
+    struct mailbox_dev *md = ch->md;
+    int buf = mailbox_desc_alloc(md, NULL);
+    int ret;
+
+    if (buf < 0)
+        return buf;
+    if (copy_from_iter(mailbox_desc_tx_buf(md, buf), size, from) != size)
+    {
+        mailbox_desc_release(md, NULL, buf);
+        return -EFAULT;
+    }
+    ret = mailbox_desc_submit(ch, NULL, buf, 0, size, task, prio);
+    return ret ? ret : size;
+}
+
+/* 描述符模式的缓冲区分配、发送与释放 */
+long mailbox_ioctl_desc(struct file *file, unsigned int cmd, struct mailbox_desc __user *argp)
+{
+    struct mailbox_chan *ch = mailbox_file_chan(file);
+    struct mailbox_dev *md = ch->md;
+    struct mailbox_desc_info info;
+    struct mailbox_desc desc;
+    int buf, ret;
+
+    if (!md->desc_slots)
+        return -ENODEV;
+    switch (cmd)
+    {
+    case MAILBOX_IOC_DESC_INFO:
+        memset(&info, 0, sizeof(info));
+        info.pool_size = (u64)md->desc_slots * md->desc_slot_size;
+        info.slot_size = md->desc_slot_size;
+        info.slots = md->desc_slots;
+        info.free_slots = READ_ONCE(md->desc_free);
+        return copy_to_user(argp, &info, sizeof(info)) ? -EFAULT : 0;
+    case MAILBOX_IOC_DESC_ALLOC:
+        buf = mailbox_desc_alloc(md, file);
+        if (buf < 0)
+        {
+            if (file->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            if (wait_event_interruptible(md->desc_waitq, (buf = mailbox_desc_alloc(md, file)) >= 0))
+                return -ERESTARTSYS;
+        }
+        memset(&desc, 0, sizeof(desc));
+        desc.buf = buf;
+        desc.len = md->desc_slot_size;
+        if (copy_to_user(argp, &desc, sizeof(desc)))
+        {
+            mailbox_desc_release(md, file, buf);
+            return -EFAULT;
+        }
+        return 0;
+    case MAILBOX_IOC_DESC_SEND:
+        if (copy_from_user(&desc, argp, sizeof(desc)))
+            return -EFAULT;
+        // 合并中的小消息先于本条消息发出
+        ret = READ_ONCE(ch->co_msgs) ? mailbox_co_flush(ch, false) : 0;
+        return ret ? ret : mailbox_desc_submit(ch, file, desc.buf, desc.off, desc.len, mailbox_file_task(file),
+                                               READ_ONCE(mailbox_file(file)->prio));
+    case MAILBOX_IOC_DESC_FREE:
+        if (copy_from_user(&desc, argp, sizeof(desc)))
+            return -EFAULT;
+        return desc.buf < md->desc_slots && mailbox_desc_release(md, file, desc.buf) ? 0 : -EINVAL;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* 把发送池映射给应用，缓冲区buf位于映射的buf * slot_size处 */
+int mailbox_desc_mmap(struct mailbox_dev *md, struct vm_area_struct *vma)
+{
+    size_t pool = (size_t)md->desc_slots * md->desc_slot_size;
+    size_t size = vma->vm_end - vma->vm_start;
+
+    if (!md->desc_slots)
+        return -ENODEV;
+    if (vma->vm_pgoff || size > pool)
+        return -EINVAL;
+    if (md->desc_phys)
+    {
+        // 与ASP共享的内存不经过cache一致性协议，按写合并映射
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+        return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(md->desc_phys + md->desc_tx_off), size, vma->vm_page_prot);
+    }
+    return remap_vmalloc_range(vma, md->desc_shm, md->desc_tx_off >> PAGE_SHIFT);
+}
+
+/*
+ * 描述符模式的共享内存：设备树中memory-region指向一块no-map的reserved memory，asp,desc-slot-size给出缓冲区大小；
+ * 模拟的对端由platform_data提供。共享内存平分为两个缓冲池，都没有时不启用描述符模式。
+ */
+int mailbox_desc_init(struct mailbox_dev *md)
+{
+    struct device_node *np = md->pdev->dev.of_node;
+    struct device_node *mem = of_parse_phandle(np, "memory-region", 0);
+    struct reserved_mem *rmem;
+    u32 slot = MAILBOX_DESC_SLOT_SIZE;
+    size_t half;
+    int ret = -EINVAL;
+
+    if (md->pdata && md->pdata->shm)
+    {
+        of_node_put(mem);
+        md->desc_shm = md->pdata->shm;
+        md->desc_shm_size = md->pdata->shm_size;
+        if (md->pdata->desc_slot_size)
+            slot = md->pdata->desc_slot_size;
+    }
+    else if (mem)
+    {
+        rmem = of_reserved_mem_lookup(mem);
+        of_node_put(mem);
+        if (!rmem)
+            return -EINVAL;
+        md->desc_shm = memremap(rmem->base, rmem->size, MEMREMAP_WC);
+        if (!md->desc_shm)
+            return -ENOMEM;
+        md->desc_phys = rmem->base;
+        md->desc_shm_size = rmem->size;
+    }
+    else
+    {
+        return 0;
+    }
+    of_property_read_u32(np, "asp,desc-slot-size", &slot);
+
+    // 两个缓冲池与每个缓冲区都按页对齐，应用才能mmap发送池
+    half = md->desc_shm_size / 2;
+    if (slot == 0 || slot % PAGE_SIZE || half % PAGE_SIZE || half < slot)
+    {
+        printk(KERN_ERR "sw_mailbox: %s: shared memory of %zu bytes cannot hold %u-byte buffers\n", md->name, md->desc_shm_size, slot);
+        goto fail;
+    }
+    ret = -ENOMEM;
+    md->desc_slot_size = slot;
+    md->desc_slots = min_t(size_t, half / slot, MAILBOX_DESC_MAX_SLOTS);
+    md->desc_tx_off = md->tx_a2c ? half : 0;
+    md->desc_rx_off = md->tx_a2c ? 0 : half;
+    md->desc_free = md->desc_slots;
+    md->desc_busy = bitmap_zalloc(md->desc_slots, GFP_KERNEL);
+    md->desc_seq = kcalloc(md->desc_slots, sizeof(*md->desc_seq), GFP_KERNEL);
+    md->desc_owner = kcalloc(md->desc_slots, sizeof(*md->desc_owner), GFP_KERNEL);
+    if (!md->desc_busy || !md->desc_seq || !md->desc_owner ||
+        kfifo_alloc(&md->desc_done, roundup_pow_of_two(md->desc_slots), GFP_KERNEL))
+        goto fail;
+    printk("sw_mailbox: %s: descriptor mode, %u buffers of %u bytes each way\n", md->name, md->desc_slots, slot);
+    return 0;
+
+fail:
+    bitmap_free(md->desc_busy);
+    kfree(md->desc_seq);
+    kfree(md->desc_owner);
+    if (md->desc_phys)
+        memunmap(md->desc_shm);
+    md->desc_slots = 0;
+    return ret;
+}
+
+void mailbox_desc_exit(struct mailbox_dev *md)
+{
+    if (!md->desc_slots)
+        return;
+    kfifo_free(&md->desc_done);
+    bitmap_free(md->desc_busy);
+    kfree(md->desc_seq);
+    kfree(md->desc_owner);
+    if (md->desc_phys)
+        memunmap(md->desc_shm);
+}
@@ -0,0 +1,343 @@
+/*
+ * sw_mailbox模块内部共用的定义：实例与通道的状态、各文件之间调用的函数与模块参数。
+ * sw_mailbox_core.c为收发主通路、文件操作与probe，其余文件各实现一个功能：
+ *   sw_mailbox_rxring.c    映射给应用的接收环
+ *   sw_mailbox_coalesce.c  小消息的合并发送与拆包
+ *   sw_mailbox_desc.c      描述符模式的共享内存缓冲池
+ *   sw_mailbox_bypass.c    寄存器环交给用户态收发的旁路
+ *   sw_mailbox_debugfs.c   debugfs中的统计
+ */
+#ifndef _SW_MAILBOX_PRIV_H
+#define _SW_MAILBOX_PRIV_H
+
+#include <linux/cdev.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/irq.h>
+#include <linux/platform_device.h>
+#include <linux/of_irq.h>
+#include <linux/poll.h>
+#include <linux/io.h>
+#include <asm/io.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/kfifo.h>
+#include <linux/delay.h>
+#include <linux/list.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/of.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
+#include <linux/capability.h>
+#include "sw_mailbox.h"
+#include "sw_mailbox_ring.h"
+#include "sw_mailbox_txq.h"
+
+#define MAILBOX_TASK_NUM 256
+
+struct mailbox_dev;
+
+/* 接收队列中的一条消息，重组期间挂在rx_partial上，完整后移入rx_msgs */
+struct mailbox_rx_msg
+{
+    struct list_head node;
+    size_t len;             /* 消息字节数 */
+    size_t filled;          /* 已收到的字节数 */
+    unsigned int next_frag; /* 期望的下一个分片序号 */
+    bool in_ring;           /* 内容在映射给应用的接收环中预留的记录里 */
+    u64 ring_pos;           /* 记录头在接收环中的位置 */
+    u8 *data;               /* 不在接收环中时紧跟在本结构之后 */
+};
+
+/* 逻辑通道：共享同一个寄存器环，各自拥有设备节点、接收队列与发送队列 */
+struct mailbox_chan
+{
+    struct list_head rx_msgs; /* 已完整的消息，按完成顺序读出 */
+    spinlock_t rx_msgs_lock;
+    size_t rx_queued_bytes;
+    wait_queue_head_t rx_waitq;
+    struct mutex read_lock;
+    struct mailbox_rx_msg *rx_partial[MAILBOX_TASK_NUM]; /* 按task重组中的消息，只由接收线程访问 */
+
+    /* 映射给应用的接收环（头部一页加数据区），第一次映射时分配，映射期间消息直接写进环中 */
+    struct mailbox_rx_ring *rx_ring;
+    u8 *rx_ring_data;
+    u64 rx_ring_size;
+    u64 rx_ring_prod; /* 内核自己的prod，不信任应用可写的头部，只由接收线程访问 */
+    atomic_t rx_ring_maps;
+
+    struct mailbox_txq txq[MAILBOX_PRIO_NUM]; /* 每个优先级一个，多个写者无锁提交完整的分片，由持有tx_lock的一方取出 */
+    wait_queue_head_t tx_waitq;
+    struct mutex write_lock; /* 只有合并发送经过，保护tx_bounce */
+    uint64_t *tx_bounce; /* 合并发送的中转页 */
+    struct device *device;
+
+    /* 合并发送：小消息以长度前缀紧凑排列在一个合并分片中，攒够后一次交给发送队列，由co_lock保护 */
+    spinlock_t co_lock;
+    uint64_t *co_frag; /* 帧头加上至多mailbox_frag_max_words()个payload寄存器 */
+    unsigned int co_bytes;
+    unsigned int co_msgs;
+    struct hrtimer co_timer;
+
+    struct mailbox_dev *md;
+    unsigned int id; /* 通道号，即帧头中的通道号 */
+};
+
+/*
+ * 打开的文件：每个优先级一个发送消息用的task id。一条消息拆成多个提交环条目时，
+ * 同一文件同一优先级的其它消息不能插进这些条目之间，否则接收方按task重组时会把它们混在一起，
+ * 单条目的消息共享该优先级的msg_sem，多条目的消息独占；两个优先级的分片可以交错。
+ */
+struct mailbox_file
+{
+    u8 task[MAILBOX_PRIO_NUM];
+    struct rw_semaphore msg_sem[MAILBOX_PRIO_NUM];
+    unsigned int prio; /* 没有逐条指定优先级的消息所用的类别 */
+};
+
+/* 数据通路统计，通过debugfs导出，直方图按log2分桶 */
+#define MAILBOX_HIST_BUCKETS 32
+struct mailbox_stats
+{
+    u64 tx_bytes;
+    u64 tx_regs;
+    u64 rx_bytes;
+    u64 rx_regs;
+    u64 doorbells_tx;
+    u64 doorbells_rx;
+    u64 tx_full_spins;
+    u64 tx_head_reads; /* 发送路径上重读对方head的次数 */
+    u64 rx_msgs;
+    u64 rx_drops;
+    u64 rx_high_hits; /* 通道越过高水位的次数 */
+    u64 rx_ring_full; /* 映射的接收环放不下而停止读接收区的次数 */
+    u64 rx_resumes;
+    u64 rx_halted_doorbells; /* 停止接收期间到达的门铃 */
+    u64 rx_polls;
+    u64 rx_poll_passes;
+    u64 rx_rearms;
+    u64 tx_head_notifies;
+    u64 tx_timer_polls;
+    u64 tx_blocks;
+    u64 tx_bank_acks;
+    u64 rx_blocks;
+    u64 tx_packed_msgs;
+    u64 tx_packed_frags;
+    u64 rx_packed_frags;
+    u64 tx_descs;
+    u64 tx_desc_done; /* 对方交还的缓冲区 */
+    u64 rx_descs;
+    u64 rx_desc_bad;  /* 越界的描述符或与发送序号不符的交还 */
+    u64 bypass_entries;
+    u64 bypass_irqs; /* 旁路期间转发给应用的中断 */
+    u64 tx_entries[MAILBOX_PRIO_NUM]; /* 各优先级取出的提交环条目 */
+    u64 tx_chunk_hist[MAILBOX_HIST_BUCKETS];          /* 每次写入的寄存器数 */
+    u64 rx_chunk_hist[MAILBOX_HIST_BUCKETS];          /* 每次读出的寄存器数 */
+    u64 rx_doorbell_latency_hist[MAILBOX_HIST_BUCKETS]; /* 门铃到读出的延迟(ns) */
+    u64 tx_queue_latency_hist[MAILBOX_PRIO_NUM][MAILBOX_HIST_BUCKETS]; /* 各优先级的条目从提交到开始写入的延迟(ns) */
+};
+
+/* 一个mailbox实例：寄存器窗口、中断、各逻辑通道与收发状态，在mailbox_probe中分配 */
+struct mailbox_dev
+{
+    unsigned int id;
+    char name[16]; /* 设备节点目录与debugfs目录的名字 */
+    struct platform_device *pdev;
+    struct sw_mailbox_platform_data *pdata; /* 模拟的对端（sw_mailbox-fake.c）提供的寄存器窗口 */
+    struct mailbox_ring ring;
+    phys_addr_t regs_phys; /* 寄存器窗口的物理地址，模拟的窗口为0，不能旁路 */
+    resource_size_t regs_size;
+    int irq;
+    int irq_cpu; /* 中断所固定的CPU，-1为不指定 */
+    dev_t devno;
+    struct cdev cdev;
+    struct mailbox_chan *chans;
+
+    /* 分片解析状态跨越多次读取，只由接收线程访问 */
+    uint64_t rx_frag_hdr;
+    unsigned int rx_frag_left;  /* 当前分片还未收到的payload寄存器数 */
+    unsigned long rx_wake_chans; /* 本轮完成了消息、需要唤醒读者的通道 */
+    /* 正在接收的合并分片的字节流，分片之间不会交错，大小按帧头中payload寄存器数的上限 */
+    uint64_t rx_packed[0xff];
+    size_t rx_packed_len;
+    size_t rx_packed_filled;
+    uint64_t rx_buf[MAILBOX_MAX_REG_NUM]; /* 一次读出的接收区 */
+    atomic64_t irq_pending; /* 硬中断清掉、留给接收线程处理的门铃位 */
+    uint64_t rx_bank_acks;  /* 本轮读完的块模式分片所在bank的应答位 */
+    ktime_t rx_doorbell_ts;
+    unsigned long interrupt_halting; /* 越过高水位、还没读到低水位或映射的接收环已满的通道，不为0时接收线程不读接收区 */
+    uint64_t rx_desc; /* 正在接收的描述符分片的描述符寄存器 */
+
+    struct ida task_ida; /* 打开的文件每个优先级占用一个发送task id，关闭时归还；0留给合并分片 */
+
+    /* 正在写入对方接收区的分片所属的通道、优先级与剩余寄存器数，分片不能与其它分片交错，由tx_lock保护 */
+    unsigned int tx_cur_chan;
+    unsigned int tx_cur_prio;
+    unsigned int tx_frag_left;
+
+    /* 自己的IR只有本端会写，rx与tx路径分别修改其中的head与tail字段，用影子寄存器加锁合并 */
+    uint64_t ir_shadow;
+    spinlock_t ir_lock;
+    /* 上次读到的对方head，空间不够时才重读，由tx_lock保护 */
+    int tx_peer_head;
+    /* 对方CSR是否为停止标志，由STOP/START与每次敲门铃时读到的CSR更新，发送消息前不再单独读CSR */
+    bool tx_peer_stopped;
+    /* 发送队列的消费者，进程、中断与hrtimer上下文都可能搬运发送队列 */
+    spinlock_t tx_lock;
+    atomic_t tx_pump_req; /* 没抢到tx_lock的一方留给持有者再搬运一轮 */
+    struct hrtimer tx_timer;
+    unsigned int tx_poll_us; /* 当前的hrtimer退避间隔 */
+    bool tx_waiting;         /* 已在IR中挂起等待标志 */
+    bool tx_block_pending;   /* 已选出但还未开始写入的分片为块模式分片 */
+    bool tx_block_kick;      /* 该块模式分片的门铃带MAILBOX_CSR_BLOCK */
+    uint64_t tx_chunk[MAILBOX_MAX_REG_NUM]; /* 一次写入对方接收区的寄存器，由tx_lock保护 */
+
+    /* 自适应模式选择的观测值：有积压时两次写入的间隔折算到每个寄存器的耗时(ns)，按模式分别做EWMA，由tx_lock保护 */
+    ktime_t tx_last_push_ts;
+    bool tx_backlogged;
+    u64 tx_block_ns_per_reg;
+    u64 tx_fifo_ns_per_reg;
+    atomic_t tx_block_probe;
+
+    /* 描述符模式：共享内存平分为C2A与A2C两个缓冲池，desc_slots为0时不启用 */
+    bool tx_a2c;               /* 本端向A2C接收区发送，发送池为后半 */
+    void *desc_shm;
+    phys_addr_t desc_phys;     /* 来自reserved memory时的物理地址；为0时desc_shm是模拟对端vmalloc的内存 */
+    size_t desc_shm_size;
+    unsigned int desc_slot_size;
+    unsigned int desc_slots;   /* 每个缓冲池的缓冲区数 */
+    size_t desc_tx_off;        /* 发送池与接收池在共享内存中的字节偏移 */
+    size_t desc_rx_off;
+    spinlock_t desc_lock;      /* 保护发送池的分配状态与desc_done的消费者 */
+    unsigned long *desc_busy;  /* 已分配或在对方手中的缓冲区 */
+    u16 *desc_seq;
+    struct file **desc_owner;  /* 由应用分配而还未发出的缓冲区所属的文件 */
+    unsigned int desc_free;
+    wait_queue_head_t desc_waitq;
+    DECLARE_KFIFO_PTR(desc_done, uint64_t); /* 内容已拷出、待交还对方的描述符 */
+
+    /* 旁路：寄存器环由bypass_file所属的进程在用户态收发，驱动不再读写接收区与发送区，由mailbox_bypass_lock保护 */
+    struct file *bypass_file;
+    struct eventfd_ctx *bypass_efd;
+
+    struct mailbox_stats stats;
+    struct dentry *debugfs;
+};
+
+/* sw_mailbox_core.c中定义的模块参数 */
+extern unsigned int nr_channels;
+extern unsigned int tx_poll_min_us;
+extern unsigned int rx_low_watermark;
+extern unsigned int rx_ring_max_kb;
+extern unsigned int coalesce_bytes;
+extern unsigned int coalesce_msgs;
+extern unsigned int coalesce_us;
+extern bool bypass;
+
+/* 寄存器环正由应用在用户态直接收发 */
+static inline bool mailbox_bypassed(struct mailbox_dev *md)
+{
+    return READ_ONCE(md->bypass_file) != NULL;
+}
+
+/* 写自己的CSR：真实硬件上非使能位写1清零，模拟的对端在普通内存上用csr_write实现同样的语义 */
+static inline void mailbox_write_csr(struct mailbox_dev *md, uint64_t val)
+{
+    if (unlikely(md->pdata && md->pdata->csr_write))
+        md->pdata->csr_write(md->pdata->ctx, val);
+    else
+        writeq(val, md->ring.base + md->ring.own_csr);
+}
+
+/* 每个实例一个cdev，覆盖它的全部通道 */
+static inline struct mailbox_dev *mailbox_inode_dev(struct inode *inode)
+{
+    return container_of(inode->i_cdev, struct mailbox_dev, cdev);
+}
+
+static inline struct mailbox_file *mailbox_file(struct file *file)
+{
+    return file->private_data;
+}
+
+/* 文件当前优先级的task id */
+static inline u8 mailbox_file_task(struct file *file)
+{
+    return mailbox_file(file)->task[mailbox_file(file)->prio];
+}
+
+/* 设备节点的次设备号减去实例的起始次设备号即通道号 */
+static inline struct mailbox_chan *mailbox_file_chan(struct file *file)
+{
+    struct mailbox_dev *md = mailbox_inode_dev(file_inode(file));
+
+    return &md->chans[iminor(file_inode(file)) - MINOR(md->devno)];
+}
+
+/* 本通道prio优先级的提交环能否再放下一个只含最大分片的条目 */
+static inline bool mailbox_tx_frag_room(struct mailbox_chan *ch, unsigned int prio)
+{
+    return mailbox_txq_avail(&ch->txq[prio]) > 1 + mailbox_frag_max_words(&ch->md->ring);
+}
+
+/* sw_mailbox_core.c */
+struct mailbox_rx_msg *mailbox_rx_msg_alloc(struct mailbox_chan *ch, size_t len);
+void mailbox_rx_drop_partial(struct mailbox_chan *ch, u8 task);
+int mailbox_rx_enqueue(struct mailbox_chan *ch, struct mailbox_rx_msg *msg);
+unsigned int mailbox_tx_queued(struct mailbox_dev *md);
+void mailbox_tx_pump(struct mailbox_dev *md);
+unsigned int mailbox_tx_submit(struct mailbox_chan *ch, unsigned int prio, const uint64_t *words, unsigned int count);
+int mailbox_tx_submit_all(struct mailbox_chan *ch, unsigned int prio, const uint64_t *words, unsigned int count);
+void mailbox_rx_resume(struct mailbox_chan *ch);
+size_t mailbox_rx_next_len(struct mailbox_chan *ch);
+
+/* sw_mailbox_rxring.c */
+bool mailbox_rx_ring_reserve(struct mailbox_chan *ch, size_t len, u64 *pos);
+void mailbox_rx_ring_commit(struct mailbox_chan *ch, struct mailbox_rx_msg *msg, bool discard);
+bool mailbox_rx_ring_ready(struct mailbox_chan *ch);
+bool mailbox_rx_ring_flush(struct mailbox_chan *ch);
+bool mailbox_rx_ring_room(struct mailbox_chan *ch);
+int mailbox_rx_ring_mmap(struct mailbox_chan *ch, struct vm_area_struct *vma);
+
+/* sw_mailbox_coalesce.c */
+int mailbox_rx_unpack(struct mailbox_chan *ch);
+int mailbox_co_flush(struct mailbox_chan *ch, bool nonblock);
+enum hrtimer_restart mailbox_co_timer_fn(struct hrtimer *timer);
+ssize_t mailbox_co_send(struct mailbox_chan *ch, struct iov_iter *from, size_t size, bool nonblock);
+
+/* sw_mailbox_desc.c */
+int mailbox_desc_release(struct mailbox_dev *md, struct file *owner, int buf);
+int mailbox_rx_desc(struct mailbox_dev *md, struct mailbox_chan *ch);
+void mailbox_desc_done_flush(struct mailbox_dev *md);
+ssize_t mailbox_desc_send_iter(struct mailbox_chan *ch, struct iov_iter *from, size_t size, u8 task, unsigned int prio);
+long mailbox_ioctl_desc(struct file *file, unsigned int cmd, struct mailbox_desc __user *argp);
+int mailbox_desc_mmap(struct mailbox_dev *md, struct vm_area_struct *vma);
+int mailbox_desc_init(struct mailbox_dev *md);
+void mailbox_desc_exit(struct mailbox_dev *md);
+
+/* sw_mailbox_bypass.c */
+void mailbox_bypass_exit(struct mailbox_dev *md);
+long mailbox_ioctl_bypass(struct file *file, struct mailbox_bypass __user *argp);
+int mailbox_bypass_mmap(struct file *file, struct mailbox_dev *md, struct vm_area_struct *vma);
+
+/* sw_mailbox_debugfs.c */
+void mailbox_debugfs_init(struct mailbox_dev *md);
+
+#endif /* _SW_MAILBOX_PRIV_H */
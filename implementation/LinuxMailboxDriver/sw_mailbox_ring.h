@@ -0,0 +1,314 @@
+/*
+ * 寄存器环协议：寄存器布局与收发两端对寄存器的读写操作。
+ * 内核驱动与用户态模拟器（emu/）共用这些函数，使用者需要先提供readq/writeq与__iomem。
+ * 寄存器数与两个接收区的位置在运行时由struct mailbox_ring给出，下面的C2A/A2C常量只是现有硬件的默认布局。
+ */
+#ifndef _SW_MAILBOX_RING_H
+#define _SW_MAILBOX_RING_H
+
+#include "sw_mailbox.h"
+
+/* mailbox address space，设备树没有给出布局时使用 */
+#define C2AMAILBOX_REG_NUM 62
+#define C2AMAILBOX_CSR 0x1F8
+#define C2AMAILBOX_IR 0x1F0
+#define C2AMAILBOX_BASE 0x000
+#define C2AMAILBOX_INT_ENA 0x8000000000000000ull
+
+#define A2CMAILBOX_REG_NUM 62
+#define A2CMAILBOX_CSR 0x3F8
+#define A2CMAILBOX_IR 0x3F0
+#define A2CMAILBOX_BASE 0x200
+#define A2CMAILBOX_INT_ENA 0x8000000000000000ull
+
+/* 每个接收区的消息寄存器数上限：IR中的head/tail与帧头中的寄存器数都是8位，两个接收区各占至多2KB */
+#define MAILBOX_MAX_REG_NUM 254
+
+/*
+ * CSR位定义：最高位为中断使能，其余位写入自己的CSR时为写1清零。
+ * 发送方只置门铃位并保留接收方的使能位，使接收方在轮询期间屏蔽中断不会被门铃打开。
+ * 0x7fff_ffff_ffff_ffff为接收方停止接收的标志。
+ */
+#define MAILBOX_CSR_VALID_MASK 0x7fffffffffffffffull
+/*
+ * 数据门铃，不区分通道：寄存器环由各通道共用，接收方无论哪个通道有数据都要按顺序读完整个接收区，
+ * 消息所属的通道只由分片帧头中的通道号给出，读出后再只唤醒完成了消息的通道
+ */
+#define MAILBOX_CSR_DOORBELL 0x0000000000000001ull
+#define MAILBOX_CSR_HEAD_NOTIFY 0x0000000000000002ull /* 接收方推进了head，通知等待中的发送方 */
+#define MAILBOX_CSR_STOPPED 0x7fffffffffffffffull
+#define MAILBOX_CSR_BLOCK 0x4000000000000000ull /* 本次门铃对应一个块模式分片 */
+/* bit58-61为各bank的应答位：接收方读完一个块模式分片后置发送方CSR中该分片所在bank的位 */
+#define MAILBOX_MAX_BANKS 4
+#define MAILBOX_CSR_BANK_SHIFT 58
+#define MAILBOX_CSR_BANK_ACK(b) (1ull << (MAILBOX_CSR_BANK_SHIFT + (b)))
+#define MAILBOX_CSR_BANK_ACK_MASK (((1ull << MAILBOX_MAX_BANKS) - 1) << MAILBOX_CSR_BANK_SHIFT)
+
+/* IR位定义：[7:0]为自己接收区的head，[15:8]为对方接收区的tail，bit16表示自己在等待对方推进head */
+#define MAILBOX_IR_HEAD_MASK 0x00000000000000ffull
+#define MAILBOX_IR_TAIL_MASK 0x000000000000ff00ull
+#define MAILBOX_IR_TAIL_SHIFT 8
+#define MAILBOX_IR_TX_WAIT 0x0000000000010000ull
+
+#ifdef __KERNEL__
+/*
+ * 没有mailbox硬件时由模拟的对端（sw_mailbox-fake.c）通过platform_data提供寄存器窗口。
+ * 普通内存没有写1清零语义，驱动写自己的CSR时改为调用csr_write，由对端模拟并注入中断。
+ */
+struct sw_mailbox_platform_data
+{
+    unsigned char __iomem *regs;
+    unsigned int reg_num; /* 每个接收区的消息寄存器数，按默认布局依次排列两个接收区，0为C2AMAILBOX_REG_NUM */
+    void (*csr_write)(void *ctx, uint64_t val);
+    void *ctx;
+    /* 描述符模式的共享内存，由vmalloc_user分配，两个缓冲池依次排列；为NULL时不支持描述符模式 */
+    void *shm;
+    size_t shm_size;
+    unsigned int desc_slot_size;
+};
+#endif
+
+/* 共享内存没有给出缓冲区大小时的默认值 */
+#define MAILBOX_DESC_SLOT_SIZE 0x10000
+/* 描述符中缓冲区号的位宽限制了每个缓冲池的缓冲区数 */
+#define MAILBOX_DESC_MAX_SLOTS 0x10000
+
+/*
+ * 一端看到的寄存器环，偏移以字节计。
+ * 发送区为对方的接收区，其后依次为自己的IR（对方接收区的tail与自己接收区的head）与对方的CSR；
+ * 接收区为自己的接收区，其后依次为对方的IR与自己的CSR。
+ */
+struct mailbox_ring
+{
+    unsigned char __iomem *base;
+    unsigned int tx_regs; /* 对方接收区的消息寄存器数 */
+    unsigned int rx_regs; /* 自己接收区的消息寄存器数 */
+    unsigned int tx_base;
+    unsigned int own_ir;
+    unsigned int peer_csr;
+    unsigned int rx_base;
+    unsigned int peer_ir;
+    unsigned int own_csr;
+};
+
+/* 默认布局中第二个接收区的偏移：两个接收区各为reg_num个消息寄存器加IR与CSR，依次排列 */
+static inline unsigned int mailbox_ring_area_size(unsigned int reg_num)
+{
+    return (reg_num + 2) * 8;
+}
+
+/* 按两个接收区的位置与寄存器数填写r，寄存器数的范围由调用者检查 */
+static inline void mailbox_ring_setup(struct mailbox_ring *r, unsigned char __iomem *base,
+                                      unsigned int tx_base, unsigned int tx_regs, unsigned int rx_base, unsigned int rx_regs)
+{
+    r->base = base;
+    r->tx_regs = tx_regs;
+    r->rx_regs = rx_regs;
+    r->tx_base = tx_base;
+    r->own_ir = tx_base + tx_regs * 8;
+    r->peer_csr = r->own_ir + 8;
+    r->rx_base = rx_base;
+    r->peer_ir = rx_base + rx_regs * 8;
+    r->own_csr = r->peer_ir + 8;
+}
+
+/* 对方接收区最多容纳的寄存器数，留一个空位区分空与满 */
+static inline unsigned int mailbox_ring_capacity(const struct mailbox_ring *r)
+{
+    return r->tx_regs - 1;
+}
+
+/* 分片的最大payload寄存器数，加上帧头后一个分片正好填满对方接收区 */
+static inline unsigned int mailbox_frag_max_words(const struct mailbox_ring *r)
+{
+    return r->tx_regs - 2;
+}
+
+/*
+ * 块模式把接收区分成banks个bank，每个块模式分片（帧头加payload）正好占一个bank，
+ * banks个分片合计不超过接收区的容量，前一个bank未读时总放得下下一个。
+ * 只有一个bank时为停等：分片填满整个接收区，等应答后才写下一个；
+ * 多个bank时发送方在接收方读bank N的同时写bank N+1。
+ */
+static inline unsigned int mailbox_block_frag_words(const struct mailbox_ring *r, unsigned int banks)
+{
+    return mailbox_ring_capacity(r) / banks - 1;
+}
+
+/*
+ * 块模式分片的门铃是否带MAILBOX_CSR_BLOCK：发送方在对方读完这个分片之前写不了下一个分片时
+ * （消息的最后一个分片，或停等时后面放不下第二个分片），接收方读空后立即开中断；
+ * 流水线中间的bank不带，接收方按流式的空闲轮询接着读下一个bank，不必每个bank一次中断。
+ */
+static inline bool mailbox_block_doorbell(const struct mailbox_ring *r, uint64_t hdr)
+{
+    return (hdr & MAILBOX_FRAG_LAST) || 2 * (1 + MAILBOX_FRAG_WORDS(hdr)) > mailbox_ring_capacity(r);
+}
+
+/* 合并分片的payload字节数上限，能放进合并分片的最大消息比它少一个两字节的长度前缀 */
+static inline unsigned int mailbox_pack_capacity(const struct mailbox_ring *r)
+{
+    return mailbox_frag_max_words(r) * 8;
+}
+
+/* 组一个描述符分片（DESC）或交还分片（DESC | DONE）：帧头加一个描述符寄存器 */
+static inline void mailbox_desc_frame(uint64_t *frame, unsigned int chan, uint8_t task, uint64_t flags, uint32_t len, uint64_t desc)
+{
+    frame[0] = MAILBOX_FRAG_HEADER(chan, task, 1, MAILBOX_FRAG_FIRST | MAILBOX_FRAG_LAST | MAILBOX_FRAG_DESC | flags, len);
+    frame[1] = desc;
+}
+
+/* 合并分片中长度前缀的字节数 */
+static inline unsigned int mailbox_pack_prefix_len(size_t len)
+{
+    return len < 0x80 ? 1 : 2;
+}
+
+/* 在p处写入长度前缀，返回写入的字节数，len不超过mailbox_pack_capacity() - 2 */
+static inline unsigned int mailbox_pack_put_len(uint8_t *p, size_t len)
+{
+    if (len < 0x80)
+    {
+        p[0] = len;
+        return 1;
+    }
+    p[0] = 0x80 | (len & 0x7f);
+    p[1] = len >> 7;
+    return 2;
+}
+
+/* 从p处最多avail个字节中解析长度前缀，返回前缀的字节数，字节流不完整时返回0 */
+static inline unsigned int mailbox_pack_get_len(const uint8_t *p, size_t avail, size_t *len)
+{
+    if (avail < 1)
+        return 0;
+    if (!(p[0] & 0x80))
+    {
+        *len = p[0];
+        return 1;
+    }
+    if (avail < 2)
+        return 0;
+    *len = (p[0] & 0x7f) | ((size_t)p[1] << 7);
+    return 2;
+}
+
+/* size字节的消息按每分片至多frag_words个payload寄存器分片后占用的寄存器数 */
+static inline size_t mailbox_frame_words(size_t size, unsigned int frag_words)
+{
+    size_t frag_bytes = frag_words * sizeof(uint64_t);
+    size_t frags = size ? (size + frag_bytes - 1) / frag_bytes : 1;
+    return frags + (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+/* 从自己接收区连续读出count个寄存器，调用者保证[first, first + count)不跨越回绕点 */
+static inline void mailbox_ring_read_regs(const struct mailbox_ring *r, uint64_t *dst, int first, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+        dst[i] = readq(r->base + r->rx_base + (first + i) * 8);
+}
+
+/* 读出自己接收区中head到tail之间的全部寄存器，返回读出的寄存器数，指针越界时返回-1 */
+static inline int mailbox_ring_read(const struct mailbox_ring *r, int head, int tail, uint64_t *dst)
+{
+    int n = 0;
+
+    if (tail >= (int)r->rx_regs || head >= (int)r->rx_regs)
+        return -1;
+
+    // 环形区在回绕点处至多被分成两段连续的寄存器
+    if (tail < head)
+    {
+        n = r->rx_regs - head;
+        mailbox_ring_read_regs(r, dst, head, n);
+        head = 0;
+    }
+    mailbox_ring_read_regs(r, dst + n, head, tail - head);
+    return n + tail - head;
+}
+
+/* 对方在自己接收区中写到的tail */
+static inline int mailbox_ring_rx_tail(uint64_t peer_ir)
+{
+    return (peer_ir & MAILBOX_IR_TAIL_MASK) >> MAILBOX_IR_TAIL_SHIFT;
+}
+
+/* 自己在对方接收区中写到的tail，ir为自己IR的影子 */
+static inline int mailbox_ring_tx_tail(uint64_t ir)
+{
+    return (ir & MAILBOX_IR_TAIL_MASK) >> MAILBOX_IR_TAIL_SHIFT;
+}
+
+/* 按对方的head与自己的tail计算对方接收区的空闲寄存器数 */
+static inline int mailbox_ring_tx_room(const struct mailbox_ring *r, int head, int tail)
+{
+    int used = tail - head;
+
+    if (used < 0)
+        used += r->tx_regs;
+    return r->tx_regs - 1 - used;
+}
+
+/*
+ * 对方只会推进head，按上次读到的head（*head）算出的空闲数只会偏少。
+ * 不足need个时才重读对方IR并刷新*head，发送路径上多数写入不需要跨总线读寄存器。
+ * reads非空时累计实际的读次数。
+ */
+static inline int mailbox_ring_tx_free(const struct mailbox_ring *r, uint64_t ir, int *head, int *tail, int need, uint64_t *reads)
+{
+    int free_regs, h;
+
+    *tail = mailbox_ring_tx_tail(ir);
+    free_regs = mailbox_ring_tx_room(r, *head, *tail);
+    if (free_regs >= need)
+        return free_regs;
+    if (reads)
+        (*reads)++;
+    h = readq(r->base + r->peer_ir) & MAILBOX_IR_HEAD_MASK;
+    if (h >= (int)r->tx_regs)
+        return 0;
+    *head = h;
+    return mailbox_ring_tx_room(r, h, *tail);
+}
+
+/* 发送前缓存的对方head的初值：视为对方接收区已满，第一次发送时读取真实的head */
+static inline int mailbox_ring_tx_head_init(const struct mailbox_ring *r, uint64_t ir)
+{
+    int tail = mailbox_ring_tx_tail(ir);
+    return tail + 1 < (int)r->tx_regs ? tail + 1 : 0;
+}
+
+/* 向对方接收区从first开始连续写入count个寄存器，调用者保证不跨越回绕点 */
+static inline void mailbox_ring_write_regs(const struct mailbox_ring *r, int first, const uint64_t *src, int count)
+{
+    __iowrite64_copy(r->base + r->tx_base + first * 8, src, count);
+}
+
+/*
+ * 从tail开始向对方接收区写入n个寄存器（n不超过空闲寄存器数），返回新的tail。
+ * 在回绕点处至多分成两段连续写入，之后对IR的writeq保证这些写入先于新的tail被对方看到。
+ */
+static inline int mailbox_ring_write(const struct mailbox_ring *r, int tail, const uint64_t *words, int n)
+{
+    int k = r->tx_regs - tail;
+
+    if (n < k)
+    {
+        mailbox_ring_write_regs(r, tail, words, n);
+        return tail + n;
+    }
+    mailbox_ring_write_regs(r, tail, words, k);
+    mailbox_ring_write_regs(r, 0, words + k, n - k);
+    return n - k;
+}
+
+/* 置对方CSR中的门铃位，保留对方的中断使能位，返回写入的值 */
+static inline uint64_t mailbox_ring_kick(const struct mailbox_ring *r, uint64_t bits)
+{
+    uint64_t mailbox_csr = readq(r->base + r->peer_csr) | bits;
+    writeq(mailbox_csr, r->base + r->peer_csr);
+    return mailbox_csr;
+}
+
+#endif /* _SW_MAILBOX_RING_H */
@@ -0,0 +1,167 @@
+/* 映射给应用的接收环：映射期间接收线程把完整的消息直接写成环中的记录，应用不经过read()取走 */
+#include "sw_mailbox_priv.h"
+
+/* 在接收环中为len字节的消息预留一条记录，放不下时返回false，只由接收线程调用 */
+bool mailbox_rx_ring_reserve(struct mailbox_chan *ch, size_t len, u64 *pos)
+{
+    u64 size = ch->rx_ring_size, prod = ch->rx_ring_prod;
+    u64 used = prod - smp_load_acquire(&ch->rx_ring->cons);
+    u64 rec = MAILBOX_RXR_SIZE(len), room = size - (prod & (size - 1));
+    u64 need = rec + (rec > room ? room : 0);
+
+    // 应用写坏的cons会让used超过size，按满处理
+    if (used > size || need > size - used)
+        return false;
+    if (rec > room)
+    {
+        // 记录不跨越数据区末尾，余下的部分填一条空记录
+        *(u64 *)(ch->rx_ring_data + (prod & (size - 1))) = MAILBOX_RXR_COMMIT | MAILBOX_RXR_PAD | (room - 8);
+        prod += room;
+    }
+    *(u64 *)(ch->rx_ring_data + (prod & (size - 1))) = 0;
+    *pos = prod;
+    ch->rx_ring_prod = prod + rec;
+    smp_store_release(&ch->rx_ring->prod, ch->rx_ring_prod);
+    return true;
+}
+
+/* 提交接收环中的记录，之后应用才能读到它 */
+void mailbox_rx_ring_commit(struct mailbox_chan *ch, struct mailbox_rx_msg *msg, bool discard)
+{
+    u64 *rec = (u64 *)(ch->rx_ring_data + (msg->ring_pos & (ch->rx_ring_size - 1)));
+
+    smp_store_release(rec, MAILBOX_RXR_COMMIT | (discard ? MAILBOX_RXR_DISCARD : 0) | msg->len);
+}
+
+/* 接收环中第一条未消费的记录已提交 */
+bool mailbox_rx_ring_ready(struct mailbox_chan *ch)
+{
+    u64 cons;
+
+    if (!atomic_read(&ch->rx_ring_maps))
+        return false;
+    cons = smp_load_acquire(&ch->rx_ring->cons);
+    if (cons == READ_ONCE(ch->rx_ring_prod))
+        return false;
+    return smp_load_acquire((u64 *)(ch->rx_ring_data + (cons & (ch->rx_ring_size - 1) & ~7ull))) & MAILBOX_RXR_COMMIT;
+}
+
+/*
+ * 把接收环映射期间积压在接收队列中的消息按顺序搬进环，只由接收线程调用。
+ * 环仍放不下时通道保持停止，返回false；搬完后接收队列不超过低水位时恢复读接收区
+ */
+bool mailbox_rx_ring_flush(struct mailbox_chan *ch)
+{
+    struct mailbox_dev *md = ch->md;
+    struct mailbox_rx_msg *msg;
+    bool full = false;
+    u64 pos;
+
+    while (atomic_read(&ch->rx_ring_maps))
+    {
+        // 映射被撤销时读者可能同时在取队首的消息，预留与摘除都在锁内
+        spin_lock(&ch->rx_msgs_lock);
+        msg = list_first_entry_or_null(&ch->rx_msgs, struct mailbox_rx_msg, node);
+        if (msg && mailbox_rx_ring_reserve(ch, msg->len, &pos))
+        {
+            list_del(&msg->node);
+            ch->rx_queued_bytes -= msg->len;
+        }
+        else
+        {
+            full = msg != NULL;
+            msg = NULL;
+        }
+        spin_unlock(&ch->rx_msgs_lock);
+        if (!msg)
+            break;
+        memcpy(ch->rx_ring_data + (pos & (ch->rx_ring_size - 1)) + sizeof(u64), msg->data, msg->len);
+        msg->ring_pos = pos;
+        mailbox_rx_ring_commit(ch, msg, false);
+        kvfree(msg);
+        __set_bit(ch->id, &md->rx_wake_chans);
+    }
+    if (full)
+    {
+        if (!test_and_set_bit(ch->id, &md->interrupt_halting))
+            md->stats.rx_ring_full++;
+        return false;
+    }
+    if (READ_ONCE(ch->rx_queued_bytes) <= rx_low_watermark && test_and_clear_bit(ch->id, &md->interrupt_halting))
+        md->stats.rx_resumes++;
+    return true;
+}
+
+/* 接收环放得下积压在接收队列中的第一条消息，记录可能要在数据区末尾填充，按两倍估计 */
+bool mailbox_rx_ring_room(struct mailbox_chan *ch)
+{
+    u64 used = READ_ONCE(ch->rx_ring_prod) - smp_load_acquire(&ch->rx_ring->cons);
+    u64 rec = MAILBOX_RXR_SIZE(mailbox_rx_next_len(ch));
+
+    return used <= ch->rx_ring_size && ch->rx_ring_size - used >= min(2 * rec, ch->rx_ring_size);
+}
+
+static void mailbox_rx_ring_vm_open(struct vm_area_struct *vma)
+{
+    struct mailbox_chan *ch = vma->vm_private_data;
+
+    atomic_inc(&ch->rx_ring_maps);
+}
+
+/*
+ * 最后一个映射消失后新消息回到接收队列，环中已预留的记录仍会完成，环本身保留到设备移除。
+ * 积压的消息改由read()取走，因环满而停止的接收按低水位恢复
+ */
+static void mailbox_rx_ring_vm_close(struct vm_area_struct *vma)
+{
+    struct mailbox_chan *ch = vma->vm_private_data;
+
+    if (atomic_dec_and_test(&ch->rx_ring_maps) && READ_ONCE(ch->rx_queued_bytes) <= rx_low_watermark)
+        mailbox_rx_resume(ch);
+}
+
+static const struct vm_operations_struct mailbox_rx_ring_vm_ops = {
+    .open = mailbox_rx_ring_vm_open,
+    .close = mailbox_rx_ring_vm_close,
+};
+
+/* 把通道的接收环映射给应用，第一次映射的长度决定数据区大小 */
+int mailbox_rx_ring_mmap(struct mailbox_chan *ch, struct vm_area_struct *vma)
+{
+    size_t size = vma->vm_end - vma->vm_start;
+    u64 data = size - PAGE_SIZE;
+    int ret;
+
+    if (size <= PAGE_SIZE || !is_power_of_2(data) || data > (u64)rx_ring_max_kb << 10)
+        return -EINVAL;
+    // 同一时刻只有一个消费者；接收线程只在映射计数不为0时使用环，环在这之前分配好
+    mutex_lock(&ch->read_lock);
+    if (atomic_read(&ch->rx_ring_maps))
+    {
+        mutex_unlock(&ch->read_lock);
+        return -EBUSY;
+    }
+    if (!ch->rx_ring)
+    {
+        ch->rx_ring = vmalloc_user(size);
+        if (ch->rx_ring)
+        {
+            ch->rx_ring_data = (u8 *)ch->rx_ring + PAGE_SIZE;
+            ch->rx_ring_size = data;
+            ch->rx_ring->size = data;
+        }
+    }
+    ret = !ch->rx_ring ? -ENOMEM : ch->rx_ring_size != data ? -EINVAL : 0;
+    if (!ret)
+        ret = remap_vmalloc_range(vma, ch->rx_ring, 0);
+    if (!ret)
+    {
+        vma->vm_flags |= VM_DONTCOPY;
+        vma->vm_private_data = ch;
+        vma->vm_ops = &mailbox_rx_ring_vm_ops;
+        mailbox_rx_ring_vm_open(vma);
+        wake_up_interruptible(&ch->rx_waitq); // 等在read()中的读者返回-EBUSY
+    }
+    mutex_unlock(&ch->read_lock);
+    return ret;
+}
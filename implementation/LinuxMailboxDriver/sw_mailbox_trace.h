@@ -0,0 +1,82 @@
+/* sw_mailbox数据通路上的tracepoint，替代逐寄存器的printk */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sw_mailbox
+
+#if !defined(_SW_MAILBOX_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SW_MAILBOX_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* 发送方写入一段寄存器并更新tail */
+TRACE_EVENT(mailbox_tx_chunk,
+    TP_PROTO(int tail, int regs, size_t remaining),
+    TP_ARGS(tail, regs, remaining),
+    TP_STRUCT__entry(
+        __field(int, tail)
+        __field(int, regs)
+        __field(size_t, remaining)
+    ),
+    TP_fast_assign(
+        __entry->tail = tail;
+        __entry->regs = regs;
+        __entry->remaining = remaining;
+    ),
+    TP_printk("tail=%d regs=%d remaining=%zu", __entry->tail, __entry->regs, __entry->remaining)
+);
+
+/* 接收方从head读到tail，msgs为本次重组完成的消息数 */
+TRACE_EVENT(mailbox_rx_drain,
+    TP_PROTO(int head, int tail, int regs, int msgs),
+    TP_ARGS(head, tail, regs, msgs),
+    TP_STRUCT__entry(
+        __field(int, head)
+        __field(int, tail)
+        __field(int, regs)
+        __field(int, msgs)
+    ),
+    TP_fast_assign(
+        __entry->head = head;
+        __entry->tail = tail;
+        __entry->regs = regs;
+        __entry->msgs = msgs;
+    ),
+    TP_printk("head=%d tail=%d regs=%d msgs=%d", __entry->head, __entry->tail, __entry->regs, __entry->msgs)
+);
+
+/* 门铃：tx为1表示向对方发出，为0表示收到对方的中断 */
+TRACE_EVENT(mailbox_csr_doorbell,
+    TP_PROTO(bool tx, u64 csr),
+    TP_ARGS(tx, csr),
+    TP_STRUCT__entry(
+        __field(bool, tx)
+        __field(u64, csr)
+    ),
+    TP_fast_assign(
+        __entry->tx = tx;
+        __entry->csr = csr;
+    ),
+    TP_printk("%s csr=%#llx", __entry->tx ? "tx" : "rx", __entry->csr)
+);
+
+/* 对方接收区满时发送方的空转，在空转结束时记录一次 */
+TRACE_EVENT(mailbox_ring_full_spin,
+    TP_PROTO(u64 spins, s64 wait_ns),
+    TP_ARGS(spins, wait_ns),
+    TP_STRUCT__entry(
+        __field(u64, spins)
+        __field(s64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->spins = spins;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("spins=%llu wait_ns=%lld", __entry->spins, __entry->wait_ns)
+);
+
+#endif /* _SW_MAILBOX_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sw_mailbox_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,138 @@
+/*
+ * 多生产者单消费者的发送提交环：每个写者以cmpxchg在环中预留一个条目，在条目中直接组帧，
+ * 写完后以release写条目头提交；同一时刻只有一个消费者按预留顺序取出已提交的条目写进寄存器环。
+ * 预留顺序就是发送顺序，后预留的条目先写完时要等前面的条目提交。
+ *
+ * 条目：头一个字为条目头，之后为若干完整分片的寄存器。条目头为0表示还未提交，
+ * 消费者取出后把用过的字清零，环中未提交的位置总是0。条目头中可以带一个提交时刻的戳，
+ * 消费者开始取一个条目时放在entry_stamp中，供使用者统计排队时间。
+ *
+ * 内核驱动与用户态模拟器（emu/）共用，使用者需要先提供READ_ONCE、cmpxchg、smp_load_acquire与smp_store_release。
+ */
+#ifndef _SW_MAILBOX_TXQ_H
+#define _SW_MAILBOX_TXQ_H
+
+#define MAILBOX_TXQ_COMMIT (1ull << 63)  /* 条目已提交 */
+#define MAILBOX_TXQ_DISCARD (1ull << 62) /* 组帧失败的条目，消费者直接跳过 */
+#define MAILBOX_TXQ_WORDS(hdr) ((unsigned long)((hdr) & 0xffffffff))
+#define MAILBOX_TXQ_STAMP_MASK 0x3fffffffu
+#define MAILBOX_TXQ_STAMP(hdr) ((uint32_t)((hdr) >> 32) & MAILBOX_TXQ_STAMP_MASK)
+
+struct mailbox_txq
+{
+    uint64_t *words;
+    unsigned long size;       /* 字数，2的幂 */
+    unsigned long prod;       /* 已预留到的位置，生产者以cmpxchg推进 */
+    unsigned long cons;       /* 已取出到的位置，只有消费者写 */
+    unsigned long entry_left; /* 当前条目还未取出的字数，只有消费者访问 */
+    uint32_t entry_stamp;     /* 当前条目提交时的戳，只有消费者访问 */
+};
+
+static inline uint64_t *mailbox_txq_word(const struct mailbox_txq *q, unsigned long pos)
+{
+    return &q->words[pos & (q->size - 1)];
+}
+
+/* 已预留的字数，含还未提交的条目 */
+static inline unsigned long mailbox_txq_used(const struct mailbox_txq *q)
+{
+    return READ_ONCE(q->prod) - smp_load_acquire(&q->cons);
+}
+
+static inline unsigned long mailbox_txq_avail(const struct mailbox_txq *q)
+{
+    return q->size - mailbox_txq_used(q);
+}
+
+/* 预留一个words个寄存器的条目（另加一个条目头），空间不够时返回false，*pos为条目头的位置 */
+static inline bool mailbox_txq_reserve(struct mailbox_txq *q, unsigned long words, unsigned long *pos)
+{
+    unsigned long head, cons;
+
+    do
+    {
+        head = READ_ONCE(q->prod);
+        cons = smp_load_acquire(&q->cons);
+        if (head - cons + 1 + words > q->size)
+            return false;
+    } while (cmpxchg(&q->prod, head, head + 1 + words) != head);
+    *pos = head;
+    return true;
+}
+
+/* 从pos开始写入count个字，可以跨越环尾 */
+static inline void mailbox_txq_put(struct mailbox_txq *q, unsigned long pos, const uint64_t *src, unsigned long count)
+{
+    unsigned long off = pos & (q->size - 1);
+    unsigned long first = count < q->size - off ? count : q->size - off;
+
+    memcpy(&q->words[off], src, first * sizeof(uint64_t));
+    memcpy(q->words, src + first, (count - first) * sizeof(uint64_t));
+}
+
+/* 条目中的寄存器全部写好后提交，discard时消费者跳过整个条目，stamp为使用者自己定义的提交时刻 */
+static inline void mailbox_txq_commit_stamp(struct mailbox_txq *q, unsigned long pos, unsigned long words, bool discard,
+                                            uint32_t stamp)
+{
+    smp_store_release(mailbox_txq_word(q, pos), MAILBOX_TXQ_COMMIT | (discard ? MAILBOX_TXQ_DISCARD : 0) |
+                                                    (uint64_t)(stamp & MAILBOX_TXQ_STAMP_MASK) << 32 | words);
+}
+
+static inline void mailbox_txq_commit(struct mailbox_txq *q, unsigned long pos, unsigned long words, bool discard)
+{
+    mailbox_txq_commit_stamp(q, pos, words, discard, 0);
+}
+
+/* 把[pos, pos + count)清零后推进cons，之后生产者才能重用这些位置 */
+static inline void mailbox_txq_release(struct mailbox_txq *q, unsigned long count)
+{
+    unsigned long off = q->cons & (q->size - 1);
+    unsigned long first = count < q->size - off ? count : q->size - off;
+
+    memset(&q->words[off], 0, first * sizeof(uint64_t));
+    memset(q->words, 0, (count - first) * sizeof(uint64_t));
+    smp_store_release(&q->cons, q->cons + count);
+}
+
+/* 消费者：下一个分片的帧头，队首的条目还未提交时返回false */
+static inline bool mailbox_txq_peek(struct mailbox_txq *q, uint64_t *hdr)
+{
+    uint64_t entry;
+
+    while (q->entry_left == 0)
+    {
+        if (q->cons == READ_ONCE(q->prod))
+            return false;
+        entry = smp_load_acquire(mailbox_txq_word(q, q->cons));
+        if (!(entry & MAILBOX_TXQ_COMMIT))
+            return false;
+        if (entry & MAILBOX_TXQ_DISCARD)
+        {
+            mailbox_txq_release(q, 1 + MAILBOX_TXQ_WORDS(entry));
+            continue;
+        }
+        q->entry_left = MAILBOX_TXQ_WORDS(entry);
+        q->entry_stamp = MAILBOX_TXQ_STAMP(entry);
+        mailbox_txq_release(q, 1);
+    }
+    *hdr = *mailbox_txq_word(q, q->cons);
+    return true;
+}
+
+/* 消费者：从当前条目取出至多n个字，不会越过条目的末尾，返回取出的字数 */
+static inline unsigned int mailbox_txq_out(struct mailbox_txq *q, uint64_t *dst, unsigned int n)
+{
+    unsigned long off = q->cons & (q->size - 1);
+    unsigned long first;
+
+    if (n > q->entry_left)
+        n = q->entry_left;
+    first = n < q->size - off ? n : q->size - off;
+    memcpy(dst, &q->words[off], first * sizeof(uint64_t));
+    memcpy(dst + first, q->words, (n - first) * sizeof(uint64_t));
+    q->entry_left -= n;
+    mailbox_txq_release(q, n);
+    return n;
+}
+
+#endif /* _SW_MAILBOX_TXQ_H */
@@ -12,22 +12,29 @@ int main()
     int fd; // 文件描述符
 
     // 打开设备文件
-    fd = open("/dev/sw_mailbox", O_RDWR);
+    fd = open("/dev/sw_mailbox/ch0", O_RDWR);
     if (fd == -1) {
-        printf("mailbox_test: cannot open /dev/sw_mailbox");
+        printf("mailbox_test: cannot open /dev/sw_mailbox/ch0");
         return 1;
     }
 
-    int size[TEST_N];
+    // 每轮的消息字节数，最大的一轮正好填满msg的一行；延迟与吞吐见mailbox_bench
+    int size[TEST_N] = {8, 64, 512, 4096, 1024 * sizeof(uint64_t)};
     int test_n,i;
-    uint64_t msg[TEST_N][1024];
-
-
+    static uint64_t msg[TEST_N][1024];
 
     for(test_n = 0; test_n < TEST_N; ++test_n){
+        for (i = 0; i < 1024; ++i) {
+            msg[test_n][i] = ((uint64_t)test_n << 32) | i;
+        }
         int bytesWritten = write(fd, (const void *)&(msg[test_n]), size[test_n]);
+        if (bytesWritten != size[test_n]) {
+            printf("mailbox_test: write of %d bytes failed!\n", size[test_n]);
+            close(fd);
+            return 1;
+        }
     }
-    
+
     // 关闭设备文件
     close(fd);
 
@@ -0,0 +1,518 @@
+/*
+ * 通过/dev/sw_mailbox/chN测量整条路径（syscall → MMIO → IRQ → read()）：
+ *   stream   单向流式发送，以发送队列排空为结束，统计bytes/s与每次write()的耗时
+ *   pingpong 每次只有一条消息在途，写一条、读回一条，统计往返延迟
+ *   bidir    写线程与读线程同时工作，在途消息数不超过窗口，统计双向bytes/s与每条消息从写入到读回的延迟
+ *   sweep    对一组消息大小依次跑以上三种
+ * pingpong与bidir需要对端回显：ASP端驱动以echo特性编译（或调用set_echo），或者加载sw_mailbox-fake.ko mode=echo。
+ * stream时对端回显的消息由一个线程读出丢弃。-j以JSON输出全部结果，便于比较不同版本驱动。
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#include "../sw_mailbox.h"
+
+#define BENCH_MAX_SIZES 32
+#define BENCH_MAX_RESULTS 128
+#define BENCH_MAX_SAMPLES (1 << 20)
+#define BENCH_HIST_BUCKETS 40 /* 以2的幂划分的纳秒区间，最大约550秒 */
+#define BENCH_RX_TIMEOUT_MS 2000
+
+enum bench_mode
+{
+    BENCH_STREAM = 1,
+    BENCH_PINGPONG = 2,
+    BENCH_BIDIR = 4,
+};
+
+/* 一组延迟样本：分位数取自排序后的样本，直方图覆盖全部样本 */
+struct bench_lat
+{
+    uint64_t *samples;
+    uint64_t n;
+    uint64_t max;
+    double sum;
+    uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+struct bench_result
+{
+    const char *mode;
+    size_t size;
+    uint64_t msgs;
+    uint64_t errors; /* 内容不符或超时未读回的消息数 */
+    double secs;
+    double tx_bytes_per_sec;
+    double rx_bytes_per_sec;
+    uint64_t p50, p99, p999, max, mean;
+    uint64_t hist[BENCH_HIST_BUCKETS];
+};
+
+static const char *dev_path = "/dev/sw_mailbox/ch0";
+static struct bench_result results[BENCH_MAX_RESULTS];
+static unsigned int nresults;
+static bool json;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lat_init(struct bench_lat *lat, uint64_t count)
+{
+    memset(lat, 0, sizeof(*lat));
+    lat->samples = malloc((count < BENCH_MAX_SAMPLES ? count : BENCH_MAX_SAMPLES) * sizeof(uint64_t));
+    if (!lat->samples)
+    {
+        perror("mailbox_bench: malloc");
+        exit(1);
+    }
+}
+
+static void lat_add(struct bench_lat *lat, uint64_t ns)
+{
+    unsigned int b = 0;
+
+    while (b + 1 < BENCH_HIST_BUCKETS && (ns >> (b + 1)))
+        b++;
+    lat->hist[b]++;
+    if (lat->n < BENCH_MAX_SAMPLES)
+        lat->samples[lat->n] = ns;
+    lat->n++;
+    lat->sum += ns;
+    if (ns > lat->max)
+        lat->max = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 排序样本后填入分位数与直方图，释放样本 */
+static void lat_finish(struct bench_lat *lat, struct bench_result *r)
+{
+    uint64_t n = lat->n < BENCH_MAX_SAMPLES ? lat->n : BENCH_MAX_SAMPLES;
+
+    if (n)
+    {
+        qsort(lat->samples, n, sizeof(uint64_t), cmp_u64);
+        r->p50 = lat->samples[(uint64_t)(0.50 * (n - 1) + 0.5)];
+        r->p99 = lat->samples[(uint64_t)(0.99 * (n - 1) + 0.5)];
+        r->p999 = lat->samples[(uint64_t)(0.999 * (n - 1) + 0.5)];
+        r->mean = lat->sum / lat->n;
+    }
+    r->max = lat->max;
+    memcpy(r->hist, lat->hist, sizeof(r->hist));
+    free(lat->samples);
+}
+
+static struct bench_result *result_add(const char *mode, size_t size)
+{
+    struct bench_result *r;
+
+    if (nresults == BENCH_MAX_RESULTS)
+    {
+        fprintf(stderr, "mailbox_bench: too many results\n");
+        exit(1);
+    }
+    r = &results[nresults++];
+    memset(r, 0, sizeof(*r));
+    r->mode = mode;
+    r->size = size;
+    return r;
+}
+
+static int open_dev(void)
+{
+    int fd = open(dev_path, O_RDWR);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "mailbox_bench: cannot open %s: %s\n", dev_path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+/* 消息的前8字节为序号，之后由序号推出的字节填充，接收方据此检查内容 */
+static void fill_msg(uint8_t *buf, size_t size, uint64_t seq)
+{
+    size_t i;
+
+    memcpy(buf, &seq, size < sizeof(seq) ? size : sizeof(seq));
+    for (i = sizeof(seq); i < size; ++i)
+        buf[i] = (uint8_t)(seq + i);
+}
+
+static bool check_msg(const uint8_t *buf, ssize_t len, size_t size, uint64_t *seq)
+{
+    size_t i;
+
+    if (len != (ssize_t)size)
+        return false;
+    *seq = 0;
+    memcpy(seq, buf, size < sizeof(*seq) ? size : sizeof(*seq));
+    for (i = sizeof(*seq); i < size; ++i)
+        if (buf[i] != (uint8_t)(*seq + i))
+            return false;
+    return true;
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t size)
+{
+    if (write(fd, buf, size) != (ssize_t)size)
+    {
+        fprintf(stderr, "mailbox_bench: write of %zu bytes failed: %s\n", size, strerror(errno));
+        exit(1);
+    }
+}
+
+/* 等待消息可读，超时返回false */
+static bool wait_readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN);
+}
+
+/* stream时读出并丢弃对端回显的消息，直到stop置位 */
+struct drain_arg
+{
+    int fd;
+    size_t size;
+    volatile bool stop;
+};
+
+static void *drain_thread(void *p)
+{
+    struct drain_arg *a = p;
+    uint8_t *buf = malloc(a->size ? a->size : 1);
+
+    while (!a->stop)
+        if (wait_readable(a->fd, 100) && read(a->fd, buf, a->size ? a->size : 1) < 0 && errno != EAGAIN)
+            break;
+    free(buf);
+    return NULL;
+}
+
+static void bench_stream(size_t size, uint64_t count)
+{
+    struct bench_result *r = result_add("stream", size);
+    struct mailbox_status st;
+    struct drain_arg drain = {.size = size};
+    struct bench_lat lat;
+    pthread_t thread;
+    uint8_t *buf = malloc(size ? size : 1);
+    uint64_t i, t0, t;
+
+    drain.fd = open_dev();
+    pthread_create(&thread, NULL, drain_thread, &drain);
+    lat_init(&lat, count);
+    t0 = now_ns();
+    for (i = 0; i < count; ++i)
+    {
+        fill_msg(buf, size, i);
+        t = now_ns();
+        write_all(drain.fd, buf, size);
+        lat_add(&lat, now_ns() - t);
+    }
+    // 合并中的小消息立即发出，发送队列排空即对端已收下全部消息
+    ioctl(drain.fd, MAILBOX_IOC_FLUSH);
+    while (ioctl(drain.fd, MAILBOX_IOC_STATUS, &st) == 0 && st.tx_queued)
+        sched_yield();
+    r->secs = (now_ns() - t0) / 1e9;
+    r->msgs = count;
+    r->tx_bytes_per_sec = count * size / r->secs;
+    lat_finish(&lat, r);
+
+    drain.stop = true;
+    pthread_join(thread, NULL);
+    close(drain.fd);
+    free(buf);
+}
+
+static void bench_pingpong(size_t size, uint64_t count)
+{
+    struct bench_result *r = result_add("pingpong", size);
+    uint8_t *tx = malloc(size ? size : 1), *rx = malloc(size ? size : 1);
+    struct bench_lat lat;
+    uint64_t i, seq, t0, t;
+    ssize_t len;
+    int fd = open_dev();
+
+    lat_init(&lat, count);
+    t0 = now_ns();
+    for (i = 0; i < count; ++i)
+    {
+        fill_msg(tx, size, i);
+        t = now_ns();
+        write_all(fd, tx, size);
+        if (!wait_readable(fd, BENCH_RX_TIMEOUT_MS))
+        {
+            r->errors += count - i;
+            break;
+        }
+        len = read(fd, rx, size ? size : 1);
+        lat_add(&lat, now_ns() - t);
+        // 不足8字节的消息只带序号的低位，不检查序号
+        if (!check_msg(rx, len, size, &seq) || (size >= sizeof(seq) && seq != i))
+            r->errors++;
+    }
+    r->secs = (now_ns() - t0) / 1e9;
+    r->msgs = i;
+    r->tx_bytes_per_sec = r->rx_bytes_per_sec = i * size / r->secs;
+    lat_finish(&lat, r);
+    close(fd);
+    free(tx);
+    free(rx);
+}
+
+/* bidir的写线程：发送时间记在sent_ns[序号]中，在途消息数达到窗口时等待读线程 */
+struct bidir_arg
+{
+    int fd;
+    size_t size;
+    uint64_t count;
+    uint64_t window;
+    uint64_t *sent_ns;
+    volatile uint64_t received;
+};
+
+static void *bidir_writer(void *p)
+{
+    struct bidir_arg *a = p;
+    uint8_t *buf = malloc(a->size);
+    uint64_t i;
+
+    for (i = 0; i < a->count; ++i)
+    {
+        while (i - __atomic_load_n(&a->received, __ATOMIC_ACQUIRE) >= a->window)
+            sched_yield();
+        fill_msg(buf, a->size, i);
+        a->sent_ns[i] = now_ns();
+        write_all(a->fd, buf, a->size);
+    }
+    free(buf);
+    return NULL;
+}
+
+static void bench_bidir(size_t size, uint64_t count, uint64_t window)
+{
+    struct bench_result *r = result_add("bidir", size);
+    struct bidir_arg a = {.size = size < sizeof(uint64_t) ? sizeof(uint64_t) : size, .count = count, .window = window};
+    struct bench_lat lat;
+    pthread_t thread;
+    uint8_t *buf;
+    uint64_t i, seq, t0;
+    ssize_t len;
+
+    // 回显的消息按序号匹配发送时间，消息至少要放得下序号
+    r->size = a.size;
+    buf = malloc(a.size);
+    a.sent_ns = calloc(count, sizeof(uint64_t));
+    a.fd = open_dev();
+    lat_init(&lat, count);
+    t0 = now_ns();
+    pthread_create(&thread, NULL, bidir_writer, &a);
+    for (i = 0; i < count; ++i)
+    {
+        if (!wait_readable(a.fd, BENCH_RX_TIMEOUT_MS))
+        {
+            // 丢失的回显让写线程永远等不到窗口，记为错误后放行
+            r->errors += count - i;
+            __atomic_store_n(&a.received, count, __ATOMIC_RELEASE);
+            break;
+        }
+        len = read(a.fd, buf, a.size);
+        if (check_msg(buf, len, a.size, &seq) && seq < count)
+            lat_add(&lat, now_ns() - a.sent_ns[seq]);
+        else
+            r->errors++;
+        __atomic_store_n(&a.received, i + 1, __ATOMIC_RELEASE);
+    }
+    r->secs = (now_ns() - t0) / 1e9;
+    pthread_join(thread, NULL);
+    r->msgs = i;
+    r->tx_bytes_per_sec = count * a.size / r->secs;
+    r->rx_bytes_per_sec = i * a.size / r->secs;
+    lat_finish(&lat, r);
+    close(a.fd);
+    free(a.sent_ns);
+    free(buf);
+}
+
+static void print_text(void)
+{
+    unsigned int i;
+
+    printf("%8s %10s %10s %8s %12s %12s %10s %10s %10s %10s\n", "mode", "size", "msgs", "errors", "tx_MiB/s", "rx_MiB/s",
+           "p50_us", "p99_us", "p999_us", "max_us");
+    for (i = 0; i < nresults; ++i)
+    {
+        struct bench_result *r = &results[i];
+        printf("%8s %10zu %10llu %8llu %12.2f %12.2f %10.2f %10.2f %10.2f %10.2f\n", r->mode, r->size,
+               (unsigned long long)r->msgs, (unsigned long long)r->errors, r->tx_bytes_per_sec / (1 << 20),
+               r->rx_bytes_per_sec / (1 << 20), r->p50 / 1000.0, r->p99 / 1000.0, r->p999 / 1000.0, r->max / 1000.0);
+    }
+}
+
+/* 驱动模块的srcversion，用来区分被测的驱动版本 */
+static void read_srcversion(char *buf, size_t len)
+{
+    FILE *f = fopen("/sys/module/sw_mailbox/srcversion", "r");
+
+    buf[0] = '\0';
+    if (f)
+    {
+        if (fgets(buf, len, f))
+            buf[strcspn(buf, "\n")] = '\0';
+        fclose(f);
+    }
+}
+
+static void print_json(void)
+{
+    struct utsname uts;
+    char srcversion[64];
+    unsigned int i, b;
+    bool first;
+
+    uname(&uts);
+    read_srcversion(srcversion, sizeof(srcversion));
+    printf("{\"device\":\"%s\",\"kernel\":\"%s\",\"driver_srcversion\":\"%s\",\"time\":%lld,\"results\":[", dev_path,
+           uts.release, srcversion, (long long)time(NULL));
+    for (i = 0; i < nresults; ++i)
+    {
+        struct bench_result *r = &results[i];
+        printf("%s\n{\"mode\":\"%s\",\"size\":%zu,\"msgs\":%llu,\"errors\":%llu,\"secs\":%.6f,"
+               "\"tx_bytes_per_sec\":%.0f,\"rx_bytes_per_sec\":%.0f,"
+               "\"latency_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%llu},\"histogram\":[",
+               i ? "," : "", r->mode, r->size, (unsigned long long)r->msgs, (unsigned long long)r->errors, r->secs,
+               r->tx_bytes_per_sec, r->rx_bytes_per_sec, (unsigned long long)r->p50, (unsigned long long)r->p99,
+               (unsigned long long)r->p999, (unsigned long long)r->max, (unsigned long long)r->mean);
+        // 只输出非空的区间，le_ns为区间的上界
+        for (b = 0, first = true; b < BENCH_HIST_BUCKETS; ++b)
+        {
+            if (!r->hist[b])
+                continue;
+            printf("%s{\"le_ns\":%llu,\"count\":%llu}", first ? "" : ",", 1ull << (b + 1), (unsigned long long)r->hist[b]);
+            first = false;
+        }
+        printf("]}");
+    }
+    printf("\n]}\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mailbox_bench [-d dev] [-m stream|pingpong|bidir|sweep] [-n count] [-b budget_mb] [-w window] [-j] [size...]\n"
+                    "  -d  device node (default /dev/sw_mailbox/ch0)\n"
+                    "  -m  one-way streaming, request/response round trips, both directions at once,\n"
+                    "      or all three over 8 B to 64 KiB (default: sweep)\n"
+                    "  -n  messages per run (default: budget / size for stream and bidir, 10000 for pingpong)\n"
+                    "  -b  bytes per stream or bidir run in MiB when -n is not given (default 64)\n"
+                    "  -w  messages in flight in bidir mode (default: as many as fit in 256 KiB)\n"
+                    "  -j  print all results as one JSON object\n"
+                    "pingpong and bidir need a peer that echoes every message back.\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sweep_sizes[] = {8, 64, 512, 4096, 16384, 65536};
+    size_t sizes[BENCH_MAX_SIZES], nsizes = 0, i;
+    uint64_t count = 0, budget = 64ull << 20, window = 0, n, w;
+    int modes = BENCH_STREAM | BENCH_PINGPONG | BENCH_BIDIR;
+    bool sweep = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:m:n:b:w:jh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dev_path = optarg;
+            break;
+        case 'm':
+            sweep = strcmp(optarg, "sweep") == 0;
+            if (strcmp(optarg, "stream") == 0)
+                modes = BENCH_STREAM;
+            else if (strcmp(optarg, "pingpong") == 0)
+                modes = BENCH_PINGPONG;
+            else if (strcmp(optarg, "bidir") == 0)
+                modes = BENCH_BIDIR;
+            else if (!sweep)
+                usage();
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            budget = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'w':
+            window = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    for (; optind < argc && nsizes < BENCH_MAX_SIZES; ++optind)
+        sizes[nsizes++] = strtoull(argv[optind], NULL, 0);
+    if (nsizes == 0 && sweep)
+    {
+        memcpy(sizes, sweep_sizes, sizeof(sweep_sizes));
+        nsizes = sizeof(sweep_sizes) / sizeof(sweep_sizes[0]);
+    }
+    else if (nsizes == 0)
+    {
+        sizes[nsizes++] = 4096;
+    }
+
+    for (i = 0; i < nsizes; ++i)
+    {
+        n = count;
+        if (n == 0)
+        {
+            n = budget / (sizes[i] ? sizes[i] : 1);
+            n = n < 100 ? 100 : n > 200000 ? 200000 : n;
+        }
+        w = window ? window : (256 << 10) / (sizes[i] ? sizes[i] : 1);
+        w = w < 1 ? 1 : w;
+        if (modes & BENCH_STREAM)
+            bench_stream(sizes[i], n);
+        if (modes & BENCH_PINGPONG)
+            bench_pingpong(sizes[i], count ? count : 10000);
+        if (modes & BENCH_BIDIR)
+            bench_bidir(sizes[i], n, w);
+        if (!json)
+            fprintf(stderr, "mailbox_bench: %zu bytes done\n", sizes[i]);
+    }
+    if (json)
+        print_json();
+    else
+        print_text();
+
+    for (i = 0; i < nresults; ++i)
+        if (results[i].errors)
+            return 1;
+    return 0;
+}
@@ -10,9 +10,9 @@ int main()
     int fd; // 文件描述符
 
     // 打开设备文件
-    fd = open("/dev/sw_mailbox", O_RDWR);
+    fd = open("/dev/sw_mailbox/ch0", O_RDWR);
     if (fd == -1) {
-        printf("mailbox_test: cannot open /dev/sw_mailbox");
+        printf("mailbox_test: cannot open /dev/sw_mailbox/ch0");
         return 1;
     }
 
@@ -25,7 +25,7 @@ int main()
         scanf("%llx", &msg[i]);
     }
 
-    int bytesWritten = write(fd, (const void *)&msg, size);
+    int bytesWritten = write(fd, (const void *)&msg, size * sizeof(uint64_t)); // 驱动按字节数计长度
     if (bytesWritten < 0) {
         printf("mailbox_test: write failed!");
         close(fd);